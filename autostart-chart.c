@@ -0,0 +1,492 @@
+/**
+ * Copyright (c) 2011-2013 Fabrice THIROUX <fabrice.thiroux@free.fr> (GPL-3+).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or any
+ * later version. See http://www.gnu.org/copyleft/gpl.html the full text
+ * of the license.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+/* Boot chart of xdg-autostart: when each program was started, when it
+ * gave its slot back, when its first window was mapped and when it
+ * exited. Saved in $XDG_RUNTIME_DIR/obsession as JSON and SVG, and as a
+ * GVariant for "xdg-autostart --report".
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <glib-unix.h>
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+
+#include "autostart-chart.h"
+#include "x-session.h"
+
+/* desktop, start (real time, µs), then per entry: id, command, and in ms
+ * from the start: started, settled, mapped, exited (-1 if not), exit
+ * status (-1 if not exited) and the index of the entry it waited for. */
+#define CHART_TYPE "(sxa(ssxxxxii))"
+
+#define ROW_HEIGHT 20
+#define LABEL_WIDTH 220
+#define MS_PER_PIXEL 10
+
+static struct {
+	Display *display;
+	Atom client_list;
+	GPtrArray *entries;
+	void (*mapped) (Entry *, Display *, Window);
+} chart;
+
+static int ignore_errors (Display *display, XErrorEvent *event)
+{
+	return 0;
+}
+
+static gchar *chart_pathname (const gchar *extension)
+{
+	gchar *basename = g_strconcat ("autostart-chart.", extension, NULL);
+	gchar *pathname = g_build_filename (g_get_user_runtime_dir (), "obsession", basename, NULL);
+
+	g_free (basename);
+	return pathname;
+}
+
+static pid_t parent_pid (pid_t pid)
+{
+	gchar *pathname = g_strdup_printf ("/proc/%d/stat", pid);
+	gchar *content = NULL, *p;
+	int ppid = 0;
+
+	/* The command name may hold spaces and parenthesis, skip it all. */
+	if (g_file_get_contents (pathname, &content, NULL, NULL) && (p = strrchr (content, ')')))
+		sscanf (p + 1, " %*c %d", &ppid);
+
+	g_free (content);
+	g_free (pathname);
+	return ppid;
+}
+
+/* The entry that started pid, directly or not. */
+static Entry *chart_find (pid_t pid)
+{
+	guint i;
+
+	for (; pid > 1; pid = parent_pid (pid))
+	{
+		for (i = 0; i < chart.entries->len; i++)
+		{
+			Entry *entry = g_ptr_array_index (chart.entries, i);
+
+			if (entry->pid == pid)
+				return entry;
+		}
+	}
+	return NULL;
+}
+
+static void chart_window (Window window)
+{
+	pid_t pid = x_get_pid (chart.display, window);
+	Entry *entry;
+
+	/* A reparenting window manager maps its frame, the client is inside. */
+	if (pid == 0)
+	{
+		Window root, parent, *children = NULL;
+		unsigned int count, i;
+
+		if (XQueryTree (chart.display, window, &root, &parent, &children, &count))
+		{
+			for (i = 0; i < count && pid == 0; i++)
+			{
+				pid = x_get_pid (chart.display, children[i]);
+				window = children[i];
+			}
+			if (children)
+				XFree (children);
+		}
+	}
+
+	if (pid == 0 || (entry = chart_find (pid)) == NULL)
+		return;
+
+	if (!entry->mapped)
+	{
+		entry->mapped = g_get_monotonic_time ();
+		g_debug ("%s mapped a window after %" G_GINT64_FORMAT " ms", entry->id,
+		         (entry->mapped - entry->started) / G_TIME_SPAN_MILLISECOND);
+	}
+	chart.mapped (entry, chart.display, window);
+}
+
+static gboolean chart_x_event (gint fd, GIOCondition condition, gpointer data)
+{
+	while (XPending (chart.display))
+	{
+		XEvent event;
+
+		XNextEvent (chart.display, &event);
+		if (event.type == MapNotify)
+			chart_window (event.xmap.window);
+		else if (event.type == PropertyNotify && event.xproperty.atom == chart.client_list)
+		{
+			gulong count, i;
+			Window *clients = x_get_clients (chart.display, &count);
+
+			for (i = 0; i < count; i++)
+				chart_window (clients[i]);
+			g_free (clients);
+		}
+	}
+	return TRUE;
+}
+
+/* Watch the windows mapped on the screen, mapped is called for each window
+ * of the entries (maybe more than once). */
+gboolean chart_watch (GPtrArray *entries, void (*mapped) (Entry *, Display *, Window))
+{
+	chart.entries = entries;
+	chart.mapped = mapped;
+
+	chart.display = XOpenDisplay (NULL);
+	if (chart.display == NULL)
+	{
+		g_warning ("Can't open the display, no window times");
+		return FALSE;
+	}
+
+	XSetErrorHandler (ignore_errors);
+	chart.client_list = XInternAtom (chart.display, "_NET_CLIENT_LIST", False);
+	XSelectInput (chart.display, DefaultRootWindow (chart.display), SubstructureNotifyMask | PropertyChangeMask);
+	XFlush (chart.display);
+
+	g_unix_fd_add (ConnectionNumber (chart.display), G_IO_IN, chart_x_event, NULL);
+	return TRUE;
+}
+
+/* Every program showed a window or exited: nothing more to learn. */
+gboolean chart_complete (GPtrArray *entries)
+{
+	guint i;
+
+	for (i = 0; i < entries->len; i++)
+	{
+		Entry *entry = g_ptr_array_index (entries, i);
+
+		if (!entry->mapped && !entry->exited)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static gint64 since (gint64 start, gint64 time)
+{
+	return time ? (time - start) / G_TIME_SPAN_MILLISECOND : -1;
+}
+
+/* When the program was ready: first window, exit or end of its slot. */
+static gint64 ready_time (gint64 settled, gint64 mapped, gint64 exited)
+{
+	if (mapped >= 0)
+		return mapped;
+	if (exited >= 0)
+		return exited;
+	return settled;
+}
+
+static void json_string (GString *out, const gchar *string)
+{
+	const gchar *p;
+
+	g_string_append_c (out, '"');
+	for (p = string; *p; p++)
+	{
+		if (*p == '"' || *p == '\\')
+			g_string_append_printf (out, "\\%c", *p);
+		else if ((guchar) *p < 0x20)
+			g_string_append_printf (out, "\\u%04x", *p);
+		else
+			g_string_append_c (out, *p);
+	}
+	g_string_append_c (out, '"');
+}
+
+static void json_time (GString *out, const gchar *key, gint64 value)
+{
+	if (value >= 0)
+		g_string_append_printf (out, ", \"%s\": %" G_GINT64_FORMAT, key, value);
+	else
+		g_string_append_printf (out, ", \"%s\": null", key);
+}
+
+static gchar *chart_json (GVariant *data)
+{
+	GString *out = g_string_new ("{\"desktop\": ");
+	const gchar *desktop, *id, *command;
+	gint64 start, started, settled, mapped, exited;
+	gint status, after;
+	GVariantIter *iter;
+	gboolean first = TRUE;
+
+	g_variant_get (data, "(&sxa(ssxxxxii))", &desktop, &start, &iter);
+	json_string (out, desktop);
+	g_string_append_printf (out, ", \"start\": %" G_GINT64_FORMAT ", \"entries\": [", start);
+
+	while (g_variant_iter_next (iter, "(&s&sxxxxii)", &id, &command, &started, &settled, &mapped, &exited, &status, &after))
+	{
+		g_string_append (out, first ? "\n  {\"id\": " : ",\n  {\"id\": ");
+		json_string (out, id);
+		g_string_append (out, ", \"command\": ");
+		json_string (out, command);
+		json_time (out, "started", started);
+		json_time (out, "settled", settled);
+		json_time (out, "mapped", mapped);
+		json_time (out, "exited", exited);
+		json_time (out, "status", status);
+		json_time (out, "after", after);
+		g_string_append_c (out, '}');
+		first = FALSE;
+	}
+	g_string_append (out, "\n]}\n");
+
+	g_variant_iter_free (iter);
+	return g_string_free (out, FALSE);
+}
+
+/* One row per entry: the slot it held, then the wait for its window. */
+static gchar *chart_svg (GVariant *data)
+{
+	GString *out = g_string_new (NULL);
+	GVariant *children;
+	const gchar *id, *command;
+	gint64 started, settled, mapped, exited, end = 0;
+	gint status, after, row = 0;
+	GVariantIter *iter;
+	gsize n;
+
+	g_variant_get (data, "(&sxa(ssxxxxii))", NULL, NULL, &iter);
+	while (g_variant_iter_next (iter, "(&s&sxxxxii)", &id, &command, &started, &settled, &mapped, &exited, &status, &after))
+		end = MAX (end, MAX (ready_time (settled, mapped, exited), settled));
+	g_variant_iter_free (iter);
+
+	children = g_variant_get_child_value (data, 2);
+	n = g_variant_n_children (children);
+	g_variant_unref (children);
+	g_string_append_printf (out, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%" G_GINT64_FORMAT "\" height=\"%" G_GSIZE_FORMAT "\" font-family=\"sans-serif\" font-size=\"12\">\n",
+	                        LABEL_WIDTH + end / MS_PER_PIXEL + 60, (n + 1) * ROW_HEIGHT);
+
+	g_variant_get (data, "(&sxa(ssxxxxii))", NULL, NULL, &iter);
+	while (g_variant_iter_next (iter, "(&s&sxxxxii)", &id, &command, &started, &settled, &mapped, &exited, &status, &after))
+	{
+		gint y = row * ROW_HEIGHT;
+		gint64 ready = ready_time (settled, mapped, exited);
+		gchar *label = g_markup_escape_text (id, -1);
+
+		g_string_append_printf (out, "<text x=\"4\" y=\"%d\">%s</text>\n", y + 14, label);
+		g_string_append_printf (out, "<rect x=\"%" G_GINT64_FORMAT "\" y=\"%d\" width=\"%" G_GINT64_FORMAT "\" height=\"%d\" fill=\"#7aa6da\"/>\n",
+		                        LABEL_WIDTH + started / MS_PER_PIXEL, y + 3, MAX (1, (settled - started) / MS_PER_PIXEL), ROW_HEIGHT - 6);
+		if (ready > settled)
+			g_string_append_printf (out, "<rect x=\"%" G_GINT64_FORMAT "\" y=\"%d\" width=\"%" G_GINT64_FORMAT "\" height=\"%d\" fill=\"#b9ca4a\"/>\n",
+			                        LABEL_WIDTH + settled / MS_PER_PIXEL, y + 7, (ready - settled) / MS_PER_PIXEL, ROW_HEIGHT - 14);
+		g_string_append_printf (out, "<text x=\"%" G_GINT64_FORMAT "\" y=\"%d\">%" G_GINT64_FORMAT " ms%s</text>\n",
+		                        LABEL_WIDTH + MAX (ready, settled) / MS_PER_PIXEL + 4, y + 14, ready - started,
+		                        mapped >= 0 ? "" : exited >= 0 ? " (exited)" : " (no window)");
+		g_free (label);
+		row++;
+	}
+	g_variant_iter_free (iter);
+
+	g_string_append (out, "</svg>\n");
+	return g_string_free (out, FALSE);
+}
+
+static void chart_write (const gchar *extension, const gchar *content, gsize length)
+{
+	gchar *pathname = chart_pathname (extension);
+	GError *error = NULL;
+
+	if (!g_file_set_contents (pathname, content, length, &error))
+	{
+		g_warning ("Can't save the chart: %s", error->message);
+		g_error_free (error);
+	}
+	g_free (pathname);
+}
+
+/* Save the chart of entries, started from start (monotonic time). */
+void chart_save (const gchar *desktop, gint64 start, GPtrArray *entries)
+{
+	GVariantBuilder builder;
+	GVariant *data;
+	gchar *dirname, *content;
+	guint i;
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssxxxxii)"));
+	for (i = 0; i < entries->len; i++)
+	{
+		Entry *entry = g_ptr_array_index (entries, i);
+		gchar *command = g_strjoinv (" ", entry->argv);
+
+		g_variant_builder_add (&builder, "(ssxxxxii)", entry->id, command,
+		                       since (start, entry->started), since (start, entry->settled_at),
+		                       since (start, entry->mapped), since (start, entry->exited),
+		                       entry->exited ? entry->status : -1,
+		                       entry->after ? entry->after->index : -1);
+		g_free (command);
+	}
+	data = g_variant_ref_sink (g_variant_new ("(sxa(ssxxxxii))", desktop,
+	                                          g_get_real_time () - (g_get_monotonic_time () - start), &builder));
+
+	dirname = g_build_filename (g_get_user_runtime_dir (), "obsession", NULL);
+	g_mkdir_with_parents (dirname, 0700);
+	g_free (dirname);
+
+	chart_write ("gvariant", g_variant_get_data (data), g_variant_get_size (data));
+	content = chart_json (data);
+	chart_write ("json", content, -1);
+	g_free (content);
+	content = chart_svg (data);
+	chart_write ("svg", content, -1);
+	g_free (content);
+
+	g_variant_unref (data);
+}
+
+typedef struct {
+	const gchar *id;
+	gint64 cost;
+	const gchar *why;
+} Cost;
+
+static gint cost_compare (gconstpointer a, gconstpointer b)
+{
+	const Cost *ca = a, *cb = b;
+
+	return ca->cost < cb->cost ? 1 : ca->cost > cb->cost ? -1 : 0;
+}
+
+/* Print the last chart. The login is over when the last program is ready;
+ * the critical path leads to it through the slots each program waited for:
+ * an entry on it delayed the login by the time it kept its slot (or until
+ * ready, for the last one). */
+gboolean chart_report (void)
+{
+	gchar *pathname = chart_pathname ("gvariant");
+	GMappedFile *file = g_mapped_file_new (pathname, FALSE, NULL);
+	GBytes *bytes;
+	GVariant *data, *entries;
+	GArray *path, *others;
+	gboolean *on_path;
+	gint64 last_ready = -1;
+	gint last = -1, i, n;
+
+	if (file == NULL)
+	{
+		g_print ("No chart in %s\n", pathname);
+		g_free (pathname);
+		return FALSE;
+	}
+	g_free (pathname);
+
+	bytes = g_mapped_file_get_bytes (file);
+	data = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (CHART_TYPE), bytes, FALSE));
+	g_bytes_unref (bytes);
+	g_mapped_file_unref (file);
+
+	entries = g_variant_get_child_value (data, 2);
+	n = g_variant_n_children (entries);
+	for (i = 0; i < n; i++)
+	{
+		gint64 settled, mapped, exited;
+
+		g_variant_get_child (entries, i, "(&s&sxxxxii)", NULL, NULL, NULL, &settled, &mapped, &exited, NULL, NULL);
+		if (ready_time (settled, mapped, exited) > last_ready)
+		{
+			last_ready = ready_time (settled, mapped, exited);
+			last = i;
+		}
+	}
+
+	if (last < 0)
+	{
+		g_print ("No program was started\n");
+		g_variant_unref (entries);
+		g_variant_unref (data);
+		return TRUE;
+	}
+
+	path = g_array_new (FALSE, FALSE, sizeof(Cost));
+	others = g_array_new (FALSE, FALSE, sizeof(Cost));
+	on_path = g_new0 (gboolean, n);
+
+	for (i = last; i >= 0 && i < n && !on_path[i];)
+	{
+		Cost cost;
+		gint64 started, settled, mapped, exited;
+		gint after;
+
+		g_variant_get_child (entries, i, "(&s&sxxxxii)", &cost.id, NULL, &started, &settled, &mapped, &exited, NULL, &after);
+		if (i == last)
+		{
+			cost.cost = last_ready - started;
+			cost.why = mapped >= 0 ? "until its window" : exited >= 0 ? "until it exited" : "until settled";
+		}
+		else
+		{
+			cost.cost = settled - started;
+			cost.why = exited >= 0 && exited == settled ? "held a slot until it exited" : "held a slot";
+		}
+		g_array_append_val (path, cost);
+		on_path[i] = TRUE;
+		i = after;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		Cost cost;
+		gint64 started, settled, mapped, exited;
+
+		if (on_path[i])
+			continue;
+		g_variant_get_child (entries, i, "(&s&sxxxxii)", &cost.id, NULL, &started, &settled, &mapped, &exited, NULL, NULL);
+		cost.cost = ready_time (settled, mapped, exited) - started;
+		cost.why = mapped >= 0 ? "until its window" : exited >= 0 ? "until it exited" : "no window";
+		g_array_append_val (others, cost);
+	}
+
+	g_array_sort (path, cost_compare);
+	g_array_sort (others, cost_compare);
+
+	g_print ("Ready after %" G_GINT64_FORMAT " ms\n\nCritical path:\n", last_ready);
+	for (i = 0; i < (gint) path->len; i++)
+	{
+		Cost *cost = &g_array_index (path, Cost, i);
+		g_print ("  %6" G_GINT64_FORMAT " ms  %s (%s)\n", cost->cost, cost->id, cost->why);
+	}
+	if (others->len > 0)
+		g_print ("\nOff the critical path:\n");
+	for (i = 0; i < (gint) others->len; i++)
+	{
+		Cost *cost = &g_array_index (others, Cost, i);
+		g_print ("  %6" G_GINT64_FORMAT " ms  %s (%s)\n", cost->cost, cost->id, cost->why);
+	}
+
+	g_free (on_path);
+	g_array_free (path, TRUE);
+	g_array_free (others, TRUE);
+	g_variant_unref (entries);
+	g_variant_unref (data);
+	return TRUE;
+}
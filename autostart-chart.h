@@ -0,0 +1,52 @@
+/**
+ * Copyright (c) 2011-2013 Fabrice THIROUX <fabrice.thiroux@free.fr> (GPL-3+).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or any
+ * later version. See http://www.gnu.org/copyleft/gpl.html the full text
+ * of the license.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _AUTOSTART_CHART_H
+#define _AUTOSTART_CHART_H
+
+#include <glib.h>
+#include <X11/Xlib.h>
+
+/* An autostarted program. Times are monotonic, in µs, 0 if not yet. */
+typedef struct _Entry Entry;
+struct _Entry {
+	gchar *id;
+	gchar **argv;
+	gchar *directory;
+	GPid pid;
+	guint settle_source;
+	gboolean settled;
+	gint index;		/* In the launch order */
+	Entry *after;		/* The entry which gave us its slot */
+	gint64 started;
+	gint64 settled_at;
+	gint64 mapped;		/* First window */
+	gint64 exited;
+	gint status;
+	GVariant *windows;	/* To put back in place, from the session snapshot */
+	gboolean *placed;	/* For each of windows */
+	GArray *seen;		/* Windows already mapped */
+};
+
+extern gboolean chart_watch (GPtrArray *, void (*)(Entry *, Display *, Window));
+extern gboolean chart_complete (GPtrArray *);
+extern void chart_save (const gchar *, gint64, GPtrArray *);
+extern gboolean chart_report (void);
+
+#endif
@@ -0,0 +1,208 @@
+/**
+ * Copyright (c) 2011-2013 Fabrice THIROUX <fabrice.thiroux@free.fr> (GPL-3+).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or any
+ * later version. See http://www.gnu.org/copyleft/gpl.html the full text
+ * of the license.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Battery policy of obsession-exit --daemon: hibernate or shutdown when
+ * the battery is nearly empty. UPower tells us when the battery changes,
+ * we do nothing in between.
+ */
+
+#include <string.h>
+
+#include "obsession.h"
+#include "dbus-interface.h"
+
+/* UPower device states */
+#define UPOWER_DISCHARGING 2
+#define UPOWER_EMPTY 3
+
+#define DEFAULT_BATTERY_WARNING 30
+
+typedef struct {
+	HandlerContext *handler_context;
+	GDBusProxy *device;
+	guint32 notification;
+	guint warning_source;	/* Pending action */
+	gboolean done;		/* Acted or cancelled, until the battery charges or the action fails */
+} BatteryPolicy;
+
+static BatteryPolicy battery;
+
+static void battery_cancel (void)
+{
+	if (battery.warning_source)
+		g_source_remove (battery.warning_source);
+	battery.warning_source = 0;
+
+	dbus_CloseNotification (battery.notification);
+	battery.notification = 0;
+}
+
+static gboolean battery_act (gpointer data)
+{
+	HandlerContext *handler_context = battery.handler_context;
+	GError *err = NULL;
+
+	battery.warning_source = 0;
+	battery_cancel ();
+	/* No second warning while the action runs. */
+	battery.done = TRUE;
+
+	g_message ("Battery critical, %s", handler_context->battery_action);
+	if (g_strcmp0 (handler_context->battery_action, "poweroff") == 0)
+		system_poweroff (handler_context, &err);
+	else
+	{
+		system_hibernate (handler_context, &err);
+		if (!err)
+			sleep_wait_resume (handler_context);
+	}
+
+	/* Warn again on the next change of the battery: it still drains. */
+	if (err)
+	{
+		g_warning ("Can't %s: %s", handler_context->battery_action, err->message);
+		g_error_free (err);
+		battery.done = FALSE;
+	}
+	return FALSE;
+}
+
+static void battery_warn (gdouble percentage, gint64 time_to_empty)
+{
+	HandlerContext *handler_context = battery.handler_context;
+	gint warning = handler_context->battery_warning;
+	gchar *body;
+
+	body = g_strdup_printf ("%.0f%% left, about %" G_GINT64_FORMAT " min. The computer will %s in %d s.",
+	                        percentage, time_to_empty / 60, handler_context->battery_action, warning);
+	g_message ("%s", body);
+
+	battery.notification = dbus_Notify ("Battery critical", body, warning * 1000, "Cancel");
+	battery.warning_source = g_timeout_add_seconds (warning, battery_act, NULL);
+	g_free (body);
+}
+
+/* Look at the battery again, on every change of its properties. */
+static void battery_check (void)
+{
+	HandlerContext *handler_context = battery.handler_context;
+	GVariant *value;
+	gdouble percentage = 100;
+	gint64 time_to_empty = 0;
+	guint32 state = 0;
+
+	if ((value = g_dbus_proxy_get_cached_property (battery.device, "State")))
+	{
+		state = g_variant_get_uint32 (value);
+		g_variant_unref (value);
+	}
+	if ((value = g_dbus_proxy_get_cached_property (battery.device, "Percentage")))
+	{
+		percentage = g_variant_get_double (value);
+		g_variant_unref (value);
+	}
+	if ((value = g_dbus_proxy_get_cached_property (battery.device, "TimeToEmpty")))
+	{
+		time_to_empty = g_variant_get_int64 (value);
+		g_variant_unref (value);
+	}
+
+	/* Plugged in: forget about it. */
+	if (state != UPOWER_DISCHARGING && state != UPOWER_EMPTY)
+	{
+		if (battery.warning_source)
+			g_message ("Battery charging, action cancelled");
+		battery_cancel ();
+		battery.done = FALSE;
+		return;
+	}
+
+	if (battery.done || battery.warning_source)
+		return;
+
+	if ((handler_context->battery_percentage > 0 && percentage <= handler_context->battery_percentage) ||
+	    (handler_context->battery_time > 0 && time_to_empty > 0 && time_to_empty <= handler_context->battery_time))
+		battery_warn (percentage, time_to_empty);
+}
+
+static void battery_changed (GDBusProxy *proxy, GVariant *changed, GStrv invalidated, gpointer data)
+{
+	battery_check ();
+}
+
+static void battery_notification_action (GDBusProxy *proxy, gchar *sender, gchar *signal, GVariant *parameters, gpointer data)
+{
+	guint32 id;
+	const gchar *action;
+
+	if (g_strcmp0 (signal, "ActionInvoked") != 0)
+		return;
+
+	g_variant_get (parameters, "(u&s)", &id, &action);
+	if (id == battery.notification && battery.warning_source && g_strcmp0 (action, "cancel") == 0)
+	{
+		g_message ("Battery action cancelled by the user");
+		battery_cancel ();
+		battery.done = TRUE;
+	}
+}
+
+/* Start the battery policy for obsession-exit --daemon. */
+gboolean battery_policy_start (HandlerContext *handler_context)
+{
+	GError *err = NULL;
+	GVariant *present;
+	gboolean is_present = FALSE;
+
+	battery.handler_context = handler_context;
+	if (handler_context->battery_warning <= 0)
+		handler_context->battery_warning = DEFAULT_BATTERY_WARNING;
+	if (handler_context->battery_action == NULL)
+		handler_context->battery_action = g_strdup ("hibernate");
+
+	battery.device = dbus_UPower_DisplayDevice (&err);
+	if (battery.device == NULL)
+	{
+		g_warning ("No battery policy: %s", err->message);
+		g_error_free (err);
+		return FALSE;
+	}
+
+	present = g_dbus_proxy_get_cached_property (battery.device, "IsPresent");
+	if (present)
+	{
+		is_present = g_variant_get_boolean (present);
+		g_variant_unref (present);
+	}
+	if (!is_present)
+	{
+		g_message ("No battery, no battery policy");
+		g_clear_object (&battery.device);
+		return FALSE;
+	}
+
+	g_signal_connect (battery.device, "g-properties-changed", G_CALLBACK (battery_changed), NULL);
+
+	/* Cancel clicks on the warning */
+	if (dbus_Notifications ())
+		g_signal_connect (dbus_Notifications (), "g-signal", G_CALLBACK (battery_notification_action), NULL);
+
+	battery_check ();
+	return TRUE;
+}
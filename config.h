@@ -14,5 +14,6 @@
 #define PREFIX              "/usr/local"
 #define PACKAGE_DATA_DIR    PREFIX"/share/"
 #define PACKAGE_LOCALE_DIR  PREFIX"/share/locale"
+#define PACKAGE_LIB_DIR     PREFIX"/lib/obsession"
 
 
@@ -16,8 +16,12 @@
 #include <config.h>
 #include <glib.h>
 #include <string.h>
+#include <unistd.h>
 #include <dbus/dbus.h>
 #include <gio/gio.h>
+#include <gio/gunixfdlist.h>
+
+#include "dbus-interface.h"
 
 /*** Mechanism independent ***/
 
@@ -89,6 +93,21 @@ dbus_UPower_Hibernate (GError **error)
     return upower_call_function ("Hibernate", TRUE, error);
 }
 
+/* Proxy on the UPower composite battery, whose properties (Percentage,
+ * TimeToEmpty, State...) are cached and updated by PropertiesChanged. */
+GDBusProxy *
+dbus_UPower_DisplayDevice (GError **error)
+{
+    return g_dbus_proxy_new_for_bus_sync (G_BUS_TYPE_SYSTEM,
+                                          G_DBUS_PROXY_FLAGS_NONE,
+                                          NULL,
+                                          "org.freedesktop.UPower",
+                                          "/org/freedesktop/UPower/devices/DisplayDevice",
+                                          "org.freedesktop.UPower.Device",
+                                          NULL,
+                                          error);
+}
+
 /*** ConsoleKit mechanism ***/
 
 static gboolean
@@ -166,8 +185,8 @@ ck_call_function (const gchar *function, gboolean value, GError **error)
                                      -1,
                                      NULL,
                                      error);
-    g_variant_unref (result);
-    return;
+    if (result)
+        g_variant_unref (result);
 }
 
 
@@ -178,9 +197,9 @@ dbus_ConsoleKit_CanPowerOff (void)
 }
 
 void
-dbus_ConsoleKit_PowerOff(GError **error)
+dbus_ConsoleKit_PowerOff(gboolean interactive, GError **error)
 {
-    ck_call_function ("PowerOff", TRUE, error);
+    ck_call_function ("PowerOff", interactive, error);
 }
 
 gboolean
@@ -190,9 +209,9 @@ dbus_ConsoleKit_CanReboot (void)
 }
 
 void
-dbus_ConsoleKit_Reboot (GError **error)
+dbus_ConsoleKit_Reboot (gboolean interactive, GError **error)
 {
-    ck_call_function ("Reboot", TRUE, error);
+    ck_call_function ("Reboot", interactive, error);
 }
 
 gboolean
@@ -202,9 +221,9 @@ dbus_ConsoleKit_CanSuspend (void)
 }
 
 void
-dbus_ConsoleKit_Suspend (GError **error)
+dbus_ConsoleKit_Suspend (gboolean interactive, GError **error)
 {
-    ck_call_function ("Suspend", TRUE, error);
+    ck_call_function ("Suspend", interactive, error);
 }
 
 gboolean
@@ -214,20 +233,19 @@ dbus_ConsoleKit_CanHibernate (void)
 }
 
 void
-dbus_ConsoleKit_hibernate (GError **error)
+dbus_ConsoleKit_hibernate (gboolean interactive, GError **error)
 {
-    ck_call_function ("Hibernate", TRUE, error);
+    ck_call_function ("Hibernate", interactive, error);
 }
 
 /*** Systemd mechanism ***/
 
-static gboolean
-systemd_query (const gchar *function, gboolean default_result, GError **error)
-{
-    GVariant *result;
-    gboolean function_result = FALSE;
-    const gchar *str;
+/* SD_LOGIND_SKIP_INHIBITORS of the *WithFlags methods */
+#define LOGIND_SKIP_INHIBITORS (1 << 4)
 
+static GDBusProxy *
+systemd_get_proxy (GError **error)
+{
     if (!systemd_proxy)
     {
         systemd_proxy = g_dbus_proxy_new_for_bus_sync (G_BUS_TYPE_SYSTEM,
@@ -238,9 +256,20 @@ systemd_query (const gchar *function, gboolean default_result, GError **error)
                                                       "org.freedesktop.login1.Manager",
                                                       NULL,
                                                       error);
-        if (!systemd_proxy)
-            return FALSE;
     }
+    return systemd_proxy;
+}
+
+/* Return the answer of a logind Can* function: "yes", "no", "challenge"
+ * or "na", NULL if logind can't be asked. */
+gchar *
+dbus_systemd_Can (const gchar *function)
+{
+    GVariant *result;
+    gchar *answer = NULL;
+
+    if (!systemd_get_proxy (NULL))
+        return NULL;
 
     result = g_dbus_proxy_call_sync (systemd_proxy,
                                      function,
@@ -248,40 +277,68 @@ systemd_query (const gchar *function, gboolean default_result, GError **error)
                                      G_DBUS_CALL_FLAGS_NONE,
                                      -1,
                                      NULL,
-                                     error);
+                                     NULL);
     if (!result)
-        return default_result;
+        return NULL;
 
     if (g_variant_is_of_type (result, G_VARIANT_TYPE ("(s)")))
-    {
-			g_variant_get (result, "(s)", &str);
-			if (g_strcmp0 (str, "yes") || g_strcmp0 (str, "challenge"))
-				function_result = TRUE;
-			else
-				function_result = default_result;
-		}
+        g_variant_get (result, "(s)", &answer);
 
     g_variant_unref (result);
+    return answer;
+}
+
+static gboolean
+systemd_query (const gchar *function, gboolean default_result, GError **error)
+{
+    gchar *answer = dbus_systemd_Can (function);
+    gboolean function_result;
+
+    if (!answer)
+        return default_result;
+
+    function_result = g_strcmp0 (answer, "yes") == 0 || g_strcmp0 (answer, "challenge") == 0;
+    g_free (answer);
     return function_result;
 }
 
+/* Call function(interactive), or functionWithFlags(flags) when flags are
+ * given. Older logind don't know the latter, the inhibitors are then only
+ * ignored if polkit allows it. Only interactive calls wait for a polkit
+ * agent: see dbus_polkit_Authorize().
+ */
 static void
-systemd_call_function (const gchar *function, gboolean value, GError **error)
+systemd_call_function (const gchar *function, gboolean value, guint64 flags, GError **error)
 {
     GVariant *result;
+    GError *local_error = NULL;
 
-    if (!systemd_proxy)
+    if (!systemd_get_proxy (error))
+        return;
+
+    if (flags)
     {
-        systemd_proxy = g_dbus_proxy_new_for_bus_sync (G_BUS_TYPE_SYSTEM,
-                                                      G_DBUS_PROXY_FLAGS_NONE,
-                                                      NULL,
-                                                      "org.freedesktop.login1",
-                                                      "/org/freedesktop/login1",
-                                                      "org.freedesktop.login1.Manager",
-                                                      NULL,
-                                                      error);
-        if (!systemd_proxy)
+        gchar *with_flags = g_strconcat (function, "WithFlags", NULL);
+
+        result = g_dbus_proxy_call_sync (systemd_proxy,
+                                         with_flags,
+                                         g_variant_new ("(t)", flags),
+                                         G_DBUS_CALL_FLAGS_NONE,
+                                         -1,
+                                         NULL,
+                                         &local_error);
+        g_free (with_flags);
+        if (result)
+        {
+            g_variant_unref (result);
             return;
+        }
+        if (!g_error_matches (local_error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD))
+        {
+            g_propagate_error (error, local_error);
+            return;
+        }
+        g_clear_error (&local_error);
     }
 
     result = g_dbus_proxy_call_sync (systemd_proxy,
@@ -291,8 +348,8 @@ systemd_call_function (const gchar *function, gboolean value, GError **error)
                                      -1,
                                      NULL,
                                      error);
-    g_variant_unref (result);
-    return;
+    if (result)
+        g_variant_unref (result);
 }
 
 gboolean
@@ -302,9 +359,9 @@ dbus_systemd_CanPowerOff (void)
 }
 
 void
-dbus_systemd_PowerOff (GError **error)
+dbus_systemd_PowerOff (gboolean ignore_inhibitors, gboolean interactive, GError **error)
 {
-    systemd_call_function ("PowerOff", TRUE, error);
+    systemd_call_function ("PowerOff", interactive, ignore_inhibitors ? LOGIND_SKIP_INHIBITORS : 0, error);
 }
 
 gboolean
@@ -314,9 +371,9 @@ dbus_systemd_CanReboot (void)
 }
 
 void
-dbus_systemd_Reboot (GError **error)
+dbus_systemd_Reboot (gboolean ignore_inhibitors, gboolean interactive, GError **error)
 {
-    systemd_call_function ("Reboot", TRUE, error);
+    systemd_call_function ("Reboot", interactive, ignore_inhibitors ? LOGIND_SKIP_INHIBITORS : 0, error);
 }
 
 gboolean
@@ -326,9 +383,9 @@ dbus_systemd_CanSuspend (void)
 }
 
 void
-dbus_systemd_Suspend (GError **error)
+dbus_systemd_Suspend (gboolean ignore_inhibitors, gboolean interactive, GError **error)
 {
-    systemd_call_function ("Suspend", TRUE, error);
+    systemd_call_function ("Suspend", interactive, ignore_inhibitors ? LOGIND_SKIP_INHIBITORS : 0, error);
 }
 
 gboolean
@@ -338,7 +395,763 @@ dbus_systemd_CanHibernate (void)
 }
 
 void
-dbus_systemd_Hibernate (GError **error)
+dbus_systemd_Hibernate (gboolean ignore_inhibitors, gboolean interactive, GError **error)
+{
+    systemd_call_function ("Hibernate", interactive, ignore_inhibitors ? LOGIND_SKIP_INHIBITORS : 0, error);
+}
+
+static void
+inhibitor_free (gpointer data)
+{
+    Inhibitor *inhibitor = data;
+
+    g_free (inhibitor->what);
+    g_free (inhibitor->who);
+    g_free (inhibitor->why);
+    g_free (inhibitor->mode);
+    g_free (inhibitor);
+}
+
+/* what is a colon separated list, e.g. "sleep:shutdown" */
+static gboolean
+inhibitor_covers (const gchar *list, const gchar *what)
+{
+    gchar **whats = g_strsplit (list, ":", -1);
+    gboolean found = FALSE;
+    gint i;
+
+    for (i = 0; whats[i] && !found; i++)
+        found = g_strcmp0 (whats[i], what) == 0;
+
+    g_strfreev (whats);
+    return found;
+}
+
+/* Return the inhibitors taken on what ("shutdown", "sleep"...), but ours. */
+GPtrArray *
+dbus_systemd_ListInhibitors (const gchar *what, GError **error)
+{
+    GVariant *result;
+    GVariantIter *iter;
+    GPtrArray *inhibitors;
+    const gchar *i_what, *who, *why, *mode;
+    guint32 uid, pid;
+
+    if (!systemd_get_proxy (error))
+        return NULL;
+
+    result = g_dbus_proxy_call_sync (systemd_proxy,
+                                     "ListInhibitors",
+                                     NULL,
+                                     G_DBUS_CALL_FLAGS_NONE,
+                                     -1,
+                                     NULL,
+                                     error);
+    if (!result)
+        return NULL;
+
+    inhibitors = g_ptr_array_new_with_free_func (inhibitor_free);
+    g_variant_get (result, "(a(ssssuu))", &iter);
+    while (g_variant_iter_loop (iter, "(&s&s&s&suu)", &i_what, &who, &why, &mode, &uid, &pid))
+    {
+        Inhibitor *inhibitor;
+
+        if (pid == (guint32) getpid () || (what && !inhibitor_covers (i_what, what)))
+            continue;
+
+        inhibitor = g_new0 (Inhibitor, 1);
+        inhibitor->what = g_strdup (i_what);
+        inhibitor->who = g_strdup (who);
+        inhibitor->why = g_strdup (why);
+        inhibitor->mode = g_strdup (mode);
+        inhibitor->uid = uid;
+        inhibitor->pid = pid;
+        g_ptr_array_add (inhibitors, inhibitor);
+    }
+    g_variant_iter_free (iter);
+    g_variant_unref (result);
+    return inhibitors;
+}
+
+/* Are other users logged in? Then logind checks the -multiple-sessions
+ * polkit actions. */
+gboolean
+dbus_systemd_OtherSessions (void)
+{
+    GVariant *result;
+    GVariantIter *iter;
+    guint32 uid;
+    gboolean found = FALSE;
+
+    if (!systemd_get_proxy (NULL))
+        return FALSE;
+
+    result = g_dbus_proxy_call_sync (systemd_proxy,
+                                     "ListSessions",
+                                     NULL,
+                                     G_DBUS_CALL_FLAGS_NONE,
+                                     -1,
+                                     NULL,
+                                     NULL);
+    if (!result)
+        return FALSE;
+
+    g_variant_get (result, "(a(susso))", &iter);
+    while (!found && g_variant_iter_next (iter, "(&su&s&s&o)", NULL, &uid, NULL, NULL, NULL))
+        found = uid != getuid ();
+    g_variant_iter_free (iter);
+    g_variant_unref (result);
+    return found;
+}
+
+/* Longest time a delay inhibitor may hold an action, in s. */
+guint
+dbus_systemd_InhibitDelayMax (void)
+{
+    GVariant *value;
+    guint64 usec = 0;
+
+    if (!systemd_get_proxy (NULL))
+        return 0;
+
+    value = g_dbus_proxy_get_cached_property (systemd_proxy, "InhibitDelayMaxUSec");
+    if (value)
+    {
+        usec = g_variant_get_uint64 (value);
+        g_variant_unref (value);
+    }
+    return (usec + G_USEC_PER_SEC - 1) / G_USEC_PER_SEC;
+}
+
+/*** Desktop notifications (session bus) ***/
+
+static GDBusProxy *notify_proxy = NULL;
+
+/* The notification server emits ActionInvoked(id, action) on the proxy,
+ * see its "g-signal". */
+GDBusProxy *
+dbus_Notifications (void)
+{
+    if (!notify_proxy)
+    {
+        notify_proxy = g_dbus_proxy_new_for_bus_sync (G_BUS_TYPE_SESSION,
+                                                      G_DBUS_PROXY_FLAGS_NONE,
+                                                      NULL,
+                                                      "org.freedesktop.Notifications",
+                                                      "/org/freedesktop/Notifications",
+                                                      "org.freedesktop.Notifications",
+                                                      NULL,
+                                                      NULL);
+    }
+    return notify_proxy;
+}
+
+/* Show a notification, with a Cancel button if cancel_label is given.
+ * Return its id, or 0 if there is no notification server. */
+guint32
+dbus_Notify (const gchar *summary, const gchar *body, gint timeout, const gchar *cancel_label)
+{
+    GVariantBuilder actions;
+    GVariant *result;
+    guint32 id = 0;
+
+    if (!dbus_Notifications ())
+        return 0;
+
+    g_variant_builder_init (&actions, G_VARIANT_TYPE ("as"));
+    if (cancel_label)
+    {
+        g_variant_builder_add (&actions, "s", "cancel");
+        g_variant_builder_add (&actions, "s", cancel_label);
+    }
+
+    result = g_dbus_proxy_call_sync (notify_proxy,
+                                     "Notify",
+                                     g_variant_new ("(susssasa{sv}i)", PACKAGE, 0, "battery-caution",
+                                                    summary, body, &actions, NULL, timeout),
+                                     G_DBUS_CALL_FLAGS_NONE,
+                                     -1,
+                                     NULL,
+                                     NULL);
+    if (!result)
+        return 0;
+
+    g_variant_get (result, "(u)", &id);
+    g_variant_unref (result);
+    return id;
+}
+
+void
+dbus_CloseNotification (guint32 id)
+{
+    GVariant *result;
+
+    if (!notify_proxy || !id)
+        return;
+
+    result = g_dbus_proxy_call_sync (notify_proxy,
+                                     "CloseNotification",
+                                     g_variant_new ("(u)", id),
+                                     G_DBUS_CALL_FLAGS_NONE,
+                                     -1,
+                                     NULL,
+                                     NULL);
+    if (result)
+        g_variant_unref (result);
+}
+
+/*** MPRIS media players (session bus) ***/
+
+/* Is one of the MPRIS media players playing? */
+gboolean
+dbus_mpris_Playing (void)
+{
+    GDBusConnection *bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, NULL);
+    GVariant *names, *status;
+    GVariantIter *iter;
+    const gchar *name;
+    gboolean playing = FALSE;
+
+    if (!bus)
+        return FALSE;
+
+    names = g_dbus_connection_call_sync (bus,
+                                         "org.freedesktop.DBus",
+                                         "/org/freedesktop/DBus",
+                                         "org.freedesktop.DBus",
+                                         "ListNames",
+                                         NULL,
+                                         G_VARIANT_TYPE ("(as)"),
+                                         G_DBUS_CALL_FLAGS_NONE,
+                                         -1,
+                                         NULL,
+                                         NULL);
+    if (!names)
+    {
+        g_object_unref (bus);
+        return FALSE;
+    }
+
+    g_variant_get (names, "(as)", &iter);
+    while (!playing && g_variant_iter_loop (iter, "&s", &name))
+    {
+        GVariant *value;
+
+        if (!g_str_has_prefix (name, "org.mpris.MediaPlayer2."))
+            continue;
+
+        status = g_dbus_connection_call_sync (bus,
+                                              name,
+                                              "/org/mpris/MediaPlayer2",
+                                              "org.freedesktop.DBus.Properties",
+                                              "Get",
+                                              g_variant_new ("(ss)", "org.mpris.MediaPlayer2.Player", "PlaybackStatus"),
+                                              G_VARIANT_TYPE ("(v)"),
+                                              G_DBUS_CALL_FLAGS_NONE,
+                                              1000,
+                                              NULL,
+                                              NULL);
+        if (!status)
+            continue;
+
+        g_variant_get (status, "(v)", &value);
+        playing = g_variant_is_of_type (value, G_VARIANT_TYPE_STRING) &&
+                  g_strcmp0 (g_variant_get_string (value, NULL), "Playing") == 0;
+        g_variant_unref (value);
+        g_variant_unref (status);
+    }
+
+    g_variant_iter_free (iter);
+    g_variant_unref (names);
+    g_object_unref (bus);
+    return playing;
+}
+
+/*** Capability changes (system bus) ***/
+
+typedef struct {
+    DBusChangeCallback callback;
+    gpointer data;
+    const gchar *service;
+} ChangeWatch;
+
+static void
+watch_signal (GDBusConnection *connection, const gchar *sender, const gchar *path,
+              const gchar *interface, const gchar *signal, GVariant *parameters, gpointer data)
+{
+    ChangeWatch *watch = data;
+
+    watch->callback (watch->service, watch->data);
+}
+
+/* Call callback with the name of a power service (login1, UPower,
+ * ConsoleKit) when what it allows may have changed: it came or went,
+ * a session was added or removed, its properties changed.
+ */
+void
+dbus_WatchChanges (DBusChangeCallback callback, gpointer data)
+{
+    static const gchar *services[][2] = {
+        { "org.freedesktop.login1", "/org/freedesktop/login1" },
+        { "org.freedesktop.UPower", "/org/freedesktop/UPower" },
+        { "org.freedesktop.ConsoleKit", "/org/freedesktop/ConsoleKit/Manager" },
+    };
+    GDBusConnection *bus = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, NULL);
+    guint i;
+
+    if (!bus)
+        return;
+
+    for (i = 0; i < G_N_ELEMENTS (services); i++)
+    {
+        ChangeWatch *watch = g_new0 (ChangeWatch, 1);
+
+        watch->callback = callback;
+        watch->data = data;
+        watch->service = services[i][0];
+
+        g_dbus_connection_signal_subscribe (bus, "org.freedesktop.DBus", "org.freedesktop.DBus",
+                                            "NameOwnerChanged", "/org/freedesktop/DBus", services[i][0],
+                                            G_DBUS_SIGNAL_FLAGS_NONE, watch_signal, watch, NULL);
+        /* Manager signals and PropertiesChanged, not the devices ones. */
+        g_dbus_connection_signal_subscribe (bus, services[i][0], NULL, NULL, services[i][1], NULL,
+                                            G_DBUS_SIGNAL_FLAGS_NONE, watch_signal, watch, NULL);
+    }
+
+    /* Subscriptions last as long as the connection. */
+}
+
+/*** Sleep monitoring (logind) ***/
+
+static gboolean sleep_prepared = FALSE;
+static gboolean sleep_resumed = FALSE;
+static gulong sleep_handler = 0;
+static GMainLoop *sleep_loop = NULL;
+
+static void
+systemd_sleep_signal (GDBusProxy *proxy, gchar *sender, gchar *signal, GVariant *parameters, gpointer data)
+{
+    gboolean start;
+
+    if (g_strcmp0 (signal, "PrepareForSleep") != 0)
+        return;
+
+    g_variant_get (parameters, "(b)", &start);
+    if (start)
+        sleep_prepared = TRUE;
+    else
+        sleep_resumed = TRUE;
+
+    if (sleep_loop)
+        g_main_loop_quit (sleep_loop);
+}
+
+static gboolean
+systemd_sleep_timeout (gpointer data)
+{
+    *(gboolean *) data = TRUE;
+    g_main_loop_quit (sleep_loop);
+    return FALSE;
+}
+
+/* Run the main loop until flag is set or timeout (in ms) expires. The
+ * timeout runs on the monotonic clock which is stopped while the computer
+ * sleeps, so it only counts the time spent awake. */
+static gboolean
+systemd_sleep_wait (gboolean *flag, guint timeout)
+{
+    gboolean timed_out = FALSE;
+    guint source;
+
+    if (!sleep_handler)
+        return FALSE;
+
+    source = g_timeout_add (timeout, systemd_sleep_timeout, &timed_out);
+    sleep_loop = g_main_loop_new (NULL, FALSE);
+    while (!*flag && !timed_out)
+        g_main_loop_run (sleep_loop);
+    g_main_loop_unref (sleep_loop);
+    sleep_loop = NULL;
+
+    if (!timed_out)
+        g_source_remove (source);
+
+    return *flag;
+}
+
+/* Start listening to PrepareForSleep, before asking for a sleep. */
+gboolean
+dbus_systemd_SleepMonitorStart (void)
+{
+    if (!systemd_get_proxy (NULL))
+        return FALSE;
+
+    sleep_prepared = FALSE;
+    sleep_resumed = FALSE;
+    if (!sleep_handler)
+        sleep_handler = g_signal_connect (systemd_proxy, "g-signal", G_CALLBACK (systemd_sleep_signal), NULL);
+    return TRUE;
+}
+
+/* Wait for PrepareForSleep(true), timeout in ms. */
+gboolean
+dbus_systemd_SleepMonitorWaitPrepare (guint timeout)
+{
+    return systemd_sleep_wait (&sleep_prepared, timeout);
+}
+
+/* Wait for PrepareForSleep(false), timeout in seconds. */
+gboolean
+dbus_systemd_SleepMonitorWait (guint timeout)
+{
+    return systemd_sleep_wait (&sleep_resumed, timeout * 1000);
+}
+
+/* Take a logind inhibitor lock. Return its file descriptor, the lock is
+ * released when it is closed, or -1 on error. */
+gint
+dbus_systemd_Inhibit (const gchar *what, const gchar *who, const gchar *why, const gchar *mode, GError **error)
+{
+    GUnixFDList *fd_list = NULL;
+    GVariant *result;
+    gint32 index;
+    gint fd = -1;
+
+    if (!systemd_get_proxy (error))
+        return -1;
+
+    result = g_dbus_proxy_call_with_unix_fd_list_sync (systemd_proxy,
+                                                       "Inhibit",
+                                                       g_variant_new ("(ssss)", what, who, why, mode),
+                                                       G_DBUS_CALL_FLAGS_NONE,
+                                                       -1,
+                                                       NULL,
+                                                       &fd_list,
+                                                       NULL,
+                                                       error);
+    if (!result)
+        return -1;
+
+    g_variant_get (result, "(h)", &index);
+    if (fd_list)
+    {
+        fd = g_unix_fd_list_get (fd_list, index, error);
+        g_object_unref (fd_list);
+    }
+
+    g_variant_unref (result);
+    return fd;
+}
+
+/* Terminate the current logind session: the one in $XDG_SESSION_ID, or
+ * the one we belong to. */
+gboolean
+dbus_systemd_TerminateSession (GError **error)
+{
+    const gchar *session = g_getenv ("XDG_SESSION_ID");
+    GVariant *result;
+    gchar *path = NULL;
+
+    if (!systemd_get_proxy (error))
+        return FALSE;
+
+    if (session && *session)
+    {
+        result = g_dbus_proxy_call_sync (systemd_proxy,
+                                         "TerminateSession",
+                                         g_variant_new ("(s)", session),
+                                         G_DBUS_CALL_FLAGS_NONE,
+                                         -1,
+                                         NULL,
+                                         error);
+        if (!result)
+            return FALSE;
+        g_variant_unref (result);
+        return TRUE;
+    }
+
+    result = g_dbus_proxy_call_sync (systemd_proxy,
+                                     "GetSessionByPID",
+                                     g_variant_new ("(u)", (guint32) getpid ()),
+                                     G_DBUS_CALL_FLAGS_NONE,
+                                     -1,
+                                     NULL,
+                                     error);
+    if (!result)
+        return FALSE;
+    g_variant_get (result, "(o)", &path);
+    g_variant_unref (result);
+
+    result = g_dbus_connection_call_sync (g_dbus_proxy_get_connection (systemd_proxy),
+                                          "org.freedesktop.login1",
+                                          path,
+                                          "org.freedesktop.login1.Session",
+                                          "Terminate",
+                                          NULL,
+                                          NULL,
+                                          G_DBUS_CALL_FLAGS_NONE,
+                                          -1,
+                                          NULL,
+                                          error);
+    g_free (path);
+    if (!result)
+        return FALSE;
+    g_variant_unref (result);
+    return TRUE;
+}
+
+/*** Timers (systemd manager) ***/
+
+/* Next elapse of the calendar timers of the system manager, in µs since
+ * the epoch, 0 if there is none. unit is set to the timer's name. */
+guint64
+dbus_systemd_NextTimer (gchar **unit, GError **error)
+{
+    GDBusConnection *bus;
+    GVariant *result;
+    GVariantIter *iter;
+    const gchar *name, *path;
+    const gchar *patterns[] = { "*.timer", NULL };
+    guint64 next = 0;
+
+    bus = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, error);
+    if (!bus)
+        return 0;
+
+    result = g_dbus_connection_call_sync (bus,
+                                          "org.freedesktop.systemd1",
+                                          "/org/freedesktop/systemd1",
+                                          "org.freedesktop.systemd1.Manager",
+                                          "ListUnitsByPatterns",
+                                          g_variant_new ("(^as^as)", NULL, patterns),
+                                          G_VARIANT_TYPE ("(a(ssssssouso))"),
+                                          G_DBUS_CALL_FLAGS_NONE,
+                                          -1,
+                                          NULL,
+                                          error);
+    if (!result)
+    {
+        g_object_unref (bus);
+        return 0;
+    }
+
+    g_variant_get (result, "(a(ssssssouso))", &iter);
+    while (g_variant_iter_loop (iter, "(&s&s&s&s&s&s&ou&s&o)", &name, NULL, NULL, NULL, NULL, NULL, &path, NULL, NULL, NULL))
+    {
+        GVariant *elapse, *value;
+        guint64 usec;
+
+        elapse = g_dbus_connection_call_sync (bus,
+                                              "org.freedesktop.systemd1",
+                                              path,
+                                              "org.freedesktop.DBus.Properties",
+                                              "Get",
+                                              g_variant_new ("(ss)", "org.freedesktop.systemd1.Timer", "NextElapseUSecRealtime"),
+                                              G_VARIANT_TYPE ("(v)"),
+                                              G_DBUS_CALL_FLAGS_NONE,
+                                              -1,
+                                              NULL,
+                                              NULL);
+        if (!elapse)
+            continue;
+
+        /* 0 for the timers only relative to boot or activation */
+        g_variant_get (elapse, "(v)", &value);
+        usec = g_variant_get_uint64 (value);
+        g_variant_unref (value);
+        g_variant_unref (elapse);
+
+        if (usec && (next == 0 || usec < next))
+        {
+            next = usec;
+            if (unit)
+            {
+                g_free (*unit);
+                *unit = g_strdup (name);
+            }
+        }
+    }
+    g_variant_iter_free (iter);
+    g_variant_unref (result);
+    g_object_unref (bus);
+    return next;
+}
+
+/*** polkit ***/
+
+/* CheckAuthorization flags */
+#define POLKIT_ALLOW_USER_INTERACTION 1
+
+/* Without interaction, polkit answers at once. */
+#define POLKIT_CHECK_TIMEOUT 2000
+
+/* We are the subject: the services we call see the same bus name. */
+static GVariant *
+polkit_parameters (GDBusConnection *bus, const gchar *action_id, guint32 flags, const gchar *cancellation_id)
+{
+    GVariantBuilder details;
+    GVariant *subject;
+
+    subject = g_variant_new_parsed ("('system-bus-name', {'name': <%s>})", g_dbus_connection_get_unique_name (bus));
+    g_variant_builder_init (&details, G_VARIANT_TYPE ("a{ss}"));
+    return g_variant_new ("(@(sa{sv})s@a{ss}us)", subject, action_id, g_variant_builder_end (&details),
+                          flags, cancellation_id);
+}
+
+/* Is action_id allowed, with or without authentication? Nobody is asked. */
+gint
+dbus_polkit_Check (const gchar *action_id)
+{
+    GDBusConnection *bus = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, NULL);
+    GVariant *result;
+    gboolean authorized = FALSE, challenge = FALSE;
+
+    if (!bus || !action_id)
+    {
+        g_clear_object (&bus);
+        return POLKIT_NO;
+    }
+
+    result = g_dbus_connection_call_sync (bus,
+                                          "org.freedesktop.PolicyKit1",
+                                          "/org/freedesktop/PolicyKit1/Authority",
+                                          "org.freedesktop.PolicyKit1.Authority",
+                                          "CheckAuthorization",
+                                          polkit_parameters (bus, action_id, 0, ""),
+                                          G_VARIANT_TYPE ("((bba{ss}))"),
+                                          G_DBUS_CALL_FLAGS_NONE,
+                                          POLKIT_CHECK_TIMEOUT,
+                                          NULL,
+                                          NULL);
+    g_object_unref (bus);
+    if (!result)
+        return POLKIT_NO;
+
+    g_variant_get (result, "((bb@a{ss}))", &authorized, &challenge, NULL);
+    g_variant_unref (result);
+    return authorized ? POLKIT_YES : (challenge ? POLKIT_CHALLENGE : POLKIT_NO);
+}
+
+typedef struct {
+    GMainLoop *loop;
+    GCancellable *cancellable;
+    GVariant *result;
+    GError *error;
+    gboolean timed_out;
+    gboolean cancelled;
+} PolkitAuthorization;
+
+static void
+polkit_authorized (GObject *source, GAsyncResult *res, gpointer data)
+{
+    PolkitAuthorization *authorization = data;
+
+    authorization->result = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), res, &authorization->error);
+    g_main_loop_quit (authorization->loop);
+}
+
+/* Close the agent's dialog, the reply comes at once (cancelled). */
+static gboolean
+polkit_timeout (gpointer data)
+{
+    PolkitAuthorization *authorization = data;
+
+    authorization->timed_out = TRUE;
+    g_cancellable_cancel (authorization->cancellable);
+    return FALSE;
+}
+
+/* The caller gave up (its dialog was closed). */
+static void
+polkit_cancelled (GCancellable *cancellable, gpointer data)
+{
+    PolkitAuthorization *authorization = data;
+
+    authorization->cancelled = TRUE;
+    g_cancellable_cancel (authorization->cancellable);
+}
+
+/* Get the right to do action_id, authenticating through the session's
+ * polkit agent if needed. The main loop runs meanwhile; without an agent
+ * polkit refuses at once, and we give up after timeout s anyway, or when
+ * cancellable (may be NULL) is cancelled.
+ */
+gboolean
+dbus_polkit_Authorize (const gchar *action_id, guint timeout, GCancellable *cancellable, GError **error)
 {
-    systemd_call_function ("Hibernate", TRUE, error);
+    static guint count = 0;
+    GDBusConnection *bus;
+    PolkitAuthorization authorization = { NULL };
+    gchar *cancellation_id;
+    gboolean authorized = FALSE, challenge = FALSE;
+    guint timeout_source;
+    gulong cancelled_handler = 0;
+
+    bus = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, error);
+    if (!bus)
+        return FALSE;
+
+    cancellation_id = g_strdup_printf ("obsession-%d-%u", getpid (), ++count);
+    authorization.loop = g_main_loop_new (NULL, FALSE);
+    authorization.cancellable = g_cancellable_new ();
+
+    g_dbus_connection_call (bus,
+                            "org.freedesktop.PolicyKit1",
+                            "/org/freedesktop/PolicyKit1/Authority",
+                            "org.freedesktop.PolicyKit1.Authority",
+                            "CheckAuthorization",
+                            polkit_parameters (bus, action_id, POLKIT_ALLOW_USER_INTERACTION, cancellation_id),
+                            G_VARIANT_TYPE ("((bba{ss}))"),
+                            G_DBUS_CALL_FLAGS_NONE,
+                            G_MAXINT,
+                            authorization.cancellable,
+                            polkit_authorized,
+                            &authorization);
+
+    timeout_source = g_timeout_add_seconds (timeout, polkit_timeout, &authorization);
+    if (cancellable)
+        cancelled_handler = g_cancellable_connect (cancellable, G_CALLBACK (polkit_cancelled), &authorization, NULL);
+    g_main_loop_run (authorization.loop);
+    if (!authorization.timed_out)
+        g_source_remove (timeout_source);
+    if (cancellable)
+        g_cancellable_disconnect (cancellable, cancelled_handler);
+
+    if (authorization.result)
+    {
+        g_variant_get (authorization.result, "((bb@a{ss}))", &authorized, &challenge, NULL);
+        g_variant_unref (authorization.result);
+        if (!authorized)
+            g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_ACCESS_DENIED,
+                         challenge ? "Authentication failed, or no polkit agent" : "Not allowed");
+    }
+    else if (authorization.timed_out || authorization.cancelled)
+    {
+        /* The agent knows nothing of our cancellable, polkit tells it. */
+        g_dbus_connection_call (bus,
+                                "org.freedesktop.PolicyKit1",
+                                "/org/freedesktop/PolicyKit1/Authority",
+                                "org.freedesktop.PolicyKit1.Authority",
+                                "CancelCheckAuthorization",
+                                g_variant_new ("(s)", cancellation_id),
+                                NULL,
+                                G_DBUS_CALL_FLAGS_NONE,
+                                -1,
+                                NULL,
+                                NULL,
+                                NULL);
+        if (authorization.timed_out)
+            g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_TIMEOUT, "No authentication within %u s", timeout);
+        else
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED, "Cancelled");
+        g_clear_error (&authorization.error);
+    }
+    else
+        g_propagate_error (error, authorization.error);
+
+    g_object_unref (authorization.cancellable);
+    g_main_loop_unref (authorization.loop);
+    g_free (cancellation_id);
+    g_object_unref (bus);
+    return authorized;
 }
@@ -23,6 +23,7 @@
 #define _DBUS_INTERFACE_H
 
 #include <glib.h>
+#include <gio/gio.h>
 
 /* ConsoleKit Interface */
 extern gboolean dbus_ConsoleKit_CanPowerOff(void);
@@ -30,10 +31,10 @@ extern gboolean dbus_ConsoleKit_CanReboot(void);
 extern gboolean dbus_ConsoleKit_CanHibernate(void);
 extern gboolean dbus_ConsoleKit_CanSuspend(void);
 
-extern void dbus_ConsoleKit_PowerOff(GError **);
-extern void dbus_ConsoleKit_Reboot(GError **);
-extern void dbus_ConsoleKit_Suspend(GError **);
-extern void dbus_ConsoleKit_Hibernate(GError **);
+extern void dbus_ConsoleKit_PowerOff(gboolean, GError **);
+extern void dbus_ConsoleKit_Reboot(gboolean, GError **);
+extern void dbus_ConsoleKit_Suspend(gboolean, GError **);
+extern void dbus_ConsoleKit_Hibernate(gboolean, GError **);
 
 /* UPower Interface */
 extern gboolean dbus_UPower_CanSuspend(void);
@@ -42,15 +43,63 @@ extern gboolean dbus_UPower_CanHibernate(void);
 extern gboolean dbus_UPower_Suspend(GError **);
 extern gboolean dbus_UPower_Hibernate(GError **);
 
+extern GDBusProxy *dbus_UPower_DisplayDevice(GError **);
+
 /* SystemD Interface */
 extern gboolean dbus_systemd_CanPowerOff(void);
 extern gboolean dbus_systemd_CanReboot(void);
 extern gboolean dbus_systemd_CanSuspend(void);
 extern gboolean dbus_systemd_CanHibernate(void);
+extern gchar *dbus_systemd_Can(const gchar *);
+
+extern void dbus_systemd_PowerOff(gboolean, gboolean, GError **);
+extern void dbus_systemd_Reboot(gboolean, gboolean, GError **);
+extern void dbus_systemd_Suspend(gboolean, gboolean, GError **);
+extern void dbus_systemd_Hibernate(gboolean, gboolean, GError **);
+
+/* SystemD inhibitors */
+typedef struct {
+	gchar *what;
+	gchar *who;
+	gchar *why;
+	gchar *mode;		/* "block" or "delay" */
+	guint32 uid;
+	guint32 pid;
+} Inhibitor;
+
+extern GPtrArray *dbus_systemd_ListInhibitors(const gchar *, GError **);
+extern guint dbus_systemd_InhibitDelayMax(void);
+extern gboolean dbus_systemd_OtherSessions(void);
+
+/* Capability changes */
+typedef void (*DBusChangeCallback) (const gchar *, gpointer);
+extern void dbus_WatchChanges(DBusChangeCallback, gpointer);
+
+/* Notifications Interface */
+extern guint32 dbus_Notify(const gchar *, const gchar *, gint, const gchar *);
+extern void dbus_CloseNotification(guint32);
+extern GDBusProxy *dbus_Notifications(void);
+
+/* MPRIS Interface */
+extern gboolean dbus_mpris_Playing(void);
+
+extern gboolean dbus_systemd_SleepMonitorStart(void);
+extern gboolean dbus_systemd_SleepMonitorWaitPrepare(guint);
+extern gboolean dbus_systemd_SleepMonitorWait(guint);
+extern gint dbus_systemd_Inhibit(const gchar *, const gchar *, const gchar *, const gchar *, GError **);
+extern gboolean dbus_systemd_TerminateSession(GError **);
+
+/* Timers */
+extern guint64 dbus_systemd_NextTimer(gchar **, GError **);
+
+/* polkit */
+enum {
+	POLKIT_NO,
+	POLKIT_YES,
+	POLKIT_CHALLENGE	/* Yes, once authenticated */
+};
 
-extern void dbus_systemd_PowerOff(GError **);
-extern void dbus_systemd_Reboot(GError **);
-extern void dbus_systemd_Suspend(GError **);
-extern void dbus_systemd_Hibernate(GError **);
+extern gint dbus_polkit_Check(const gchar *);
+extern gboolean dbus_polkit_Authorize(const gchar *, guint, GCancellable *, GError **);
 
 #endif
@@ -0,0 +1,428 @@
+/**
+ * Copyright (c) 2011-2013 Fabrice THIROUX <fabrice.thiroux@free.fr> (GPL-3+).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or any
+ * later version. See http://www.gnu.org/copyleft/gpl.html the full text
+ * of the license.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Site scripts run before (and after resuming from) an action. Each one
+ * is a [Hook name] group of obsession.conf:
+ *
+ *   [Hook stop-vms]
+ *   command=virsh managedsave-all
+ *   actions=suspend;hibernate;reboot;poweroff
+ *   when=pre
+ *   after=unmount-shares
+ *   timeout=20
+ *
+ * The hooks of an action start together, but a hook waits for the ones
+ * listed in "after". Each has its own timeout and all of them must be
+ * done before the [Hooks] deadline, then the action goes on anyway.
+ */
+
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "obsession.h"
+
+#define DEFAULT_HOOK_TIMEOUT 10
+#define DEFAULT_HOOKS_DEADLINE 30
+
+typedef struct {
+	gchar *name;
+	gchar *command;
+	gchar **actions;
+	gboolean post;		/* Run after resuming, not before the action */
+	gint timeout;		/* in s */
+	gchar **after;		/* Hooks to wait for */
+} Hook;
+
+enum {
+	HOOK_WAITING,
+	HOOK_RUNNING,
+	HOOK_DONE
+};
+
+typedef struct {
+	Hook *hook;
+	gint state;
+	GPid pid;		/* Leads the process group of the hook */
+	gint64 started;
+	GSource *child_source;
+	GSource *timeout_source;
+} HookRun;
+
+typedef struct {
+	GMainContext *context;
+	GMainLoop *loop;
+	GPtrArray *runs;
+	gchar **envp;
+	guint running;
+	guint left;
+} HooksRun;
+
+static void hook_free (gpointer data)
+{
+	Hook *hook = data;
+
+	g_free (hook->name);
+	g_free (hook->command);
+	g_strfreev (hook->actions);
+	g_strfreev (hook->after);
+	g_free (hook);
+}
+
+/* Read the [Hooks] group and the [Hook name] groups. */
+void hooks_load (HandlerContext* handler_context, GKeyFile *kf)
+{
+	gchar **groups = g_key_file_get_groups (kf, NULL);
+	GError *error = NULL;
+	gint i;
+
+	handler_context->hooks_deadline = g_key_file_get_integer (kf, "Hooks", "deadline", &error);
+	if (error)
+	{
+		handler_context->hooks_deadline = DEFAULT_HOOKS_DEADLINE;
+		g_clear_error (&error);
+	}
+	handler_context->hooks = g_ptr_array_new_with_free_func (hook_free);
+
+	for (i = 0; groups[i]; i++)
+	{
+		Hook *hook;
+		gchar *when;
+
+		if (!g_str_has_prefix (groups[i], "Hook "))
+			continue;
+
+		hook = g_new0 (Hook, 1);
+		hook->name = g_strdup (groups[i] + strlen ("Hook "));
+		hook->command = g_key_file_get_string (kf, groups[i], "command", NULL);
+		hook->actions = g_key_file_get_string_list (kf, groups[i], "actions", NULL, NULL);
+		hook->after = g_key_file_get_string_list (kf, groups[i], "after", NULL, NULL);
+		hook->timeout = g_key_file_get_integer (kf, groups[i], "timeout", NULL);
+		if (hook->timeout <= 0)
+			hook->timeout = DEFAULT_HOOK_TIMEOUT;
+
+		when = g_key_file_get_string (kf, groups[i], "when", NULL);
+		hook->post = g_strcmp0 (when, "post") == 0;
+		g_free (when);
+
+		if (hook->command == NULL || hook->actions == NULL)
+		{
+			g_warning ("Hook '%s' needs a command and actions", hook->name);
+			hook_free (hook);
+			continue;
+		}
+		g_ptr_array_add (handler_context->hooks, hook);
+	}
+
+	g_strfreev (groups);
+}
+
+void hooks_free (HandlerContext* handler_context)
+{
+	if (handler_context->hooks)
+		g_ptr_array_free (handler_context->hooks, TRUE);
+	handler_context->hooks = NULL;
+}
+
+static gboolean strv_has (gchar **strv, const gchar *value)
+{
+	gint i;
+
+	for (i = 0; strv && strv[i]; i++)
+	{
+		if (g_strcmp0 (strv[i], value) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static void hooks_start_ready (HooksRun *run, gboolean force);
+
+static void hook_report (HookRun *hook_run, const gchar *how)
+{
+	gint64 elapsed = (g_get_monotonic_time () - hook_run->started) / G_TIME_SPAN_MILLISECOND;
+
+	g_message ("Hook '%s' %s after %" G_GINT64_FORMAT " ms", hook_run->hook->name, how, elapsed);
+}
+
+/* Child watches only give one pointer: keep the whole run around. */
+typedef struct {
+	HooksRun *run;
+	HookRun *hook_run;
+} HookWatch;
+
+static void hook_done (HooksRun *run, HookRun *hook_run)
+{
+	hook_run->state = HOOK_DONE;
+	run->running--;
+	run->left--;
+
+	if (hook_run->timeout_source)
+	{
+		g_source_destroy (hook_run->timeout_source);
+		g_source_unref (hook_run->timeout_source);
+		hook_run->timeout_source = NULL;
+	}
+
+	if (run->left == 0)
+		g_main_loop_quit (run->loop);
+	else
+		hooks_start_ready (run, FALSE);
+}
+
+static void hook_watch_exited (GPid pid, gint status, gpointer data)
+{
+	HookWatch *watch = data;
+	GError *error = NULL;
+
+	g_spawn_close_pid (pid);
+	if (watch->hook_run->state != HOOK_RUNNING)
+		return;
+
+#if GLIB_CHECK_VERSION(2,70,0)
+	if (g_spawn_check_wait_status (status, &error))
+#else
+	if (g_spawn_check_exit_status (status, &error))
+#endif
+		hook_report (watch->hook_run, "succeeded");
+	else
+	{
+		gchar *how = g_strdup_printf ("failed (%s)", error->message);
+		hook_report (watch->hook_run, how);
+		g_free (how);
+		g_error_free (error);
+	}
+
+	hook_done (watch->run, watch->hook_run);
+}
+
+/* Kill the hook and whatever it started, and reap it now: its child watch
+ * goes away with the private context of the run. */
+static void hook_kill (HookRun *hook_run)
+{
+	if (hook_run->child_source)
+	{
+		g_source_destroy (hook_run->child_source);
+		g_source_unref (hook_run->child_source);
+		hook_run->child_source = NULL;
+	}
+
+	kill (-hook_run->pid, SIGKILL);
+	waitpid (hook_run->pid, NULL, 0);
+	g_spawn_close_pid (hook_run->pid);
+}
+
+static gboolean hook_timeout (gpointer data)
+{
+	HookWatch *watch = data;
+	HooksRun *run = watch->run;
+	HookRun *hook_run = watch->hook_run;
+
+	/* The child watch owns watch, it goes with it. */
+	hook_kill (hook_run);
+	hook_report (hook_run, "killed, out of time");
+	hook_done (run, hook_run);
+	return FALSE;
+}
+
+/* A process group per hook, to kill all of it. */
+static void hook_child_setup (gpointer data)
+{
+	setpgid (0, 0);
+}
+
+static void hook_start (HooksRun *run, HookRun *hook_run)
+{
+	gchar **argv = NULL;
+	GError *error = NULL;
+	HookWatch *watch;
+
+	hook_run->started = g_get_monotonic_time ();
+	hook_run->state = HOOK_RUNNING;
+	run->running++;
+
+	self_stats_spawned ();
+	if (!g_shell_parse_argv (hook_run->hook->command, NULL, &argv, &error) ||
+	    !g_spawn_async (NULL, argv, run->envp, G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD,
+	                    hook_child_setup, NULL, &hook_run->pid, &error))
+	{
+		gchar *how = g_strdup_printf ("not started (%s)", error->message);
+		hook_report (hook_run, how);
+		g_free (how);
+		g_error_free (error);
+		g_strfreev (argv);
+		hook_done (run, hook_run);
+		return;
+	}
+	g_strfreev (argv);
+
+	/* Also from here: a kill may come before the child runs. */
+	setpgid (hook_run->pid, hook_run->pid);
+
+	watch = g_new (HookWatch, 1);
+	watch->run = run;
+	watch->hook_run = hook_run;
+
+	hook_run->child_source = g_child_watch_source_new (hook_run->pid);
+	g_source_set_callback (hook_run->child_source, (GSourceFunc) hook_watch_exited, watch, g_free);
+	g_source_attach (hook_run->child_source, run->context);
+
+	hook_run->timeout_source = g_timeout_source_new_seconds (hook_run->hook->timeout);
+	g_source_set_callback (hook_run->timeout_source, hook_timeout, watch, NULL);
+	g_source_attach (hook_run->timeout_source, run->context);
+}
+
+/* Is every hook listed in "after" done, or not part of this run? */
+static gboolean hook_ready (HooksRun *run, HookRun *hook_run)
+{
+	guint i;
+
+	for (i = 0; i < run->runs->len; i++)
+	{
+		HookRun *other = g_ptr_array_index (run->runs, i);
+
+		if (other->state != HOOK_DONE && strv_has (hook_run->hook->after, other->hook->name))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* Start the waiting hooks whose dependencies are done. When nothing runs
+ * and nothing can start, the dependencies loop: start them anyway. */
+static void hooks_start_ready (HooksRun *run, gboolean force)
+{
+	guint i;
+
+	for (i = 0; i < run->runs->len; i++)
+	{
+		HookRun *hook_run = g_ptr_array_index (run->runs, i);
+
+		if (hook_run->state == HOOK_WAITING && (force || hook_ready (run, hook_run)))
+			hook_start (run, hook_run);
+	}
+
+	if (run->running == 0 && run->left > 0 && !force)
+	{
+		g_warning ("Hooks depend on each other, starting them all");
+		hooks_start_ready (run, TRUE);
+	}
+}
+
+static gboolean hooks_deadline (gpointer data)
+{
+	HooksRun *run = data;
+	guint i;
+
+	for (i = 0; i < run->runs->len; i++)
+	{
+		HookRun *hook_run = g_ptr_array_index (run->runs, i);
+
+		if (hook_run->state == HOOK_RUNNING)
+		{
+			hook_kill (hook_run);
+			hook_report (hook_run, "killed, deadline reached");
+		}
+		else if (hook_run->state == HOOK_WAITING)
+			g_message ("Hook '%s' not run, deadline reached", hook_run->hook->name);
+	}
+
+	g_main_loop_quit (run->loop);
+	return FALSE;
+}
+
+/* Run the hooks of action ("suspend", "hibernate", "reboot", "poweroff",
+ * "logout"), the pre ones or the post ones, and wait for them at most
+ * hooks_deadline seconds. They get OBSESSION_ACTION and OBSESSION_STAGE
+ * in their environment.
+ */
+void hooks_run (HandlerContext* handler_context, const gchar *action, gboolean post)
+{
+	gint64 started = g_get_monotonic_time ();
+	HooksRun run;
+	GSource *deadline;
+	guint i;
+
+	if (handler_context->hooks == NULL || action == NULL)
+		return;
+
+	memset (&run, 0, sizeof(run));
+	run.runs = g_ptr_array_new_with_free_func (g_free);
+	for (i = 0; i < handler_context->hooks->len; i++)
+	{
+		Hook *hook = g_ptr_array_index (handler_context->hooks, i);
+
+		if (hook->post == post && strv_has (hook->actions, action))
+		{
+			HookRun *hook_run = g_new0 (HookRun, 1);
+			hook_run->hook = hook;
+			g_ptr_array_add (run.runs, hook_run);
+		}
+	}
+
+	run.left = run.runs->len;
+	if (run.left == 0)
+	{
+		g_ptr_array_free (run.runs, TRUE);
+		return;
+	}
+
+	run.envp = g_get_environ ();
+	run.envp = g_environ_setenv (run.envp, "OBSESSION_ACTION", action, TRUE);
+	run.envp = g_environ_setenv (run.envp, "OBSESSION_STAGE", post ? "post" : "pre", TRUE);
+
+	/* A private context: nothing else (dialog, daemon) runs meanwhile. */
+	run.context = g_main_context_new ();
+	run.loop = g_main_loop_new (run.context, FALSE);
+
+	deadline = g_timeout_source_new_seconds (handler_context->hooks_deadline);
+	g_source_set_callback (deadline, hooks_deadline, &run, NULL);
+	g_source_attach (deadline, run.context);
+
+	hooks_start_ready (&run, FALSE);
+	if (run.left > 0)
+		g_main_loop_run (run.loop);
+
+	g_source_destroy (deadline);
+	g_source_unref (deadline);
+	for (i = 0; i < run.runs->len; i++)
+	{
+		HookRun *hook_run = g_ptr_array_index (run.runs, i);
+
+		if (hook_run->timeout_source)
+		{
+			g_source_destroy (hook_run->timeout_source);
+			g_source_unref (hook_run->timeout_source);
+		}
+		if (hook_run->child_source)
+		{
+			g_source_destroy (hook_run->child_source);
+			g_source_unref (hook_run->child_source);
+		}
+	}
+
+	g_message ("%s hooks of %s done in %" G_GINT64_FORMAT " ms", post ? "Post" : "Pre", action,
+	           (g_get_monotonic_time () - started) / G_TIME_SPAN_MILLISECOND);
+
+	g_main_loop_unref (run.loop);
+	g_main_context_unref (run.context);
+	g_strfreev (run.envp);
+	g_ptr_array_free (run.runs, TRUE);
+}
@@ -0,0 +1,251 @@
+/**
+ * Copyright (c) 2011-2013 Fabrice THIROUX <fabrice.thiroux@free.fr> (GPL-3+).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or any
+ * later version. See http://www.gnu.org/copyleft/gpl.html the full text
+ * of the license.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Key bindings of obsession-exit --daemon. The keys of the [Keys] group
+ * are grabbed on the root window; a key press runs its action with the
+ * context probed at start (and kept up to date by D-Bus signals), no
+ * process nor discovery in between:
+ *
+ *   [Keys]
+ *   lock=W-l
+ *   suspend=XF86Sleep
+ *   poweroff=C-A-Delete
+ *
+ * Bindings are written as in openbox's rc.xml: modifiers S (Shift),
+ * C (Control), A or M (Mod1), W (Mod4) and H (Mod3) joined with "-" to
+ * the key name.
+ */
+
+#include <string.h>
+#include <glib-unix.h>
+#include <X11/Xlib.h>
+#include <X11/keysym.h>
+
+#include "obsession.h"
+
+typedef struct {
+	const gchar *action;
+	KeyCode keycode;
+	unsigned int modifiers;
+} Hotkey;
+
+typedef struct {
+	HandlerContext *handler_context;
+	Display *display;
+	unsigned int ignored;	/* Lock modifiers: Caps Lock, Num Lock */
+	GArray *keys;
+	gboolean grab_failed;
+} HotkeyPolicy;
+
+static HotkeyPolicy hotkey;
+
+static unsigned int modifier_mask (Display *display, KeySym keysym)
+{
+	XModifierKeymap *map = XGetModifierMapping (display);
+	KeyCode keycode = XKeysymToKeycode (display, keysym);
+	unsigned int mask = 0;
+	gint i;
+
+	for (i = 0; keycode && i < 8 * map->max_keypermod; i++)
+	{
+		if (map->modifiermap[i] == keycode)
+			mask = 1 << (i / map->max_keypermod);
+	}
+	XFreeModifiermap (map);
+	return mask;
+}
+
+/* "C-A-Delete" to a keycode and modifiers. */
+static gboolean hotkey_parse (const gchar *binding, Hotkey *key)
+{
+	gchar **parts = g_strsplit (binding, "-", -1);
+	guint length = g_strv_length (parts);
+	KeySym keysym;
+	guint i;
+
+	key->modifiers = 0;
+	for (i = 0; i + 1 < length; i++)
+	{
+		if (g_strcmp0 (parts[i], "S") == 0)
+			key->modifiers |= ShiftMask;
+		else if (g_strcmp0 (parts[i], "C") == 0)
+			key->modifiers |= ControlMask;
+		else if (g_strcmp0 (parts[i], "A") == 0 || g_strcmp0 (parts[i], "M") == 0)
+			key->modifiers |= Mod1Mask;
+		else if (g_strcmp0 (parts[i], "W") == 0)
+			key->modifiers |= Mod4Mask;
+		else if (g_strcmp0 (parts[i], "H") == 0)
+			key->modifiers |= Mod3Mask;
+		else
+			break;
+	}
+
+	keysym = (i + 1 == length) ? XStringToKeysym (parts[i]) : NoSymbol;
+	g_strfreev (parts);
+
+	key->keycode = keysym != NoSymbol ? XKeysymToKeycode (hotkey.display, keysym) : 0;
+	return key->keycode != 0;
+}
+
+static int grab_error (Display *display, XErrorEvent *event)
+{
+	hotkey.grab_failed = TRUE;
+	return 0;
+}
+
+/* Grab with every combination of the lock modifiers, or Num Lock would
+ * disable the key. */
+static gboolean hotkey_grab (Hotkey *key)
+{
+	Window root = DefaultRootWindow (hotkey.display);
+	XErrorHandler old_handler;
+	unsigned int lock;
+
+	hotkey.grab_failed = FALSE;
+	old_handler = XSetErrorHandler (grab_error);
+
+	for (lock = 0; lock <= hotkey.ignored; lock++)
+	{
+		if ((lock & hotkey.ignored) == lock)
+			XGrabKey (hotkey.display, key->keycode, key->modifiers | lock, root, True, GrabModeAsync, GrabModeAsync);
+	}
+
+	XSync (hotkey.display, False);
+	XSetErrorHandler (old_handler);
+	return !hotkey.grab_failed;
+}
+
+static void hotkey_run (const gchar *action)
+{
+	HandlerContext *handler_context = hotkey.handler_context;
+	GError *err = NULL;
+
+	g_message ("Key pressed, %s", action);
+
+	if (g_strcmp0 (action, "lock") == 0)
+	{
+		lock_screen (handler_context->lock_cmd);
+		return;
+	}
+	else if (g_strcmp0 (action, "suspend") == 0)
+		system_suspend (handler_context, &err);
+	else if (g_strcmp0 (action, "hibernate") == 0)
+		system_hibernate (handler_context, &err);
+	else if (g_strcmp0 (action, "reboot") == 0)
+		system_reboot (handler_context, &err);
+	else if (g_strcmp0 (action, "poweroff") == 0)
+		system_poweroff (handler_context, &err);
+	else if (g_strcmp0 (action, "logout") == 0)
+		system_logout (handler_context, &err);
+
+	if (err)
+	{
+		g_warning ("Can't %s: %s", action, err->message);
+		g_error_free (err);
+		return;
+	}
+
+	if (g_strcmp0 (action, "suspend") == 0 || g_strcmp0 (action, "hibernate") == 0)
+		sleep_wait_resume (handler_context);
+}
+
+static gboolean hotkey_x_event (gint fd, GIOCondition condition, gpointer data)
+{
+	while (XPending (hotkey.display))
+	{
+		XEvent event;
+		guint i;
+
+		XNextEvent (hotkey.display, &event);
+		if (event.type != KeyPress)
+			continue;
+
+		for (i = 0; i < hotkey.keys->len; i++)
+		{
+			Hotkey *key = &g_array_index (hotkey.keys, Hotkey, i);
+
+			if (key->keycode == event.xkey.keycode &&
+			    key->modifiers == (event.xkey.state & ~hotkey.ignored & (ShiftMask | ControlMask | Mod1Mask | Mod2Mask | Mod3Mask | Mod4Mask | Mod5Mask)))
+			{
+				hotkey_run (key->action);
+				/* Presses queued while we slept are stale. */
+				XSync (hotkey.display, True);
+				break;
+			}
+		}
+	}
+	return TRUE;
+}
+
+/* Start the key bindings for obsession-exit --daemon. */
+gboolean hotkey_policy_start (HandlerContext *handler_context)
+{
+	const struct {
+		const gchar *action;
+		const gchar *binding;
+	} bindings[] = {
+		{ "lock", handler_context->key_lock },
+		{ "suspend", handler_context->key_suspend },
+		{ "hibernate", handler_context->key_hibernate },
+		{ "reboot", handler_context->key_reboot },
+		{ "poweroff", handler_context->key_poweroff },
+		{ "logout", handler_context->key_logout },
+	};
+	gint i;
+
+	hotkey.handler_context = handler_context;
+	hotkey.display = XOpenDisplay (NULL);
+	if (hotkey.display == NULL)
+	{
+		g_warning ("Can't open the display, no key bindings");
+		return FALSE;
+	}
+
+	hotkey.ignored = LockMask | modifier_mask (hotkey.display, XK_Num_Lock);
+	hotkey.keys = g_array_new (FALSE, FALSE, sizeof(Hotkey));
+
+	for (i = 0; i < G_N_ELEMENTS (bindings); i++)
+	{
+		Hotkey key = { bindings[i].action };
+
+		if (bindings[i].binding == NULL)
+			continue;
+
+		if (!hotkey_parse (bindings[i].binding, &key))
+			g_warning ("Unknown key '%s' for %s", bindings[i].binding, key.action);
+		else if (!hotkey_grab (&key))
+			g_warning ("Key '%s' for %s is taken by another application", bindings[i].binding, key.action);
+		else
+			g_array_append_val (hotkey.keys, key);
+	}
+
+	if (hotkey.keys->len == 0)
+	{
+		g_array_free (hotkey.keys, TRUE);
+		XCloseDisplay (hotkey.display);
+		hotkey.display = NULL;
+		return FALSE;
+	}
+
+	/* The providers may come and go while we wait for keys. */
+	context_watch (handler_context, NULL);
+
+	g_unix_fd_add (ConnectionNumber (hotkey.display), G_IO_IN, hotkey_x_event, NULL);
+	return TRUE;
+}
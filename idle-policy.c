@@ -0,0 +1,235 @@
+/**
+ * Copyright (c) 2011-2013 Fabrice THIROUX <fabrice.thiroux@free.fr> (GPL-3+).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or any
+ * later version. See http://www.gnu.org/copyleft/gpl.html the full text
+ * of the license.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Idle policy of obsession-exit --daemon. The X server counts the idle
+ * time (IDLETIME system counter of the SYNC extension) and wakes us up
+ * with an alarm when a threshold is reached, then when the user is back:
+ * nothing runs while the user is active.
+ */
+
+#include <string.h>
+#include <glib-unix.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/sync.h>
+
+#include "obsession.h"
+#include "dbus-interface.h"
+
+enum {
+	IDLE_LOCK,
+	IDLE_SUSPEND,
+	IDLE_HIBERNATE,
+	IDLE_ACTIONS
+};
+
+static const gchar *idle_names[IDLE_ACTIONS] = { "lock", "suspend", "hibernate" };
+
+typedef struct {
+	HandlerContext *handler_context;
+	Display *display;
+	int event_base;
+	XSyncCounter counter;
+	gint64 thresholds[IDLE_ACTIONS];	/* in ms, 0 or less if disabled */
+	XSyncAlarm alarms[IDLE_ACTIONS];
+	XSyncAlarm reset;			/* Fires when the user is back */
+} IdlePolicy;
+
+static IdlePolicy idle;
+
+static XSyncCounter idle_counter (Display *display)
+{
+	XSyncSystemCounter *counters;
+	XSyncCounter counter = None;
+	int i, count;
+
+	counters = XSyncListSystemCounters (display, &count);
+	for (i = 0; i < count; i++)
+	{
+		if (g_strcmp0 (counters[i].name, "IDLETIME") == 0)
+			counter = counters[i].counter;
+	}
+
+	if (counters)
+		XSyncFreeSystemCounterList (counters);
+	return counter;
+}
+
+/* Create or (re)arm alarm: it fires once when the idle time goes above
+ * (or below, when positive is FALSE) value ms. */
+static XSyncAlarm idle_set_alarm (XSyncAlarm alarm, gint64 value, gboolean positive)
+{
+	XSyncAlarmAttributes attributes;
+	unsigned long flags = XSyncCACounter | XSyncCAValueType | XSyncCATestType | XSyncCAValue | XSyncCADelta;
+
+	attributes.trigger.counter = idle.counter;
+	attributes.trigger.value_type = XSyncAbsolute;
+	attributes.trigger.test_type = positive ? XSyncPositiveComparison : XSyncNegativeComparison;
+	XSyncIntsToValue (&attributes.trigger.wait_value, value & 0xffffffff, value >> 32);
+	/* A zero delta makes the alarm inactive once it fired. */
+	XSyncIntToValue (&attributes.delta, 0);
+
+	if (alarm == None)
+		return XSyncCreateAlarm (idle.display, flags, &attributes);
+
+	XSyncChangeAlarm (idle.display, alarm, flags, &attributes);
+	return alarm;
+}
+
+static void idle_arm_all (void)
+{
+	gint i;
+
+	for (i = 0; i < IDLE_ACTIONS; i++)
+	{
+		if (idle.thresholds[i] > 0)
+			idle.alarms[i] = idle_set_alarm (idle.alarms[i], idle.thresholds[i], TRUE);
+	}
+}
+
+/* Media players and applications holding a logind "idle" inhibitor keep
+ * the session awake. */
+static gboolean idle_inhibited (void)
+{
+	gboolean blocked = FALSE;
+	gchar *list;
+
+	if (dbus_mpris_Playing ())
+	{
+		g_message ("Idle action postponed: media is playing");
+		return TRUE;
+	}
+
+	list = system_inhibitors ("idle", &blocked);
+	if (blocked)
+		g_message ("Idle action postponed, blocked by:\n%s", list);
+	g_free (list);
+	return blocked;
+}
+
+static void idle_run (gint action)
+{
+	HandlerContext *handler_context = idle.handler_context;
+	GError *err = NULL;
+
+	g_message ("Idle for %" G_GINT64_FORMAT " s, %s", idle.thresholds[action] / 1000, idle_names[action]);
+
+	switch (action)
+	{
+		case IDLE_LOCK:
+			lock_screen (handler_context->lock_cmd);
+			return;
+
+		case IDLE_SUSPEND:
+			system_suspend (handler_context, &err);
+			break;
+
+		case IDLE_HIBERNATE:
+			system_hibernate (handler_context, &err);
+			break;
+	}
+
+	if (err)
+	{
+		g_warning ("Can't %s: %s", idle_names[action], err->message);
+		g_error_free (err);
+		return;
+	}
+
+	sleep_wait_resume (handler_context);
+
+	/* The idle time keeps growing while asleep: start again from zero,
+	 * or the next threshold would be reached right after the resume. */
+	XResetScreenSaver (idle.display);
+	XFlush (idle.display);
+}
+
+static void idle_alarm (XSyncAlarmNotifyEvent *event)
+{
+	gint64 value = ((gint64) XSyncValueHigh32 (event->counter_value) << 32) | XSyncValueLow32 (event->counter_value);
+	gint i;
+
+	if (event->alarm == idle.reset)
+	{
+		/* The user is back. */
+		idle_arm_all ();
+		return;
+	}
+
+	for (i = 0; i < IDLE_ACTIONS; i++)
+	{
+		if (event->alarm != idle.alarms[i])
+			continue;
+
+		/* Ask again after the same idle time. */
+		if (idle_inhibited ())
+			idle.alarms[i] = idle_set_alarm (idle.alarms[i], value + idle.thresholds[i], TRUE);
+		else
+			idle_run (i);
+	}
+
+	/* Wait for the user. */
+	idle.reset = idle_set_alarm (idle.reset, MAX (value - 1, 0), FALSE);
+}
+
+static gboolean idle_x_event (gint fd, GIOCondition condition, gpointer data)
+{
+	while (XPending (idle.display))
+	{
+		XEvent event;
+
+		XNextEvent (idle.display, &event);
+		if (event.type == idle.event_base + XSyncAlarmNotify)
+			idle_alarm ((XSyncAlarmNotifyEvent *) &event);
+	}
+	XFlush (idle.display);
+	return TRUE;
+}
+
+/* Start the idle policy for obsession-exit --daemon. */
+gboolean idle_policy_start (HandlerContext *handler_context)
+{
+	int error_base, major, minor;
+
+	idle.handler_context = handler_context;
+	idle.thresholds[IDLE_LOCK] = handler_context->idle_lock * G_GINT64_CONSTANT (1000);
+	idle.thresholds[IDLE_SUSPEND] = handler_context->idle_suspend * G_GINT64_CONSTANT (1000);
+	idle.thresholds[IDLE_HIBERNATE] = handler_context->idle_hibernate * G_GINT64_CONSTANT (1000);
+
+	idle.display = XOpenDisplay (NULL);
+	if (idle.display == NULL)
+	{
+		g_warning ("Can't open the display, no idle policy");
+		return FALSE;
+	}
+
+	if (!XSyncQueryExtension (idle.display, &idle.event_base, &error_base) ||
+	    !XSyncInitialize (idle.display, &major, &minor) ||
+	    (idle.counter = idle_counter (idle.display)) == None)
+	{
+		g_warning ("No IDLETIME counter, no idle policy");
+		XCloseDisplay (idle.display);
+		idle.display = NULL;
+		return FALSE;
+	}
+
+	idle_arm_all ();
+	XFlush (idle.display);
+	g_unix_fd_add (ConnectionNumber (idle.display), G_IO_IN, idle_x_event, NULL);
+	return TRUE;
+}
@@ -0,0 +1,295 @@
+/**
+ * Copyright (c) 2011-2013 Fabrice THIROUX <fabrice.thiroux@free.fr> (GPL-3+).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or any
+ * later version. See http://www.gnu.org/copyleft/gpl.html the full text
+ * of the license.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Timings of the startup helpers which only touch the filesystem:
+ * verify_running(), session_get_name() and load_config(). Each scenario
+ * builds a synthetic tree (PATH, XDG_DATA_DIRS, xsessions, config) and
+ * runs in its own process, as glib caches the XDG directories.
+ *
+ * The syscalls are counted apart, after the timing: a child runs the
+ * helper again under ptrace and every syscall stop is counted. Run
+ * "strace -c ./obsession-bench --only NAME" to see which ones.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "config.h"
+#include "obsession.h"
+
+#define DEFAULT_ITERATIONS 2000
+/* Calls traced to count the syscalls, tracing is slow. */
+#define COUNTED_CALLS 200
+
+typedef struct {
+	const gchar *name;
+	const gchar *helper;
+	gint path_dirs;		/* PATH length */
+	gboolean in_path;	/* The executable is in the last one */
+	gint data_dirs;		/* XDG_DATA_DIRS length */
+	gint xsessions;		/* .desktop files in each xsessions directory */
+	gboolean config;	/* obsession.conf present */
+} Scenario;
+
+static const Scenario scenarios[] = {
+	{ "verify-short-missing", "verify_running", 5, FALSE, 3, 0, TRUE },
+	{ "verify-long-missing", "verify_running", 200, FALSE, 3, 0, TRUE },
+	{ "verify-long-present", "verify_running", 200, TRUE, 3, 0, TRUE },
+	{ "name-few-dirs", "session_get_name", 5, FALSE, 3, 10, TRUE },
+	{ "name-many-dirs", "session_get_name", 5, FALSE, 50, 10, TRUE },
+	{ "name-many-sessions", "session_get_name", 5, FALSE, 50, 500, TRUE },
+	{ "config-present", "load_config", 5, FALSE, 3, 0, TRUE },
+	{ "config-missing", "load_config", 5, FALSE, 3, 0, FALSE },
+	{ NULL }
+};
+
+static gint iterations = DEFAULT_ITERATIONS;
+static gchar *only = NULL;
+
+static GOptionEntry opt_entries[] = {
+	{ "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations, "Calls per scenario", "N" },
+	{ "only", 0, 0, G_OPTION_ARG_STRING, &only, "Run this scenario only", "NAME" },
+	{ NULL }
+};
+
+static void write_file (const gchar *pathname, const gchar *content)
+{
+	gchar *dirname = g_path_get_dirname (pathname);
+
+	g_mkdir_with_parents (dirname, 0700);
+	g_file_set_contents (pathname, content, -1, NULL);
+	g_free (dirname);
+}
+
+/* Build the tree of scenario under root and point the environment at it. */
+static void scenario_setup (const Scenario *scenario, const gchar *root)
+{
+	GString *path = g_string_new (NULL);
+	GString *data_dirs = g_string_new (NULL);
+	gchar *pathname;
+	gint i, j;
+
+	for (i = 0; i < scenario->path_dirs; i++)
+	{
+		pathname = g_strdup_printf ("%s/bin%d", root, i);
+		g_mkdir_with_parents (pathname, 0700);
+		g_string_append_printf (path, "%s%s", i ? ":" : "", pathname);
+		g_free (pathname);
+	}
+	if (scenario->in_path)
+	{
+		pathname = g_strdup_printf ("%s/bin%d/lxdm", root, scenario->path_dirs - 1);
+		write_file (pathname, "#!/bin/sh\n");
+		g_chmod (pathname, 0755);
+		g_free (pathname);
+	}
+
+	/* The session is only described in the last directory. */
+	for (i = 0; i < scenario->data_dirs; i++)
+	{
+		pathname = g_strdup_printf ("%s/data%d", root, i);
+		g_string_append_printf (data_dirs, "%s%s", i ? ":" : "", pathname);
+		g_free (pathname);
+
+		for (j = 0; j < scenario->xsessions; j++)
+		{
+			pathname = g_strdup_printf ("%s/data%d/xsessions/session%d.desktop", root, i, j);
+			write_file (pathname, "[Desktop Entry]\nName=Other\n");
+			g_free (pathname);
+		}
+	}
+	pathname = g_strdup_printf ("%s/data%d/xsessions/bench.desktop", root, scenario->data_dirs - 1);
+	write_file (pathname, "[Desktop Entry]\nName=Bench\nExec=true\n");
+	g_free (pathname);
+
+	if (scenario->config)
+	{
+		pathname = g_strdup_printf ("%s/config/obsession.conf", root);
+		write_file (pathname, "[Session]\nscreenlock=xlock -mode blank\nclose_timeout=10\n"
+		                      "[Idle]\nlock=300\n[Hibernate]\nreclaim=true\n");
+		g_free (pathname);
+	}
+
+	/* A missing directory: load_config can't create the file either. */
+	pathname = g_strdup_printf ("%s/%s", root, scenario->config ? "config" : "nowhere/config");
+	g_setenv ("XDG_CONFIG_HOME", pathname, TRUE);
+	g_free (pathname);
+
+	g_setenv ("PATH", path->str, TRUE);
+	g_setenv ("XDG_DATA_DIRS", data_dirs->str, TRUE);
+	g_setenv ("DESKTOP_SESSION", "bench", TRUE);
+
+	g_string_free (path, TRUE);
+	g_string_free (data_dirs, TRUE);
+}
+
+static void remove_tree (const gchar *pathname)
+{
+	GDir *dir = g_dir_open (pathname, 0, NULL);
+	const gchar *name;
+
+	if (dir)
+	{
+		while ((name = g_dir_read_name (dir)))
+		{
+			gchar *child = g_build_filename (pathname, name, NULL);
+			remove_tree (child);
+			g_free (child);
+		}
+		g_dir_close (dir);
+	}
+	g_remove (pathname);
+}
+
+static void call_helper (const Scenario *scenario)
+{
+	if (g_strcmp0 (scenario->helper, "verify_running") == 0)
+		verify_running ("lxdm", "lxdm");
+	else if (g_strcmp0 (scenario->helper, "session_get_name") == 0)
+		session_get_name ();
+	else
+	{
+		HandlerContext handler_context;
+
+		memset (&handler_context, 0, sizeof(HandlerContext));
+		load_config (&handler_context);
+		free_context (&handler_context);
+	}
+}
+
+/* Syscalls per call of the helper, counted by tracing a child which calls
+ * it: entry and exit stops, but exit_group() only enters. Return -1 if
+ * we can't trace. */
+static gdouble count_syscalls (const Scenario *scenario)
+{
+	gint calls = MIN (iterations, COUNTED_CALLS);
+	guint64 stops = 0;
+	gint status, i, pending = 0;
+	pid_t pid = fork ();
+
+	if (pid < 0)
+		return -1;
+
+	if (pid == 0)
+	{
+		if (ptrace (PTRACE_TRACEME, 0, NULL, NULL) < 0)
+			_exit (1);
+		raise (SIGSTOP);
+		for (i = 0; i < calls; i++)
+			call_helper (scenario);
+		_exit (0);
+	}
+
+	if (waitpid (pid, &status, 0) != pid || !WIFSTOPPED (status))
+		return -1;
+	ptrace (PTRACE_SETOPTIONS, pid, NULL, (void *) (PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL));
+
+	while (ptrace (PTRACE_SYSCALL, pid, NULL, GINT_TO_POINTER (pending)) == 0 &&
+	       waitpid (pid, &status, 0) == pid && WIFSTOPPED (status))
+	{
+		/* Other stops are signals for the child. */
+		pending = 0;
+		if (WSTOPSIG (status) == (SIGTRAP | 0x80))
+			stops++;
+		else
+			pending = WSTOPSIG (status);
+	}
+
+	if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+		return -1;
+	return (gdouble) ((stops + 1) / 2) / calls;
+}
+
+/* In a child process: the XDG directories are read once by glib. */
+static void scenario_run (const Scenario *scenario)
+{
+	gchar *root = g_dir_make_tmp ("obsession-bench-XXXXXX", NULL);
+	gint64 start, elapsed;
+	gdouble syscalls;
+	gint i;
+
+	if (root == NULL)
+		_exit (1);
+
+	scenario_setup (scenario, root);
+
+	/* Once to warm the caches up */
+	call_helper (scenario);
+
+	start = g_get_monotonic_time ();
+	for (i = 0; i < iterations; i++)
+		call_helper (scenario);
+	elapsed = g_get_monotonic_time () - start;
+	syscalls = count_syscalls (scenario);
+
+	if (syscalls < 0)
+		g_print ("%-22s %-18s %8.1f %10s\n", scenario->name, scenario->helper,
+		         (gdouble) elapsed / iterations, "-");
+	else
+		g_print ("%-22s %-18s %8.1f %10.1f\n", scenario->name, scenario->helper,
+		         (gdouble) elapsed / iterations, syscalls);
+
+	remove_tree (root);
+	g_free (root);
+	_exit (0);
+}
+
+int main (int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	gint i;
+
+	context = g_option_context_new ("");
+	g_option_context_add_main_entries (context, opt_entries, PACKAGE " " PACKAGE_VERSION);
+	if (!g_option_context_parse (context, &argc, &argv, &error))
+	{
+		g_print ("%s\n", error->message);
+		g_error_free (error);
+		return 1;
+	}
+	g_option_context_free (context);
+
+	if (iterations <= 0)
+		iterations = DEFAULT_ITERATIONS;
+
+	g_print ("%-22s %-18s %8s %10s\n", "scenario", "helper", "us/call", "syscalls");
+
+	for (i = 0; scenarios[i].name; i++)
+	{
+		pid_t pid;
+
+		if (only && g_strcmp0 (only, scenarios[i].name) != 0)
+			continue;
+
+		pid = fork ();
+		if (pid == 0)
+			scenario_run (&scenarios[i]);
+		else if (pid > 0)
+			waitpid (pid, NULL, 0);
+	}
+	return 0;
+}
@@ -18,14 +18,380 @@
  * along with this program; if not, write to the Free Software Foundation,
  * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
- #include <stdlib.h>
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
+#include <glib-unix.h>
+
+#include "config.h"
 #include "obsession.h"
 #include "dbus-interface.h"
+#include "sysfs-interface.h"
+#include "x-session.h"
+
+/* What "openbox --exit" does is now built in, see system_logout(). */
+#define DEFAULT_LOGOUT_CMD "openbox --exit"
+
+/* How long (awake) we wait for a resume before giving up recording it. */
+#define SLEEP_RESUME_TIMEOUT 60
+
+/* Memory asked to memory.reclaim at once, the time budget is checked
+ * between two requests. */
+#define RECLAIM_CHUNK (128 * 1024 * 1024)
+#define DEFAULT_RECLAIM_BUDGET 2000
+
+/* Working set read back after hibernating: time budget in ms, size in MiB */
+#define DEFAULT_PREFETCH_BUDGET 3000
+#define DEFAULT_PREFETCH_MAX 1024
+
+/* How long we wait for logind to announce a sleep we asked for, and for
+ * the screen locker to cover the screen, in ms. */
+#define LOCK_PREPARE_TIMEOUT 5000
+#define DEFAULT_LOCK_TIMEOUT 2000
+
+/* Time given to applications to close on logout, in s. */
+#define DEFAULT_CLOSE_TIMEOUT 10
+
+/* How long an action is still joined once done, in ms: requests fired
+ * together may come a bit late. */
+#define ACTION_GRACE 1000
+
+/* How long a joiner waits for the result of the action, in s, and the
+ * owner for the request of a joiner, in ms. */
+#define ACTION_JOIN_TIMEOUT 300
+#define ACTION_REQUEST_TIMEOUT 100
+
+/* Time given to the polkit agent, in s. */
+#define DEFAULT_AUTH_TIMEOUT 60
+
+
+/* Can logind do action? One question tells if it needs authentication
+ * too ("challenge"). */
+static gboolean probe_systemd (HandlerContext* handler_context, guint action, const gchar *function)
+{
+	gchar *answer = dbus_systemd_Can (function);
+	gboolean result = g_strcmp0 (answer, "yes") == 0 || g_strcmp0 (answer, "challenge") == 0;
+
+	if (g_strcmp0 (answer, "challenge") == 0)
+		handler_context->challenge |= action;
+	g_free (answer);
+	return result;
+}
+
+/* The polkit actions of logind for one of its actions. */
+enum {
+	LOGIND_PLAIN,
+	LOGIND_IGNORE_INHIBIT,
+	LOGIND_MULTIPLE_SESSIONS
+};
+
+/* polkit action of provider for action (ACTION_*), by bit of action.
+ * variant (LOGIND_*) only matters to logind. */
+static const gchar *polkit_action (gint provider, guint action, gint variant)
+{
+	static const gchar *systemd[][3] = {
+		{ "org.freedesktop.login1.power-off", "org.freedesktop.login1.power-off-ignore-inhibit",
+		  "org.freedesktop.login1.power-off-multiple-sessions" },
+		{ "org.freedesktop.login1.reboot", "org.freedesktop.login1.reboot-ignore-inhibit",
+		  "org.freedesktop.login1.reboot-multiple-sessions" },
+		{ "org.freedesktop.login1.suspend", "org.freedesktop.login1.suspend-ignore-inhibit",
+		  "org.freedesktop.login1.suspend-multiple-sessions" },
+		{ "org.freedesktop.login1.hibernate", "org.freedesktop.login1.hibernate-ignore-inhibit",
+		  "org.freedesktop.login1.hibernate-multiple-sessions" }
+	};
+	static const gchar *consolekit[] = {
+		"org.freedesktop.consolekit.system.stop",
+		"org.freedesktop.consolekit.system.restart",
+		"org.freedesktop.consolekit.system.suspend",
+		"org.freedesktop.consolekit.system.hibernate"
+	};
+	/* UPower only sleeps. */
+	static const gchar *upower[] = {
+		NULL,
+		NULL,
+		"org.freedesktop.upower.suspend",
+		"org.freedesktop.upower.hibernate"
+	};
+	gint i = g_bit_nth_lsf (action, -1);
+
+	if (i < 0 || i >= G_N_ELEMENTS (consolekit))
+		return NULL;
+
+	if (provider == SYSTEMD)
+		return systemd[i][variant];
+	else if (provider == CONSOLEKIT)
+		return consolekit[i];
+	else if (provider == UPOWER)
+		return upower[i];
+	return NULL;
+}
+
+/* ConsoleKit and UPower don't say if they need authentication: ask
+ * polkit, without interaction. */
+static void probe_polkit (HandlerContext* handler_context, guint actions)
+{
+	gint providers[] = { handler_context->poweroff, handler_context->reboot,
+	                     handler_context->suspend, handler_context->hibernate };
+	gint i;
+
+	for (i = 0; i < G_N_ELEMENTS (providers); i++)
+	{
+		if ((actions & (1 << i)) && (providers[i] == CONSOLEKIT || providers[i] == UPOWER) &&
+		    dbus_polkit_Check (polkit_action (providers[i], 1 << i, LOGIND_PLAIN)) == POLKIT_CHALLENGE)
+			handler_context->challenge |= 1 << i;
+	}
+}
+
+/* Authenticate now for a challenged action, with a time limit, so that
+ * the call itself never waits on an agent that isn't there. For logind,
+ * the actions it will check: -multiple-sessions when other users are
+ * logged in, -ignore-inhibit when it is blocked and we go on anyway, the
+ * plain one otherwise. interactive tells if the call may still involve
+ * the agent: only when there was nothing to authorize beforehand.
+ */
+static gboolean action_authorize (HandlerContext* handler_context, guint action, gint provider, gint code,
+                                  gboolean *interactive, GError **err)
+{
+	const gchar *ids[3] = { NULL, NULL, NULL };
+	GError *error = NULL;
+	gint i, count = 0;
+
+	*interactive = FALSE;
+	if (provider == SYSTEMD)
+	{
+		const gchar *what = action & (ACTION_SUSPEND | ACTION_HIBERNATE) ? "sleep" : "shutdown";
+		gboolean blocked = FALSE;
+
+		if (dbus_systemd_OtherSessions ())
+			ids[count++] = polkit_action (provider, action, LOGIND_MULTIPLE_SESSIONS);
+		if (handler_context->ignore_inhibitors)
+			g_free (system_inhibitors (what, &blocked));
+		if (blocked)
+			ids[count++] = polkit_action (provider, action, LOGIND_IGNORE_INHIBIT);
+		if (count == 0)
+			ids[count++] = polkit_action (provider, action, LOGIND_PLAIN);
+	}
+	else if (handler_context->challenge & action)
+	{
+		ids[count] = polkit_action (provider, action, LOGIND_PLAIN);
+		/* Nothing to ask beforehand: let the call ask. */
+		if (ids[count++] == NULL)
+			*interactive = TRUE;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		if (ids[i] == NULL || dbus_polkit_Check (ids[i]) != POLKIT_CHALLENGE)
+			continue;
+		if (!dbus_polkit_Authorize (ids[i], handler_context->auth_timeout, handler_context->cancellable, &error))
+		{
+			g_set_error (err, OBSESSION_ERROR, code, "Not authorized: %s", error->message);
+			g_error_free (error);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/* Is there a system bus to ask? A file test, no connection. */
+static gboolean system_bus_present (void)
+{
+	gchar *pathname;
+	gboolean present;
+
+	if (g_getenv ("DBUS_SYSTEM_BUS_ADDRESS"))
+		return TRUE;
+
+	pathname = sysfs_path ("/run/dbus/system_bus_socket");
+	present = g_file_test (pathname, G_FILE_TEST_EXISTS);
+	g_free (pathname);
+	return present;
+}
 
-static GQuark OBSESSION_ERROR;
+/* Can the kernel backend do action? Sleep states are read from
+ * /sys/power/state, reboot and poweroff only need the helper. */
+static gboolean kernel_can (guint action)
+{
+	switch (action)
+	{
+		case ACTION_SUSPEND:
+			return sysfs_choice_supported ("/sys/power/state", "mem") ||
+			       sysfs_choice_supported ("/sys/power/state", "freeze");
+		case ACTION_HIBERNATE:
+			return sysfs_choice_supported ("/sys/power/state", "disk");
+		default:
+			return TRUE;
+	}
+}
+
+/* Without a system bus, or when asked to, use the kernel directly. */
+static void kernel_probe (HandlerContext* handler_context, guint actions)
+{
+	if (actions & ACTION_POWEROFF)
+		handler_context->poweroff = kernel_can (ACTION_POWEROFF) ? KERNEL : NONE;
+	if (actions & ACTION_REBOOT)
+		handler_context->reboot = kernel_can (ACTION_REBOOT) ? KERNEL : NONE;
+	if (actions & ACTION_SUSPEND)
+		handler_context->suspend = kernel_can (ACTION_SUSPEND) ? KERNEL : NONE;
+	if (actions & ACTION_HIBERNATE)
+		handler_context->hibernate = kernel_can (ACTION_HIBERNATE) ? KERNEL : NONE;
+}
+
+/* Find out again who handles the given actions (ACTION_* flags). */
+void context_probe (HandlerContext* handler_context, guint actions)
+{
+	handler_context->challenge &= ~actions;
+
+	if (handler_context->backend == BACKEND_KERNEL ||
+	    (handler_context->backend == BACKEND_AUTO && !system_bus_present ()))
+	{
+		kernel_probe (handler_context, actions);
+		return;
+	}
+
+	/* Is poweroff controlled by systemd or ConsoleKit? */
+	if (actions & ACTION_POWEROFF)
+	{
+		if (dbus_ConsoleKit_CanPowerOff())
+		{
+			handler_context->poweroff = CONSOLEKIT;
+		}
+		else if (probe_systemd (handler_context, ACTION_POWEROFF, "CanPowerOff"))
+		{
+			handler_context->poweroff = SYSTEMD;
+		}
+		else
+			handler_context->poweroff = NONE;
+	}
+
+	/* Is reboot controlled by systemd or ConsoleKit? */
+	if (actions & ACTION_REBOOT)
+	{
+		if (probe_systemd (handler_context, ACTION_REBOOT, "CanReboot"))
+		{
+			handler_context->reboot = SYSTEMD;
+		}
+		else if (dbus_ConsoleKit_CanReboot())
+		{
+			handler_context->reboot = CONSOLEKIT;
+		}
+		else
+		{
+			handler_context->reboot = NONE;
+		}
+	}
+
+	/* Is suspend controlled by systemd or UPower? */
+	if (actions & ACTION_SUSPEND)
+	{
+		if (dbus_UPower_CanSuspend())
+		{
+			handler_context->suspend = UPOWER;
+		}
+		else if (probe_systemd (handler_context, ACTION_SUSPEND, "CanSuspend"))
+		{
+			handler_context->suspend = SYSTEMD;
+		}
+		else if (dbus_ConsoleKit_CanSuspend())
+		{
+			handler_context->suspend = CONSOLEKIT;
+		}
+		else
+		{
+			handler_context->suspend = NONE;
+		}
+	}
+
+	/* Is hibernation controlled by systemd or UPower? */
+	if (actions & ACTION_HIBERNATE)
+	{
+		if (dbus_UPower_CanHibernate())
+		{
+			handler_context->hibernate = UPOWER;
+		}
+		else if (dbus_ConsoleKit_CanHibernate())
+		{
+			handler_context->hibernate = CONSOLEKIT;
+		}
+		else if (probe_systemd (handler_context, ACTION_HIBERNATE, "CanHibernate"))
+		{
+			handler_context->hibernate = SYSTEMD;
+		}
+		else
+		{
+			handler_context->hibernate = NONE;
+		}
+	}
+
+	probe_polkit (handler_context, actions);
+}
+
+typedef struct {
+	HandlerContext *handler_context;
+	void (*changed) (HandlerContext *, guint);
+	guint pending;		/* Actions to probe again */
+	guint idle_source;
+} ContextWatch;
+
+static ContextWatch context_watch_data;
+
+static gboolean context_reprobe (gpointer data)
+{
+	guint actions = context_watch_data.pending;
+
+	context_watch_data.pending = 0;
+	context_watch_data.idle_source = 0;
+
+	context_probe (context_watch_data.handler_context, actions);
+	if (context_watch_data.changed)
+		context_watch_data.changed (context_watch_data.handler_context, actions);
+	return FALSE;
+}
+
+/* Something changed in a service: only the actions it handles, or that
+ * nobody handles, may move. Signals come in bursts, they are handled
+ * together once idle. */
+static void context_service_changed (const gchar *service, gpointer data)
+{
+	HandlerContext *handler_context = context_watch_data.handler_context;
+	gint provider = NONE;
+
+	if (g_strcmp0 (service, "org.freedesktop.login1") == 0)
+		provider = SYSTEMD;
+	else if (g_strcmp0 (service, "org.freedesktop.UPower") == 0)
+		provider = UPOWER;
+	else if (g_strcmp0 (service, "org.freedesktop.ConsoleKit") == 0)
+		provider = CONSOLEKIT;
+
+	if (handler_context->poweroff == provider || handler_context->poweroff == NONE)
+		context_watch_data.pending |= ACTION_POWEROFF;
+	if (handler_context->reboot == provider || handler_context->reboot == NONE)
+		context_watch_data.pending |= ACTION_REBOOT;
+	if (handler_context->suspend == provider || handler_context->suspend == NONE)
+		context_watch_data.pending |= ACTION_SUSPEND;
+	if (handler_context->hibernate == provider || handler_context->hibernate == NONE)
+		context_watch_data.pending |= ACTION_HIBERNATE;
+
+	if (context_watch_data.pending && !context_watch_data.idle_source)
+		context_watch_data.idle_source = g_idle_add (context_reprobe, NULL);
+}
+
+/* Keep the context up to date while the main loop runs: changed, if not
+ * NULL, is called with the actions (ACTION_* flags) probed again. */
+void context_watch (HandlerContext* handler_context, void (*changed) (HandlerContext *, guint))
+{
+	context_watch_data.handler_context = handler_context;
+	context_watch_data.changed = changed;
+	dbus_WatchChanges (context_service_changed, NULL);
+}
 
 /*
  * Set up a context containing informations about how
@@ -35,250 +401,1115 @@ static GQuark OBSESSION_ERROR;
 void initialize_context (HandlerContext* handler_context)
 {
 	memset(handler_context, 0, sizeof(HandlerContext));
+	handler_context->cancellable = g_cancellable_new ();
 
-	OBSESSION_ERROR = g_quark_from_string ("__obsession_error__");
+	/* The backend is chosen in obsession.conf */
+	load_config (handler_context);
+	context_probe (handler_context, ACTION_ALL);
 
-	/* Is poweroff controlled by systemd or ConsoleKit? */
-	if (dbus_ConsoleKit_CanPowerOff())
+	/* If we are under LXDM, its "Switch User" is available. */
+	if (verify_running("lxdm", "lxdm"))
+	{
+		handler_context->switch_user = LXDM;
+	}
+	/* If we are under GDM, its "Switch User" is available. */
+	else if (verify_running("gdm", "gdmflexiserver"))
+	{
+		handler_context->switch_user = GDM;
+	}
+	/* If we are under KDM, its "Switch User" is available. */
+	else if (verify_running("kdm", "kdmctl"))
 	{
-		handler_context->poweroff = CONSOLEKIT;
+		handler_context->switch_user = KDM;
 	}
-	else if (dbus_systemd_CanPowerOff())
+	/* If we are under LightDM, its "Switch User" is available. */
+	else if (verify_running("lightdm", "dm-tool"))
 	{
-		handler_context->poweroff = SYSTEMD;
+		handler_context->switch_user = LIGHTDM;
 	}
 	else
-		handler_context->poweroff = NONE;
+		handler_context->switch_user = NONE;
+}
 
-	/* Is reboot controlled by systemd or ConsoleKit? */
-	if (dbus_systemd_CanReboot())
+/* Free allocated memory from handler context */
+void free_context (HandlerContext* handler_context)
+{
+	g_free (handler_context->logout_cmd);
+	g_free (handler_context->lock_cmd);
+	g_free (handler_context->helper_cmd);
+	g_free (handler_context->suspend_mode);
+	g_free (handler_context->sleep_mode);
+	g_free (handler_context->image_size);
+	g_free (handler_context->hibernate_mode);
+	g_free (handler_context->locker_daemon);
+	g_free (handler_context->locker_arm);
+	g_free (handler_context->battery_action);
+	g_strfreev (handler_context->thermal_zones);
+	g_strfreev (handler_context->prefetch_processes);
+	working_set_free (handler_context->working_set);
+	g_free (handler_context->key_lock);
+	g_free (handler_context->key_suspend);
+	g_free (handler_context->key_hibernate);
+	g_free (handler_context->key_reboot);
+	g_free (handler_context->key_poweroff);
+	g_free (handler_context->key_logout);
+	hooks_free (handler_context);
+	g_clear_object (&handler_context->cancellable);
+}
+
+/* Try to run xlock command in order to lock the screen, return TRUE on
+ * success, FALSE if command execution failed. If a lock supervisor is
+ * running (obsession-exit --daemon), it does it for us.
+ */
+gboolean lock_screen(gchar *cmd)
+{
+	g_return_val_if_fail (cmd != NULL, FALSE);
+
+	if (lock_supervisor_request (0) >= 0)
+		return TRUE;
+
+	self_stats_spawned ();
+	return g_spawn_command_line_async(cmd, NULL);
+}
+
+/* Abstract unix socket named after the user and the display, so that the
+ * processes of a session can find each other. */
+static socklen_t session_socket_address (const gchar *name, struct sockaddr_un *address)
+{
+	const gchar *display = g_getenv ("DISPLAY");
+	gchar *path = g_strdup_printf ("obsession-%s-%d-%s", name, getuid (), display ? display : "");
+	gsize length = MIN (strlen (path), sizeof(address->sun_path) - 1);
+
+	memset (address, 0, sizeof(struct sockaddr_un));
+	address->sun_family = AF_UNIX;
+	/* sun_path[0] = '\0' makes it abstract: no file, gone with its owner. */
+	memcpy (address->sun_path + 1, path, length);
+	g_free (path);
+
+	return offsetof (struct sockaddr_un, sun_path) + 1 + length;
+}
+
+/* Abstract sockets can be reached by any user: check the other end. */
+static gboolean session_socket_trusted (gint fd)
+{
+	struct ucred credentials;
+	socklen_t length = sizeof(credentials);
+
+	return getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == 0
+	    && credentials.uid == getuid ();
+}
+
+/* Listen on the socket called name. Return -1 if another process already
+ * does. */
+gint session_socket_listen (const gchar *name)
+{
+	struct sockaddr_un address;
+	socklen_t length = session_socket_address (name, &address);
+	gint fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (fd < 0)
+		return -1;
+
+	if (bind (fd, (struct sockaddr *) &address, length) < 0 || listen (fd, 8) < 0)
 	{
-		handler_context->reboot = SYSTEMD;
+		close (fd);
+		return -1;
 	}
-	else if (dbus_ConsoleKit_CanReboot())
+
+	return fd;
+}
+
+/* Accept a connection from a process of the same user, or return -1. */
+gint session_socket_accept (gint listen_fd)
+{
+	gint fd = accept4 (listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+	if (fd >= 0 && !session_socket_trusted (fd))
 	{
-		handler_context->reboot = CONSOLEKIT;
+		close (fd);
+		return -1;
 	}
-	else
+
+	return fd;
+}
+
+/* Connect to the socket called name. Return -1 if nobody listens. */
+gint session_socket_connect (const gchar *name)
+{
+	struct sockaddr_un address;
+	socklen_t length = session_socket_address (name, &address);
+	gint fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (fd < 0)
+		return -1;
+
+	if (connect (fd, (struct sockaddr *) &address, length) < 0 || !session_socket_trusted (fd))
 	{
-		handler_context->reboot = NONE;
+		close (fd);
+		return -1;
 	}
 
-	/* Is suspend controlled by systemd or UPower? */
-	if (dbus_UPower_CanSuspend())
+	return fd;
+}
+
+/* The process of the session doing an action, see session_action_join().
+ * depth counts the joins of this process still to be done, answer is set
+ * during the grace. */
+static struct {
+	gchar *action;
+	gint fd;
+	guint depth;
+	gchar *answer;
+	guint watch_source;
+	guint grace_source;
+} action_owner = { NULL, -1, 0, NULL, 0, 0 };
+
+static gboolean write_all (gint fd, const gchar *data)
+{
+	gsize length = strlen (data);
+
+	while (length > 0)
 	{
-		handler_context->suspend = UPOWER;
+		gssize written = write (fd, data, length);
+
+		if (written <= 0)
+			return FALSE;
+		data += written;
+		length -= written;
 	}
-	else if (dbus_systemd_CanSuspend())
+	return TRUE;
+}
+
+/* Read a line of at most size - 1 bytes within timeout ms, or return FALSE
+ * on end of file or time out (then timed_out is set, if not NULL). */
+static gboolean read_line (gint fd, gchar *line, gsize size, gint timeout, gboolean *timed_out)
+{
+	gint64 deadline = g_get_monotonic_time () + (gint64) timeout * G_TIME_SPAN_MILLISECOND;
+	gsize length = 0;
+	gint64 now;
+
+	if (timed_out)
+		*timed_out = FALSE;
+
+	while (length < size - 1)
 	{
-		handler_context->suspend = SYSTEMD;
+		struct pollfd pfd = { fd, POLLIN, 0 };
+
+		now = g_get_monotonic_time ();
+		if (now >= deadline || poll (&pfd, 1, (deadline - now) / G_TIME_SPAN_MILLISECOND + 1) == 0)
+		{
+			if (timed_out)
+				*timed_out = TRUE;
+			length = 0;
+			break;
+		}
+		if (read (fd, line + length, 1) != 1)
+			break;
+		if (line[length] == '\n')
+			break;
+		length++;
 	}
-	else if (dbus_ConsoleKit_CanSuspend())
+	line[length] = '\0';
+	return length > 0;
+}
+
+/* Answer the joiners waiting in the backlog, without blocking. */
+static void action_answer_pending (void)
+{
+	gchar request[64], *line;
+	gint fd;
+
+	for (;;)
 	{
-		handler_context->suspend = CONSOLEKIT;
+		/* An untrusted peer is refused without touching errno. */
+		errno = 0;
+		if ((fd = session_socket_accept (action_owner.fd)) < 0)
+		{
+			if (errno == 0 || errno == ECONNABORTED || errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (read_line (fd, request, sizeof(request), ACTION_REQUEST_TIMEOUT, NULL))
+		{
+			if (g_strcmp0 (request, action_owner.action) == 0)
+				write_all (fd, action_owner.answer);
+			else
+			{
+				line = g_strdup_printf ("busy %s\n", action_owner.action);
+				write_all (fd, line);
+				g_free (line);
+			}
+		}
+		close (fd);
 	}
-	else
+}
+
+/* Answer the last joiners and let the next action be done. */
+static void action_release (void)
+{
+	if (action_owner.answer)
+		action_answer_pending ();
+
+	if (action_owner.watch_source)
+		g_source_remove (action_owner.watch_source);
+	if (action_owner.grace_source)
+		g_source_remove (action_owner.grace_source);
+	action_owner.watch_source = 0;
+	action_owner.grace_source = 0;
+
+	close (action_owner.fd);
+	action_owner.fd = -1;
+	action_owner.depth = 0;
+	g_free (action_owner.action);
+	action_owner.action = NULL;
+	g_free (action_owner.answer);
+	action_owner.answer = NULL;
+}
+
+static gboolean action_joined (gint fd, GIOCondition condition, gpointer data)
+{
+	action_answer_pending ();
+	return TRUE;
+}
+
+static gboolean action_grace_over (gpointer data)
+{
+	action_owner.grace_source = 0;
+	action_release ();
+	return FALSE;
+}
+
+/* Take the action, or return FALSE if another process has it. */
+static gboolean action_own (const gchar *action)
+{
+	action_owner.fd = session_socket_listen ("action");
+	if (action_owner.fd < 0)
+		return FALSE;
+
+	g_unix_set_fd_nonblocking (action_owner.fd, TRUE, NULL);
+	action_owner.action = g_strdup (action);
+	action_owner.depth = 1;
+	return TRUE;
+}
+
+/* Several processes of the session may ask for the same action at once (a
+ * lid switch, a panel button and a hotkey): only the first one does it.
+ * Return FALSE if we are that one, then session_action_done() must follow.
+ * Return TRUE if another process did it for us, err is its result, or if
+ * another action is in progress (BUSY_ERROR).
+ */
+gboolean session_action_join (const gchar *action, GError **err)
+{
+	gchar *request, reply[256];
+	gint fd, code;
+	gboolean joined, timed_out = FALSE;
+
+	/* Ours already: obsession-exit joins before the discovery, then the
+	 * action joins again. Anything else waits for the end of ours. */
+	if (action_owner.fd >= 0 && action_owner.answer == NULL)
 	{
-		handler_context->suspend = NONE;
+		if (g_strcmp0 (action_owner.action, action) != 0)
+		{
+			g_set_error (err, OBSESSION_ERROR, BUSY_ERROR, "Busy, %s in progress", action_owner.action);
+			return TRUE;
+		}
+		action_owner.depth++;
+		return FALSE;
 	}
 
-	/* Is hibernation controlled by systemd or UPower? */
-	if (dbus_UPower_CanHibernate())
+	/* Done, still in its grace: answer the last ones now. */
+	if (action_owner.fd >= 0)
+		action_release ();
+
+	if (action_own (action))
+		return FALSE;
+
+	fd = session_socket_connect ("action");
+	if (fd < 0)
 	{
-		handler_context->hibernate = UPOWER;
+		/* Just released, try again: or do it alone. */
+		action_own (action);
+		return FALSE;
 	}
-		else if (dbus_ConsoleKit_CanHibernate())
+
+	request = g_strdup_printf ("%s\n", action);
+	joined = write_all (fd, request);
+	g_free (request);
+	if (joined)
+		joined = read_line (fd, reply, sizeof(reply), ACTION_JOIN_TIMEOUT * 1000, &timed_out);
+	close (fd);
+
+	/* Still connected but silent: don't go on top of it. */
+	if (timed_out)
 	{
-		handler_context->hibernate = CONSOLEKIT;
+		g_set_error (err, OBSESSION_ERROR, BUSY_ERROR, "No answer from the %s in progress", action);
+		return TRUE;
 	}
-	else if (dbus_systemd_CanHibernate())
+
+	/* The other process died on the way: our turn. */
+	if (!joined)
+		return session_action_join (action, err);
+
+	g_message ("Joined %s, already in progress", action);
+	if (g_str_has_prefix (reply, "busy "))
+		g_set_error (err, OBSESSION_ERROR, BUSY_ERROR, "Busy, %s in progress", reply + 5);
+	else if (g_str_has_prefix (reply, "error ") && sscanf (reply + 6, "%d", &code) == 1 && strchr (reply + 6, ' '))
+		g_set_error (err, OBSESSION_ERROR, code, "%s", strchr (reply + 6, ' ') + 1);
+
+	return TRUE;
+}
+
+/* Give the result of the action to the processes which joined it, then
+ * for a little while from the main loop, and let the next one be done. */
+void session_action_done (const gchar *action, const GError *err)
+{
+	gchar *line;
+
+	if (action_owner.fd < 0 || action_owner.answer || g_strcmp0 (action_owner.action, action) != 0)
+		return;
+	if (--action_owner.depth > 0)
+		return;
+
+	/* One line for the message. */
+	if (err)
 	{
-		handler_context->hibernate = SYSTEMD;
+		line = g_strdelimit (g_strdup (err->message), "\n", ' ');
+		action_owner.answer = g_strdup_printf ("error %d %s\n", err->code, line);
+		g_free (line);
 	}
 	else
+		action_owner.answer = g_strdup ("ok\n");
+
+	action_answer_pending ();
+	action_owner.watch_source = g_unix_fd_add (action_owner.fd, G_IO_IN, action_joined, NULL);
+	action_owner.grace_source = g_timeout_add (ACTION_GRACE, action_grace_over, NULL);
+}
+
+/* Verify that a program is running and that an executable is available. */
+gboolean verify_running(const char * display_manager, const char * executable)
+{
+	/* See if the executable we need to run is in the path. */
+	gchar * full_path = g_find_program_in_path(executable);
+	if (full_path != NULL)
+	{
+		g_free(full_path);
+
+		/* Form the filespec of the pid file for the display manager. */
+		char buffer[PATH_MAX];
+		sprintf(buffer, "/run/%s.pid", display_manager);
+
+		/* Open the pid file. */
+		int fd = open(buffer, O_RDONLY);
+		if (fd >= 0)
+		{
+			/* Pid file exists.  Read it. */
+			ssize_t length = read(fd, buffer, sizeof(buffer));
+			close(fd);
+			if (length > 0)
+			{
+				/* Null terminate the buffer and convert the pid. */
+				buffer[length] = '\0';
+				pid_t pid = atoi(buffer);
+				if (pid > 0)
+				{
+					/* Form the filespec of the command line file under /proc.
+					 * This is Linux specific.  Should be conditionalized to the appropriate /proc layout for
+					 * other systems.  Your humble developer has no way to test on other systems. */
+					sprintf(buffer, "/proc/%d/cmdline", pid);
+
+					/* Open the file. */
+					int fd = open(buffer, O_RDONLY);
+					if (fd >= 0)
+					{
+						/* Read the command line. */
+						ssize_t length = read(fd, buffer, sizeof(buffer));
+						close(fd);
+						if (length > 0)
+						{
+							/* Null terminate the buffer and look for the display manager name in the command.
+							 * If found, return success. */
+							buffer[length] = '\0';
+							if (strstr(buffer, display_manager) != NULL)
+								return TRUE;
+						}
+					}
+				}
+			}
+		}
+	}
+	return FALSE;
+}
+
+/* Select the suspend variant asked in the configuration or on the command
+ * line, through the privileged helper. The kernel default is kept if it
+ * can't be changed.
+ */
+static void suspend_mode_apply (HandlerContext* handler_context)
+{
+	const gchar *args[] = { "mem-sleep", handler_context->suspend_mode, NULL };
+	GError *error = NULL;
+	gchar *current = NULL;
+
+	if (handler_context->suspend_mode == NULL)
+		return;
+
+	g_strfreev (sysfs_choices ("/sys/power/mem_sleep", &current));
+	if (g_strcmp0 (current, handler_context->suspend_mode) != 0)
+	{
+		if (!sysfs_choice_supported ("/sys/power/mem_sleep", handler_context->suspend_mode))
+			g_warning ("Suspend mode '%s' is not supported", handler_context->suspend_mode);
+		else if (!sysfs_helper_run (handler_context->helper_cmd, args, &error))
+		{
+			g_warning ("Can't select suspend mode '%s': %s", handler_context->suspend_mode, error->message);
+			g_error_free (error);
+		}
+	}
+
+	g_free (current);
+}
+
+/* Program the RTC to wake the computer up at wake_at, through the
+ * helper: it works whoever suspends. */
+static gboolean wake_alarm_apply (HandlerContext* handler_context, GError **err)
+{
+	gchar *seconds = g_strdup_printf ("%" G_GINT64_FORMAT, handler_context->wake_at);
+	const gchar *args[] = { "wakealarm", seconds, NULL };
+	GError *error = NULL;
+	gboolean result = TRUE;
+
+	if (!sysfs_wakealarm_supported ())
+	{
+		g_set_error (err, OBSESSION_ERROR, SUSPEND_ERROR, "No RTC wake alarm");
+		result = FALSE;
+	}
+	else if (!sysfs_helper_run (handler_context->helper_cmd, args, &error))
 	{
-		handler_context->hibernate = NONE;
+		g_set_error (err, OBSESSION_ERROR, SUSPEND_ERROR, "Can't set the wake alarm: %s", error->message);
+		g_error_free (error);
+		result = FALSE;
 	}
 
-	/* If we are under LXDM, its "Switch User" is available. */
-	if (verify_running("lxdm", "lxdm"))
+	g_free (seconds);
+	return result;
+}
+
+/* Kernel backend: write state to /sys/power/state through the helper. It
+ * returns once the computer is awake again. */
+static void kernel_sleep (HandlerContext* handler_context, const gchar *state, GError **err)
+{
+	const gchar *args[] = { "state", state, NULL };
+
+	if (sysfs_helper_run (handler_context->helper_cmd, args, err))
+		handler_context->sleep_resumed = g_get_monotonic_time ();
+}
+
+/* Kernel backend: reboot or poweroff. */
+static void kernel_power (HandlerContext* handler_context, const gchar *command, GError **err)
+{
+	const gchar *args[] = { command, NULL };
+
+	sysfs_helper_run (handler_context->helper_cmd, args, err);
+}
+
+/* Select the hibernation mode of the configuration (kernel backend). */
+static void hibernate_mode_apply (HandlerContext* handler_context)
+{
+	const gchar *args[] = { "disk", handler_context->hibernate_mode, NULL };
+	GError *error = NULL;
+
+	if (handler_context->hibernate_mode == NULL)
+		return;
+
+	if (!sysfs_choice_supported ("/sys/power/disk", handler_context->hibernate_mode))
+		g_warning ("Hibernation mode '%s' is not supported", handler_context->hibernate_mode);
+	else if (!sysfs_helper_run (handler_context->helper_cmd, args, &error))
+	{
+		g_warning ("Can't select hibernation mode '%s': %s", handler_context->hibernate_mode, error->message);
+		g_error_free (error);
+	}
+}
+
+/* Remember what is about to sleep, and how, so that sleep_wait_resume()
+ * can record it. */
+static void sleep_begin (HandlerContext* handler_context, const gchar *action, const gchar *choices)
+{
+	gchar **modes;
+
+	g_free (handler_context->sleep_mode);
+	modes = sysfs_choices (choices, &handler_context->sleep_mode);
+	g_strfreev (modes);
+
+	handler_context->sleep_action = action;
+	handler_context->sleep_reclaimed = 0;
+	handler_context->sleep_started = g_get_monotonic_time ();
+	handler_context->sleep_resumed = 0;
+
+	/* The kernel backend returns once resumed, there is nothing to monitor. */
+	if ((g_strcmp0 (action, "suspend") == 0 ? handler_context->suspend : handler_context->hibernate) != KERNEL)
+		dbus_systemd_SleepMonitorStart ();
+}
+
+/* Append a line to $XDG_CACHE_HOME/obsession/sleep.log:
+ * date, computer model, action, kernel mode, transition time in ms,
+ * memory reclaimed before hibernating in bytes and time for the working
+ * set to be back after it in ms ("-" if not measured or not back).
+ */
+static void sleep_record (HandlerContext* handler_context, gint64 elapsed, gint64 responsive)
+{
+	gchar *back = responsive >= 0 ? g_strdup_printf ("%" G_GINT64_FORMAT, responsive) : g_strdup ("-");
+	gchar *dirname = g_build_filename (g_get_user_cache_dir (), "obsession", NULL);
+	gchar *pathname = g_build_filename (dirname, "sleep.log", NULL);
+	gchar *model = sysfs_read ("/sys/class/dmi/id/product_name");
+	GDateTime *now = g_date_time_new_now_local ();
+	gchar *date = g_date_time_format (now, "%Y-%m-%dT%H:%M:%S");
+	FILE *log;
+
+	g_mkdir_with_parents (dirname, 0700);
+	log = fopen (pathname, "a");
+	if (log)
+	{
+		fprintf (log, "%s\t%s\t%s\t%s\t%" G_GINT64_FORMAT "\t%" G_GUINT64_FORMAT "\t%s\n",
+		         date,
+		         model ? model : "unknown",
+		         handler_context->sleep_action,
+		         handler_context->sleep_mode ? handler_context->sleep_mode : "default",
+		         elapsed,
+		         handler_context->sleep_reclaimed,
+		         back);
+		fclose (log);
+	}
+
+	g_free (back);
+	g_free (date);
+	g_date_time_unref (now);
+	g_free (model);
+	g_free (pathname);
+	g_free (dirname);
+}
+
+/* Wait for the computer to wake up after system_suspend() or
+ * system_hibernate() and record the time spent going to sleep and resuming.
+ * The sleep itself isn't counted: the monotonic clock is stopped meanwhile.
+ */
+void sleep_wait_resume (HandlerContext* handler_context)
+{
+	gint64 resumed = handler_context->sleep_resumed;
+
+	if (handler_context->sleep_started == 0)
+		return;
+
+	if (resumed || dbus_systemd_SleepMonitorWait (SLEEP_RESUME_TIMEOUT))
+		resumed = resumed ? resumed : g_get_monotonic_time ();
+
+	/* The post hooks don't wait for the prefetch. */
+	hooks_run (handler_context, handler_context->sleep_action, TRUE);
+
+	if (resumed)
+	{
+		gint64 elapsed = (resumed - handler_context->sleep_started) / 1000;
+		gint64 responsive = -1;
+
+		if (handler_context->working_set && g_strcmp0 (handler_context->sleep_action, "hibernate") == 0)
+			responsive = working_set_prefetch (handler_context->working_set, handler_context->prefetch_budget);
+		sleep_record (handler_context, elapsed, responsive);
+	}
+
+	working_set_free (handler_context->working_set);
+	handler_context->working_set = NULL;
+	handler_context->sleep_started = 0;
+}
+
+/* Take a logind delay inhibitor, so that the sleep waits for the screen to
+ * be locked. Without logind, lock and wait for the locker right now.
+ * Return the inhibitor or -1.
+ */
+static gint lock_before_sleep (HandlerContext* handler_context)
+{
+	gint inhibitor = dbus_systemd_Inhibit ("sleep", "obsession", "Lock the screen before sleeping", "delay", NULL);
+
+	if (inhibitor < 0 && !lock_screen_wait (handler_context->lock_cmd, handler_context->lock_timeout))
+		g_warning ("The screen locker did not report it was ready");
+
+	return inhibitor;
+}
+
+/* Start the locker when logind announces the sleep (PrepareForSleep) and
+ * release the inhibitor as soon as the screen is covered, or after
+ * lock_timeout ms.
+ */
+static void lock_on_sleep (HandlerContext* handler_context, gint inhibitor, gboolean sleeping)
+{
+	if (inhibitor < 0)
+		return;
+
+	if (sleeping)
 	{
-		handler_context->switch_user = LXDM;
+		dbus_systemd_SleepMonitorWaitPrepare (LOCK_PREPARE_TIMEOUT);
+		if (!lock_screen_wait (handler_context->lock_cmd, handler_context->lock_timeout))
+			g_warning ("The screen locker did not report it was ready");
 	}
-	/* If we are under GDM, its "Switch User" is available. */
-	else if (verify_running("gdm", "gdmflexiserver"))
+
+	close (inhibitor);
+}
+
+/* Describe the inhibitors of what ("shutdown" or "sleep"), one "who: why
+ * (mode)" per line, NULL if there is none. blocked tells if one of them
+ * blocks the action, the others only delay it.
+ */
+gchar *system_inhibitors (const gchar *what, gboolean *blocked)
+{
+	GPtrArray *inhibitors = dbus_systemd_ListInhibitors (what, NULL);
+	GString *text;
+	guint i;
+
+	*blocked = FALSE;
+	if (inhibitors == NULL || inhibitors->len == 0)
 	{
-		handler_context->switch_user = GDM;
+		if (inhibitors)
+			g_ptr_array_free (inhibitors, TRUE);
+		return NULL;
 	}
-	/* If we are under KDM, its "Switch User" is available. */
-	else if (verify_running("kdm", "kdmctl"))
+
+	text = g_string_new (NULL);
+	for (i = 0; i < inhibitors->len; i++)
 	{
-		handler_context->switch_user = KDM;
+		Inhibitor *inhibitor = g_ptr_array_index (inhibitors, i);
+
+		if (g_strcmp0 (inhibitor->mode, "block") == 0)
+			*blocked = TRUE;
+		g_string_append_printf (text, "%s%s: %s (%s)", i ? "\n" : "",
+		                        inhibitor->who, inhibitor->why, inhibitor->mode);
 	}
-	/* If we are under LightDM, its "Switch User" is available. */
-	else if (verify_running("lightdm", "dm-tool"))
+
+	g_ptr_array_free (inhibitors, TRUE);
+	return g_string_free (text, FALSE);
+}
+
+typedef struct {
+	HandlerContext *handler_context;
+	const gchar *what;
+	gint remaining;
+	GMainLoop *loop;
+	guint source;
+} InhibitWait;
+
+static gboolean inhibit_wait_tick (gpointer data)
+{
+	InhibitWait *wait = data;
+	gboolean blocked;
+	gchar *list;
+
+	wait->remaining--;
+	list = system_inhibitors (wait->what, &blocked);
+	if (blocked && wait->remaining > 0)
 	{
-		handler_context->switch_user = LIGHTDM;
+		if (wait->handler_context->inhibit_progress)
+			wait->handler_context->inhibit_progress (wait->handler_context, list, wait->remaining);
+		g_free (list);
+		return TRUE;
 	}
-	else
-		handler_context->switch_user = NONE;
 
-	load_config (handler_context);
+	g_free (list);
+	wait->source = 0;
+	g_main_loop_quit (wait->loop);
+	return FALSE;
 }
 
-/* Free allocated memory from handler context */
-void free_context (HandlerContext* handler_context)
+static void inhibit_wait_cancelled (GCancellable *cancellable, gpointer data)
 {
-	g_free (handler_context->logout_cmd);
-	g_free (handler_context->lock_cmd);
+	InhibitWait *wait = data;
+
+	g_main_loop_quit (wait->loop);
 }
 
-/* Try to run xlock command in order to lock the screen, return TRUE on
- * success, FALSE if command execution failed
+/* Check nobody blocks what before asking logind, which would refuse. We
+ * wait for the blockers at most inhibit_wait seconds, with a countdown
+ * given to inhibit_progress, unless the cancellable of the context gives
+ * up first. Delay inhibitors only hold the action for InhibitDelayMaxUSec,
+ * we just say so.
  */
-gboolean lock_screen(gchar *cmd)
+static gboolean inhibitors_check (HandlerContext* handler_context, const gchar *what, GError **err)
 {
-	g_return_val_if_fail (cmd != NULL, FALSE);
+	gboolean blocked;
+	gchar *list;
 
-	if (!g_spawn_command_line_async(cmd, NULL))
-	{
+	if (handler_context->ignore_inhibitors)
 		return TRUE;
-	}
-	else
-	{
-		return FALSE;
-	}
-}
 
-/* Verify that a program is running and that an executable is available. */
-gboolean verify_running(const char * display_manager, const char * executable)
-{
-	/* See if the executable we need to run is in the path. */
-	gchar * full_path = g_find_program_in_path(executable);
-	if (full_path != NULL)
+	list = system_inhibitors (what, &blocked);
+	if (blocked && handler_context->inhibit_wait > 0 && !g_cancellable_is_cancelled (handler_context->cancellable))
 	{
-		g_free(full_path);
+		InhibitWait wait = { handler_context, what, handler_context->inhibit_wait, NULL, 0 };
+		gulong cancelled;
 
-		/* Form the filespec of the pid file for the display manager. */
-		char buffer[PATH_MAX];
-		sprintf(buffer, "/run/%s.pid", display_manager);
+		if (handler_context->inhibit_progress)
+			handler_context->inhibit_progress (handler_context, list, wait.remaining);
 
-		/* Open the pid file. */
-		int fd = open(buffer, O_RDONLY);
-		if (fd >= 0)
-		{
-			/* Pid file exists.  Read it. */
-			ssize_t length = read(fd, buffer, sizeof(buffer));
-			close(fd);
-			if (length > 0)
-			{
-				/* Null terminate the buffer and convert the pid. */
-				buffer[length] = '\0';
-				pid_t pid = atoi(buffer);
-				if (pid > 0)
-				{
-					/* Form the filespec of the command line file under /proc.
-					 * This is Linux specific.  Should be conditionalized to the appropriate /proc layout for
-					 * other systems.  Your humble developer has no way to test on other systems. */
-					sprintf(buffer, "/proc/%d/cmdline", pid);
+		wait.loop = g_main_loop_new (NULL, FALSE);
+		wait.source = g_timeout_add_seconds (1, inhibit_wait_tick, &wait);
+		cancelled = g_cancellable_connect (handler_context->cancellable, G_CALLBACK (inhibit_wait_cancelled), &wait, NULL);
+		g_main_loop_run (wait.loop);
+		g_cancellable_disconnect (handler_context->cancellable, cancelled);
+		if (wait.source)
+			g_source_remove (wait.source);
+		g_main_loop_unref (wait.loop);
 
-					/* Open the file. */
-					int fd = open(buffer, O_RDONLY);
-					if (fd >= 0)
-					{
-						/* Read the command line. */
-						ssize_t length = read(fd, buffer, sizeof(buffer));
-						close(fd);
-						if (length > 0)
-						{
-							/* Null terminate the buffer and look for the display manager name in the command.
-							 * If found, return success. */
-							buffer[length] = '\0';
-							if (strstr(buffer, display_manager) != NULL)
-								return TRUE;
-						}
-					}
-				}
-			}
+		g_free (list);
+		if (g_cancellable_is_cancelled (handler_context->cancellable))
+		{
+			g_set_error (err, OBSESSION_ERROR, INHIBITED_ERROR, "Cancelled");
+			return FALSE;
 		}
+		list = system_inhibitors (what, &blocked);
 	}
-	return FALSE;
+
+	if (blocked)
+		g_set_error (err, OBSESSION_ERROR, INHIBITED_ERROR, "Blocked by:\n%s", list);
+	else if (list)
+		g_message ("May be delayed up to %u s by:\n%s", dbus_systemd_InhibitDelayMax (), list);
+
+	g_free (list);
+	return !blocked;
 }
 
-void system_suspend (HandlerContext* handler_context, GError *err)
+void system_suspend (HandlerContext* handler_context, GError **err)
 {
+	GError *error = NULL;
+	gboolean interactive;
+	gint inhibitor;
+	gchar *action;
+
+	/* Only a suspend until the same time is the same action. */
+	if (handler_context->wake_at)
+		action = g_strdup_printf ("suspend until %" G_GINT64_FORMAT, handler_context->wake_at);
+	else
+		action = g_strdup ("suspend");
+
+	if (session_action_join (action, &error))
+		goto out;
+
+	if (!action_authorize (handler_context, ACTION_SUSPEND, handler_context->suspend, SUSPEND_ERROR, &interactive, &error))
+		goto done;
+
+	/* Not asleep forever if the alarm can't be set. */
+	if (handler_context->wake_at && handler_context->suspend != NONE && !wake_alarm_apply (handler_context, &error))
+		goto done;
+
+	if (handler_context->suspend == SYSTEMD && !inhibitors_check (handler_context, "sleep", &error))
+		goto done;
+	if (handler_context->suspend != NONE)
+		hooks_run (handler_context, "suspend", FALSE);
+
 	switch (handler_context->suspend)
 	{
 		case SYSTEMD:
-			lock_screen(handler_context->lock_cmd);
-			dbus_systemd_Suspend (&err);
+			suspend_mode_apply (handler_context);
+			inhibitor = lock_before_sleep (handler_context);
+			sleep_begin (handler_context, "suspend", "/sys/power/mem_sleep");
+			dbus_systemd_Suspend (handler_context->ignore_inhibitors, interactive, &error);
+			lock_on_sleep (handler_context, inhibitor, error == NULL);
 			break;
 
 		case UPOWER:
-			lock_screen(handler_context->lock_cmd);
-			dbus_UPower_Suspend (&err);
+			suspend_mode_apply (handler_context);
+			lock_screen_wait (handler_context->lock_cmd, handler_context->lock_timeout);
+			sleep_begin (handler_context, "suspend", "/sys/power/mem_sleep");
+			dbus_UPower_Suspend (&error);
+			break;
+
+		case CONSOLEKIT:
+			suspend_mode_apply (handler_context);
+			lock_screen_wait (handler_context->lock_cmd, handler_context->lock_timeout);
+			sleep_begin (handler_context, "suspend", "/sys/power/mem_sleep");
+			dbus_ConsoleKit_Suspend (interactive, &error);
+			break;
+
+		case KERNEL:
+			suspend_mode_apply (handler_context);
+			lock_screen_wait (handler_context->lock_cmd, handler_context->lock_timeout);
+			sleep_begin (handler_context, "suspend", "/sys/power/mem_sleep");
+			kernel_sleep (handler_context, sysfs_choice_supported ("/sys/power/state", "mem") ? "mem" : "freeze", &error);
 			break;
 
 		default:
-			err = g_error_new (OBSESSION_ERROR, SUSPEND_ERROR, "Don't know how to suspend");
+			g_set_error (&error, OBSESSION_ERROR, SUSPEND_ERROR, "Don't know how to suspend");
+			break;
+	}
+
+	/* Nothing to wait for if we didn't go to sleep, undo the pre hooks. */
+	if (error)
+	{
+		handler_context->sleep_started = 0;
+		if (handler_context->suspend != NONE)
+			hooks_run (handler_context, "suspend", TRUE);
+	}
+
+done:
+	session_action_done (action, error);
+out:
+	g_free (action);
+	if (error)
+		g_propagate_error (err, error);
+}
+
+/* Refuse to hibernate, or only warn, when the image won't fit in swap. */
+static gboolean hibernate_preflight (HandlerContext* handler_context, GError **err)
+{
+	HibernateCheck check;
+	gboolean result = TRUE;
+
+	if (handler_context->hibernate_preflight == PREFLIGHT_OFF)
+		return TRUE;
+
+	sysfs_hibernate_check (&check);
+	if (check.result == HIBERNATE_CHECK_FAIL && handler_context->hibernate_preflight == PREFLIGHT_REFUSE)
+	{
+		g_set_error (err, OBSESSION_ERROR, HIBERNATE_ERROR, "%s", check.message);
+		result = FALSE;
+	}
+	else if (check.result != HIBERNATE_CHECK_OK)
+	{
+		g_warning ("%s", check.message);
+	}
+
+	g_free (check.message);
+	return result;
+}
+
+/* Make the hibernation image smaller before hibernating: set image_size,
+ * drop clean page cache then push the user's memory out with
+ * memory.reclaim until the time budget is spent. Return the number of
+ * bytes freed.
+ */
+static guint64 hibernate_reclaim (HandlerContext* handler_context)
+{
+	gint64 deadline = g_get_monotonic_time () + handler_context->reclaim_budget * G_TIME_SPAN_MILLISECOND;
+	guint64 before = sysfs_mem_free ();
+	guint64 after, freed;
+	const gchar *drop_caches[] = { "drop-caches", NULL };
+	GError *error = NULL;
+	gchar *cgroup;
+
+	if (handler_context->image_size)
+	{
+		const gchar *args[] = { "image-size", handler_context->image_size, NULL };
+
+		if (!sysfs_helper_run (handler_context->helper_cmd, args, &error))
+		{
+			g_warning ("Can't set the hibernation image size: %s", error->message);
+			g_clear_error (&error);
+		}
+	}
+
+	if (!sysfs_helper_run (handler_context->helper_cmd, drop_caches, &error))
+	{
+		g_warning ("Can't drop caches: %s", error->message);
+		g_clear_error (&error);
+	}
+
+	cgroup = sysfs_user_cgroup ();
+	while (cgroup && g_get_monotonic_time () < deadline)
+	{
+		if (!sysfs_cgroup_reclaim (cgroup, RECLAIM_CHUNK))
 			break;
 	}
+	g_free (cgroup);
+
+	after = sysfs_mem_free ();
+	freed = after > before ? after - before : 0;
+	g_message ("Reclaimed %" G_GUINT64_FORMAT " bytes before hibernating", freed);
+	return freed;
 }
 
-void system_hibernate (HandlerContext* handler_context, GError *err)
+void system_hibernate (HandlerContext* handler_context, GError **err)
 {
+	GError *error = NULL;
+	guint64 reclaimed = 0;
+	gboolean interactive;
+	gint inhibitor;
+
+	if (session_action_join ("hibernate", &error))
+		goto out;
+
+	if (!action_authorize (handler_context, ACTION_HIBERNATE, handler_context->hibernate, HIBERNATE_ERROR, &interactive, &error))
+		goto done;
+
+	if (handler_context->hibernate != NONE && !hibernate_preflight (handler_context, &error))
+		goto done;
+
+	if (handler_context->hibernate == SYSTEMD && !inhibitors_check (handler_context, "sleep", &error))
+		goto done;
+	if (handler_context->hibernate != NONE)
+		hooks_run (handler_context, "hibernate", FALSE);
+
+	/* Only once it is sure to happen. The working set first, before the
+	 * reclaim pushes it out. */
+	if (handler_context->hibernate != NONE && handler_context->prefetch)
+	{
+		working_set_free (handler_context->working_set);
+		handler_context->working_set = working_set_record (handler_context->prefetch_processes,
+		                                                   (guint64) handler_context->prefetch_max << 20,
+		                                                   handler_context->prefetch_budget);
+	}
+
+	if (handler_context->hibernate != NONE && handler_context->reclaim)
+		reclaimed = hibernate_reclaim (handler_context);
+
 	switch (handler_context->hibernate)
 	{
 		case SYSTEMD:
-			lock_screen(handler_context->lock_cmd);
-			dbus_systemd_Hibernate (&err);
+			inhibitor = lock_before_sleep (handler_context);
+			sleep_begin (handler_context, "hibernate", "/sys/power/disk");
+			handler_context->sleep_reclaimed = reclaimed;
+			dbus_systemd_Hibernate (handler_context->ignore_inhibitors, interactive, &error);
+			lock_on_sleep (handler_context, inhibitor, error == NULL);
 			break;
 
 		case UPOWER:
-			lock_screen(handler_context->lock_cmd);
-			dbus_UPower_Hibernate (&err);
+			lock_screen_wait (handler_context->lock_cmd, handler_context->lock_timeout);
+			sleep_begin (handler_context, "hibernate", "/sys/power/disk");
+			handler_context->sleep_reclaimed = reclaimed;
+			dbus_UPower_Hibernate (&error);
+			break;
+
+		case CONSOLEKIT:
+			lock_screen_wait (handler_context->lock_cmd, handler_context->lock_timeout);
+			sleep_begin (handler_context, "hibernate", "/sys/power/disk");
+			handler_context->sleep_reclaimed = reclaimed;
+			dbus_ConsoleKit_hibernate (interactive, &error);
+			break;
+
+		case KERNEL:
+			hibernate_mode_apply (handler_context);
+			lock_screen_wait (handler_context->lock_cmd, handler_context->lock_timeout);
+			sleep_begin (handler_context, "hibernate", "/sys/power/disk");
+			handler_context->sleep_reclaimed = reclaimed;
+			kernel_sleep (handler_context, "disk", &error);
 			break;
 
 		default:
-			err = g_error_new (OBSESSION_ERROR, HIBERNATE_ERROR, "Don't know how to hibernate");
+			g_set_error (&error, OBSESSION_ERROR, HIBERNATE_ERROR, "Don't know how to hibernate");
 			break;
 	}
+
+	/* Nothing to wait for if we didn't go to sleep, undo the pre hooks. */
+	if (error)
+	{
+		handler_context->sleep_started = 0;
+		if (handler_context->hibernate != NONE)
+			hooks_run (handler_context, "hibernate", TRUE);
+	}
+
+done:
+	/* Not left for a later resume. */
+	if (error)
+	{
+		working_set_free (handler_context->working_set);
+		handler_context->working_set = NULL;
+	}
+	session_action_done ("hibernate", error);
+out:
+	if (error)
+		g_propagate_error (err, error);
 }
 
-void system_reboot (HandlerContext* handler_context, GError *err)
+void system_reboot (HandlerContext* handler_context, GError **err)
 {
+	GError *error = NULL;
+	gboolean interactive;
+
+	if (session_action_join ("reboot", &error))
+		goto out;
+
+	if (!action_authorize (handler_context, ACTION_REBOOT, handler_context->reboot, REBOOT_ERROR, &interactive, &error))
+		goto done;
+
+	if (handler_context->reboot == SYSTEMD && !inhibitors_check (handler_context, "shutdown", &error))
+		goto done;
+	if (handler_context->reboot != NONE)
+	{
+		session_save (handler_context);
+		hooks_run (handler_context, "reboot", FALSE);
+	}
+
 	switch (handler_context->reboot)
 	{
 		case SYSTEMD:
-			dbus_systemd_Reboot (&err);
+			dbus_systemd_Reboot (handler_context->ignore_inhibitors, interactive, &error);
 			break;
 
 		case CONSOLEKIT:
-			dbus_ConsoleKit_Reboot (&err);
+			dbus_ConsoleKit_Reboot (interactive, &error);
+			break;
+
+		case KERNEL:
+			kernel_power (handler_context, "reboot", &error);
 			break;
 
 		default:
-			err = g_error_new (OBSESSION_ERROR, REBOOT_ERROR, "Don't know how to reboot");
+			g_set_error (&error, OBSESSION_ERROR, REBOOT_ERROR, "Don't know how to reboot");
 			break;
 	}
+
+	/* Still there: undo the pre hooks. */
+	if (error && handler_context->reboot != NONE)
+		hooks_run (handler_context, "reboot", TRUE);
+
+done:
+	session_action_done ("reboot", error);
+out:
+	if (error)
+		g_propagate_error (err, error);
 }
 
-void system_poweroff (HandlerContext* handler_context, GError *err)
+void system_poweroff (HandlerContext* handler_context, GError **err)
 {
+	GError *error = NULL;
+	gboolean interactive;
+
+	if (session_action_join ("poweroff", &error))
+		goto out;
+
+	if (!action_authorize (handler_context, ACTION_POWEROFF, handler_context->poweroff, POWEROFF_ERROR, &interactive, &error))
+		goto done;
+
+	if (handler_context->poweroff == SYSTEMD && !inhibitors_check (handler_context, "shutdown", &error))
+		goto done;
+	if (handler_context->poweroff != NONE)
+	{
+		session_save (handler_context);
+		hooks_run (handler_context, "poweroff", FALSE);
+	}
+
 	switch (handler_context->poweroff)
 	{
 		case SYSTEMD:
-			dbus_systemd_PowerOff (&err);
+			dbus_systemd_PowerOff (handler_context->ignore_inhibitors, interactive, &error);
 			break;
 
 		case CONSOLEKIT:
-			dbus_ConsoleKit_PowerOff (&err);
+			dbus_ConsoleKit_PowerOff (interactive, &error);
+			break;
+
+		case KERNEL:
+			kernel_power (handler_context, "poweroff", &error);
 			break;
 
 		default:
-			err = g_error_new (OBSESSION_ERROR, POWEROFF_ERROR, "Don't know how to shutdown");
+			g_set_error (&error, OBSESSION_ERROR, POWEROFF_ERROR, "Don't know how to shutdown");
 			break;
 	}
+
+	/* Still there: undo the pre hooks. */
+	if (error && handler_context->poweroff != NONE)
+		hooks_run (handler_context, "poweroff", TRUE);
+
+done:
+	session_action_done ("poweroff", error);
+out:
+	if (error)
+		g_propagate_error (err, error);
 }
 
 void system_user_switch (HandlerContext* handler_context)
@@ -286,21 +1517,25 @@ void system_user_switch (HandlerContext* handler_context)
 	switch (handler_context->switch_user)
 	{
 		case LXDM:
+			self_stats_spawned ();
 			g_spawn_command_line_sync("lxdm -c USER_SWITCH", NULL, NULL, NULL, NULL);
 			break;
 
 		case GDM:
 			lock_screen(handler_context->lock_cmd);
+			self_stats_spawned ();
 			g_spawn_command_line_sync("gdmflexiserver --startnew", NULL, NULL, NULL, NULL);
 			break;
 
 		case KDM:
 			lock_screen(handler_context->lock_cmd);
+			self_stats_spawned ();
 			g_spawn_command_line_sync("kdmctl reserve", NULL, NULL, NULL, NULL);
 			break;
 
 		case LIGHTDM:
 			lock_screen(handler_context->lock_cmd);
+			self_stats_spawned ();
 			g_spawn_command_line_sync("dm-tool switch-to-greeter", NULL, NULL, NULL, NULL);
 			break;
 
@@ -309,6 +1544,83 @@ void system_user_switch (HandlerContext* handler_context)
 	}
 }
 
+/* Keep the applications of the session in
+ * $XDG_CACHE_HOME/obsession/session.snapshot for "xdg-autostart --restore".
+ * Only once: obsession-logout saves before asking the windows to close,
+ * there is nothing left to see when it logs out afterwards.
+ */
+void session_save (HandlerContext* handler_context)
+{
+	GVariant *snapshot;
+	gchar *dirname, *pathname;
+	GError *error = NULL;
+
+	if (!handler_context->save_session || handler_context->session_saved)
+		return;
+	handler_context->session_saved = TRUE;
+
+	snapshot = x_session_snapshot (handler_context->display);
+	if (snapshot == NULL)
+		return;
+	g_variant_ref_sink (snapshot);
+
+	dirname = g_build_filename (g_get_user_cache_dir (), "obsession", NULL);
+	pathname = g_build_filename (dirname, SESSION_SNAPSHOT, NULL);
+	g_mkdir_with_parents (dirname, 0700);
+
+	if (g_file_set_contents (pathname, g_variant_get_data (snapshot), g_variant_get_size (snapshot), &error))
+		g_message ("%" G_GSIZE_FORMAT " applications saved", g_variant_n_children (snapshot));
+	else
+	{
+		g_warning ("Can't save the session: %s", error->message);
+		g_error_free (error);
+	}
+
+	g_variant_unref (snapshot);
+	g_free (pathname);
+	g_free (dirname);
+}
+
+/* End the session with a single message: the window manager is asked to
+ * exit (Openbox), or logind terminates the session. The "logout" command
+ * of obsession.conf, when set, replaces both.
+ */
+void system_logout (HandlerContext* handler_context, GError **err)
+{
+	GError *error = NULL, *terminate_error = NULL;
+
+	if (session_action_join ("logout", &error))
+		goto out;
+
+	session_save (handler_context);
+	hooks_run (handler_context, "logout", FALSE);
+
+	if (handler_context->logout_cmd)
+	{
+		self_stats_spawned ();
+		g_spawn_command_line_async (handler_context->logout_cmd, &error);
+	}
+	else if (!x_wm_exit (handler_context->display) && !dbus_systemd_TerminateSession (&terminate_error))
+	{
+		g_message ("Can't terminate the session: %s", terminate_error->message);
+		g_clear_error (&terminate_error);
+
+		/* Last resort, the historical default. */
+		self_stats_spawned ();
+		if (!g_spawn_command_line_async (DEFAULT_LOGOUT_CMD, NULL))
+			g_set_error (&error, OBSESSION_ERROR, LOGOUT_ERROR, "Don't know how to logout");
+	}
+
+	/* Still there: undo the pre hooks. */
+	if (error)
+		hooks_run (handler_context, "logout", TRUE);
+
+	session_action_done ("logout", error);
+out:
+	if (error)
+		g_propagate_error (err, error);
+}
+
 
 gchar *get_default_lock_cmd (void)
 {
@@ -316,11 +1628,24 @@ gchar *get_default_lock_cmd (void)
 }
 
 
-gchar *get_default_logout_cmd (void)
+gchar *get_default_helper_cmd (void)
 {
-	return g_strdup ("openbox --exit");
+	return g_strdup ("pkexec " PACKAGE_LIB_DIR "/obsession-helper");
 }
 
+/* An idle time of the Idle group, in s. A negative one would fire at once:
+ * it disables the action, like 0. */
+static gint idle_time (GKeyFile *kf, const gchar *key)
+{
+	gint value = g_key_file_get_integer (kf, "Idle", key, NULL);
+
+	if (value < 0)
+	{
+		g_warning ("Negative idle time %s=%d, disabled", key, value);
+		return 0;
+	}
+	return value;
+}
 
 void load_config (HandlerContext* handler_context)
 {
@@ -328,6 +1653,9 @@ void load_config (HandlerContext* handler_context)
 	gchar *pathname = g_build_filename (g_get_user_config_dir(), "obsession.conf", NULL);
 
 	GKeyFile *kf = g_key_file_new ();
+
+	handler_context->save_session = TRUE;
+
 	if (g_key_file_load_from_file (kf, pathname, G_KEY_FILE_KEEP_COMMENTS, &error))
 	{
 		handler_context->lock_cmd = g_key_file_get_string (kf, "Session", "screenlock", NULL);
@@ -337,20 +1665,90 @@ void load_config (HandlerContext* handler_context)
 		if (handler_context->lock_cmd == NULL)
 			handler_context->lock_cmd = get_default_lock_cmd ();
 
-		if (handler_context->logout_cmd == NULL)
-			handler_context->logout_cmd = get_default_logout_cmd ();
+		/* Older versions wrote the default command in the file, it is not
+		 * an override: the built-in transports do the same without a
+		 * process. */
+		if (g_strcmp0 (handler_context->logout_cmd, DEFAULT_LOGOUT_CMD) == 0)
+		{
+			g_free (handler_context->logout_cmd);
+			handler_context->logout_cmd = NULL;
+		}
+
+		handler_context->helper_cmd = g_key_file_get_string (kf, "Session", "helper", NULL);
+		handler_context->lock_timeout = g_key_file_get_integer (kf, "Session", "lock_timeout", NULL);
+		handler_context->inhibit_wait = g_key_file_get_integer (kf, "Session", "inhibit_wait", NULL);
+		handler_context->auth_timeout = g_key_file_get_integer (kf, "Session", "auth_timeout", NULL);
+		handler_context->close_timeout = g_key_file_get_integer (kf, "Session", "close_timeout", &error);
+		if (error)
+		{
+			handler_context->close_timeout = DEFAULT_CLOSE_TIMEOUT;
+			g_clear_error (&error);
+		}
+		if (g_key_file_has_key (kf, "Session", "save_session", NULL))
+			handler_context->save_session = g_key_file_get_boolean (kf, "Session", "save_session", NULL);
+		handler_context->lock_supervisor = g_key_file_get_boolean (kf, "Locker", "supervisor", NULL);
+		handler_context->locker_daemon = g_key_file_get_string (kf, "Locker", "daemon", NULL);
+		handler_context->locker_arm = g_key_file_get_string (kf, "Locker", "arm", NULL);
+		handler_context->suspend_mode = g_key_file_get_string (kf, "Suspend", "mode", NULL);
+
+		handler_context->idle_lock = idle_time (kf, "lock");
+		handler_context->idle_suspend = idle_time (kf, "suspend");
+		handler_context->idle_hibernate = idle_time (kf, "hibernate");
+
+		handler_context->battery_percentage = g_key_file_get_integer (kf, "Battery", "percentage", NULL);
+		handler_context->battery_time = g_key_file_get_integer (kf, "Battery", "time", NULL);
+		handler_context->battery_action = g_key_file_get_string (kf, "Battery", "action", NULL);
+		handler_context->battery_warning = g_key_file_get_integer (kf, "Battery", "warning", NULL);
+
+		handler_context->thermal_hibernate = g_key_file_get_integer (kf, "Thermal", "hibernate", NULL);
+		handler_context->thermal_poweroff = g_key_file_get_integer (kf, "Thermal", "poweroff", NULL);
+		handler_context->thermal_hysteresis = g_key_file_get_integer (kf, "Thermal", "hysteresis", NULL);
+		handler_context->thermal_zones = g_key_file_get_string_list (kf, "Thermal", "zones", NULL, NULL);
+		handler_context->thermal_arm = g_key_file_get_boolean (kf, "Thermal", "arm", NULL);
+
+		handler_context->key_lock = g_key_file_get_string (kf, "Keys", "lock", NULL);
+		handler_context->key_suspend = g_key_file_get_string (kf, "Keys", "suspend", NULL);
+		handler_context->key_hibernate = g_key_file_get_string (kf, "Keys", "hibernate", NULL);
+		handler_context->key_reboot = g_key_file_get_string (kf, "Keys", "reboot", NULL);
+		handler_context->key_poweroff = g_key_file_get_string (kf, "Keys", "poweroff", NULL);
+		handler_context->key_logout = g_key_file_get_string (kf, "Keys", "logout", NULL);
+
+		hooks_load (handler_context, kf);
+		self_stats_load (kf);
+
+		handler_context->reclaim = g_key_file_get_boolean (kf, "Hibernate", "reclaim", NULL);
+		handler_context->reclaim_budget = g_key_file_get_integer (kf, "Hibernate", "reclaim_budget", NULL);
+		handler_context->image_size = g_key_file_get_string (kf, "Hibernate", "image_size", NULL);
+		handler_context->hibernate_mode = g_key_file_get_string (kf, "Hibernate", "mode", NULL);
+		handler_context->prefetch = g_key_file_get_boolean (kf, "Hibernate", "prefetch", NULL);
+		handler_context->prefetch_processes = g_key_file_get_string_list (kf, "Hibernate", "prefetch_processes", NULL, NULL);
+		handler_context->prefetch_budget = g_key_file_get_integer (kf, "Hibernate", "prefetch_budget", NULL);
+		handler_context->prefetch_max = g_key_file_get_integer (kf, "Hibernate", "prefetch_max", NULL);
+
+		gchar *backend = g_key_file_get_string (kf, "Session", "backend", NULL);
+		if (g_strcmp0 (backend, "kernel") == 0)
+			handler_context->backend = BACKEND_KERNEL;
+		else if (g_strcmp0 (backend, "dbus") == 0)
+			handler_context->backend = BACKEND_DBUS;
+		g_free (backend);
+
+		gchar *preflight = g_key_file_get_string (kf, "Hibernate", "preflight", NULL);
+		if (g_strcmp0 (preflight, "off") == 0)
+			handler_context->hibernate_preflight = PREFLIGHT_OFF;
+		else if (g_strcmp0 (preflight, "warn") == 0)
+			handler_context->hibernate_preflight = PREFLIGHT_WARN;
+		g_free (preflight);
 	}
 	else
 	{
 		// get default configuration.
+		handler_context->close_timeout = DEFAULT_CLOSE_TIMEOUT;
 		handler_context->lock_cmd = get_default_lock_cmd ();
-		handler_context->logout_cmd = get_default_logout_cmd ();
 
 		// The config file doesn't exist. We create it.
 		if (error != NULL && error->code == G_FILE_ERROR_NOENT)
 		{
 			g_key_file_set_string (kf, "Session", "screenlock", handler_context->lock_cmd);
-			g_key_file_set_string (kf, "Session", "logout", handler_context->logout_cmd);
 			gchar *content = g_key_file_to_data (kf, NULL, NULL);
 			g_file_set_contents (pathname, content, -1, NULL);
 			g_free (content);
@@ -361,6 +1759,24 @@ void load_config (HandlerContext* handler_context)
 	if (error)
 		g_error_free (error);
 
+	if (handler_context->helper_cmd == NULL)
+		handler_context->helper_cmd = get_default_helper_cmd ();
+
+	if (handler_context->lock_timeout <= 0)
+		handler_context->lock_timeout = DEFAULT_LOCK_TIMEOUT;
+
+	if (handler_context->reclaim_budget <= 0)
+		handler_context->reclaim_budget = DEFAULT_RECLAIM_BUDGET;
+
+	if (handler_context->auth_timeout <= 0)
+		handler_context->auth_timeout = DEFAULT_AUTH_TIMEOUT;
+
+	if (handler_context->prefetch_budget <= 0)
+		handler_context->prefetch_budget = DEFAULT_PREFETCH_BUDGET;
+
+	if (handler_context->prefetch_max <= 0)
+		handler_context->prefetch_max = DEFAULT_PREFETCH_MAX;
+
 	g_key_file_free (kf);
 	g_free (pathname);
 }
@@ -20,11 +20,107 @@
  */
 
 #include <glib.h>
+#include <stdio.h>
 #include <string.h>
 
 #include "config.h"
 #include "obsession.h"
 #include "dbus-interface.h"
+#include "sysfs-interface.h"
+
+static gboolean suspend = FALSE;
+static gchar *suspend_mode = NULL;
+static gint64 wake_at = 0;
+static gboolean wake_at_timer = FALSE;
+
+/* Wake up this long before a timer, so that it finds the computer ready. */
+#define WAKE_BEFORE_TIMER 60
+
+/* --suspend takes an optional suspend variant: --suspend=deep */
+static gboolean parse_suspend (const gchar *name, const gchar *value, gpointer data, GError **error)
+{
+	suspend = TRUE;
+	if (value)
+	{
+		g_free (suspend_mode);
+		suspend_mode = g_strdup (value);
+	}
+	return TRUE;
+}
+
+/* --suspend-until=TIME: "HH:MM", the next one, or an ISO 8601 date and
+ * time such as 2024-05-01T03:00 (GLib wants the seconds, not us). */
+static gboolean parse_suspend_until (const gchar *name, const gchar *value, gpointer data, GError **error)
+{
+	GDateTime *now = g_date_time_new_now_local ();
+	GDateTime *time = NULL;
+	guint year, month, day, hour, minute;
+	gchar separator, end;
+
+	if (sscanf (value, "%u:%u%c", &hour, &minute, &end) == 2 && hour < 24 && minute < 60)
+	{
+		time = g_date_time_new_local (g_date_time_get_year (now), g_date_time_get_month (now),
+		                              g_date_time_get_day_of_month (now), hour, minute, 0);
+		if (g_date_time_compare (time, now) <= 0)
+		{
+			GDateTime *tomorrow = g_date_time_add_days (time, 1);
+			g_date_time_unref (time);
+			time = tomorrow;
+		}
+	}
+	else if (sscanf (value, "%4u-%2u-%2u%c%2u:%2u%c", &year, &month, &day, &separator, &hour, &minute, &end) == 6 &&
+	         (separator == 'T' || separator == ' '))
+		time = g_date_time_new_local (year, month, day, hour, minute, 0);
+#if GLIB_CHECK_VERSION(2,56,0)
+	else
+	{
+		GTimeZone *local = g_time_zone_new_local ();
+		time = g_date_time_new_from_iso8601 (value, local);
+		g_time_zone_unref (local);
+	}
+#endif
+
+	if (time == NULL || g_date_time_compare (time, now) <= 0)
+	{
+		g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "%s is not a time to come", value);
+		if (time)
+			g_date_time_unref (time);
+		g_date_time_unref (now);
+		return FALSE;
+	}
+
+	suspend = TRUE;
+	wake_at = g_date_time_to_unix (time);
+	g_date_time_unref (time);
+	g_date_time_unref (now);
+	return TRUE;
+}
+
+/* --suspend-until-next-timer: the next calendar timer of systemd. */
+static gboolean next_timer (GError **error)
+{
+	gchar *unit = NULL;
+	guint64 next = dbus_systemd_NextTimer (&unit, error);
+
+	if (next == 0)
+	{
+		if (error && *error == NULL)
+			g_set_error (error, OBSESSION_ERROR, SUSPEND_ERROR, "No timer to wake up for");
+		return FALSE;
+	}
+
+	wake_at = next / G_USEC_PER_SEC - WAKE_BEFORE_TIMER;
+	if (wake_at <= g_get_real_time () / G_USEC_PER_SEC)
+	{
+		g_set_error (error, OBSESSION_ERROR, SUSPEND_ERROR, "%s is due now", unit);
+		g_free (unit);
+		return FALSE;
+	}
+
+	g_print ("Waking up for %s\n", unit);
+	g_free (unit);
+	return TRUE;
+}
 
 const gchar *provider(int id)
 {
@@ -44,32 +140,53 @@ const gchar *provider(int id)
 			return "LightDM";
 		case LXDM:
 			return "LXDM";
+		case KERNEL:
+			return "kernel";
 		default:
 			return "Unknown";
 	}
 }
 
+static const gchar *auth_note (HandlerContext* handler_context, guint action)
+{
+	return (handler_context->challenge & action) ? " (needs authentication)" : "";
+}
+
 void get_capabilities (HandlerContext* handler_context)
 {
 	g_print ("Capabilities:\n");
 	if (handler_context->poweroff != NONE)
 	{
-		g_print ("  Shutdown : %s\n", provider(handler_context->poweroff));
+		g_print ("  Shutdown : %s%s\n", provider(handler_context->poweroff), auth_note (handler_context, ACTION_POWEROFF));
 	}
 
 	if (handler_context->reboot != NONE)
 	{
-		g_print ("  Reboot: %s\n", provider(handler_context->reboot));
+		g_print ("  Reboot: %s%s\n", provider(handler_context->reboot), auth_note (handler_context, ACTION_REBOOT));
 	}
 
 	if (handler_context->suspend != NONE)
 	{
-		g_print ("  Suspend: %s\n", provider(handler_context->suspend));
+		gchar *modes = sysfs_read ("/sys/power/mem_sleep");
+
+		g_print ("  Suspend: %s%s\n", provider(handler_context->suspend), auth_note (handler_context, ACTION_SUSPEND));
+		if (modes)
+			g_print ("  Suspend modes: %s\n", modes);
+		g_print ("  Wake alarm: %s\n", sysfs_wakealarm_supported () ? "rtc0" : "none");
+		g_free (modes);
 	}
 
 	if (handler_context->hibernate != NONE)
 	{
-		g_print ("  Hibernate: %s\n", provider(handler_context->hibernate));
+		HibernateCheck check;
+
+		g_print ("  Hibernate: %s%s\n", provider(handler_context->hibernate), auth_note (handler_context, ACTION_HIBERNATE));
+
+		sysfs_hibernate_check (&check);
+		g_print ("  Hibernate check: %s (%s)\n",
+		         check.result == HIBERNATE_CHECK_OK ? "ok" : check.result == HIBERNATE_CHECK_WARN ? "warning" : "failure",
+		         check.message);
+		g_free (check.message);
 	}
 
 	if (handler_context->switch_user != NONE)
@@ -77,8 +194,70 @@ void get_capabilities (HandlerContext* handler_context)
 		g_print ("  User switch: %s\n", provider(handler_context->switch_user));
 	}
 
+	const gchar *whats[] = { "shutdown", "sleep", NULL };
+	gint i;
+	for (i = 0; whats[i]; i++)
+	{
+		gboolean blocked;
+		gchar *list = system_inhibitors (whats[i], &blocked);
+
+		if (list)
+		{
+			gchar **lines = g_strsplit (list, "\n", -1);
+			gchar *indented = g_strjoinv ("\n    ", lines);
+
+			g_print ("  Inhibitors (%s, %s):\n    %s\n", whats[i], blocked ? "blocked" : "delayed", indented);
+			g_free (indented);
+			g_strfreev (lines);
+		}
+		g_free (list);
+	}
+
 	g_print ("Lock command: '%s'\n", handler_context->lock_cmd);
-	g_print ("Logout command: '%s'\n", handler_context->logout_cmd);
+	g_print ("Logout command: '%s'\n", handler_context->logout_cmd ? handler_context->logout_cmd : "built-in");
+	g_print ("Suspend mode: '%s'\n", handler_context->suspend_mode ? handler_context->suspend_mode : "default");
+}
+
+
+/* Countdown while the blockers of an action are waited for. */
+static void inhibit_progress (HandlerContext* handler_context, const gchar *blockers, gint remaining)
+{
+	g_print ("Waiting %d s for:\n%s\n", remaining, blockers);
+}
+
+
+/* Resident mode: run the policies enabled in obsession.conf. */
+static int run_daemon (HandlerContext* handler_context)
+{
+	gboolean running = FALSE;
+	GMainLoop *loop;
+
+	if (handler_context->lock_supervisor)
+		running |= lock_supervisor_start (handler_context);
+
+	if (handler_context->idle_lock > 0 || handler_context->idle_suspend > 0 || handler_context->idle_hibernate > 0)
+		running |= idle_policy_start (handler_context);
+
+	if (handler_context->battery_percentage > 0 || handler_context->battery_time > 0)
+		running |= battery_policy_start (handler_context);
+
+	if (handler_context->thermal_hibernate > 0 || handler_context->thermal_poweroff > 0)
+		running |= thermal_policy_start (handler_context);
+
+	if (handler_context->key_lock || handler_context->key_suspend || handler_context->key_hibernate ||
+	    handler_context->key_reboot || handler_context->key_poweroff || handler_context->key_logout)
+		running |= hotkey_policy_start (handler_context);
+
+	if (!running)
+	{
+		g_print ("Nothing to do, see obsession.conf\n");
+		return 1;
+	}
+
+	loop = g_main_loop_new (NULL, FALSE);
+	g_main_loop_run (loop);
+	g_main_loop_unref (loop);
+	return 0;
 }
 
 
@@ -87,17 +266,29 @@ int main(int argc, char* argv[])
 	HandlerContext handler_context;
 	GError *err = NULL;
 	gboolean poweroff = FALSE;
-	gboolean suspend = FALSE;
 	gboolean hibernate = FALSE;
 	gboolean reboot = FALSE;
 	gboolean capabilities = FALSE;
+	gboolean daemon = FALSE;
+	gboolean logout = FALSE;
+	gboolean ignore_inhibitors = FALSE;
+	gboolean self_stats = FALSE;
+	gint inhibit_wait = -1;
+	const gchar *action = NULL;
 
 	GOptionEntry opt_entries[] = {
 		{ "poweroff",     'p', 0, G_OPTION_ARG_NONE, &poweroff,     "Shutdown the computer", NULL },
-		{ "suspend",      's', 0, G_OPTION_ARG_NONE, &suspend,      "Suspend the computer", NULL },
+		{ "suspend",      's', G_OPTION_FLAG_OPTIONAL_ARG, G_OPTION_ARG_CALLBACK, parse_suspend, "Suspend the computer", "deep|s2idle" },
+		{ "suspend-until", 0,  0, G_OPTION_ARG_CALLBACK, parse_suspend_until, "Suspend the computer, wake it up at TIME", "HH:MM|DATE" },
+		{ "suspend-until-next-timer", 0, 0, G_OPTION_ARG_NONE, &wake_at_timer, "Suspend the computer until the next systemd timer", NULL },
 		{ "hibernate",    'H', 0, G_OPTION_ARG_NONE, &hibernate,    "Go to Hibernation", NULL },
 		{ "reboot",       'r', 0, G_OPTION_ARG_NONE, &reboot,       "Restart the computer", NULL },
+		{ "logout",       'l', 0, G_OPTION_ARG_NONE, &logout,       "End the session", NULL },
+		{ "ignore-inhibitors", 'i', 0, G_OPTION_ARG_NONE, &ignore_inhibitors, "Act even if an application blocks it", NULL },
+		{ "wait",         'w', 0, G_OPTION_ARG_INT,  &inhibit_wait, "Wait at most N s for the applications blocking the action", "N" },
 		{ "capabilities", 'c', 0, G_OPTION_ARG_NONE, &capabilities, "List power capabilities", NULL },
+		{ "daemon",       'd', 0, G_OPTION_ARG_NONE, &daemon,       "Stay in the background and run the policies of obsession.conf", NULL },
+		{ "self-stats",   0,   0, G_OPTION_ARG_NONE, &self_stats,   "Print what each phase costs, check the budget of obsession.conf", NULL },
 		{ NULL }
 	};
 
@@ -105,55 +296,136 @@ int main(int argc, char* argv[])
 		g_type_init ();
 #endif
 
-	initialize_context (&handler_context);
-
 	GOptionContext * context = g_option_context_new ("");
 	g_option_context_add_main_entries (context, opt_entries, PACKAGE " " PACKAGE_VERSION);
 	g_option_context_set_help_enabled (context, TRUE);
 	if ( !g_option_context_parse (context, &argc, &argv, NULL) ||
-	    (!poweroff && !suspend && !hibernate && !reboot && !capabilities))
+	    (!poweroff && !suspend && !wake_at_timer && !hibernate && !reboot && !logout && !capabilities && !daemon))
 	{
 		g_print ("%s", g_option_context_get_help (context, TRUE, NULL));
 		return 1;
 	}
 	g_option_context_free (context);
 
+	if (self_stats)
+	{
+		self_stats_enable ();
+		self_stats_phase ("options");
+	}
+
+	/* The wake alarm is only for a suspend. */
+	if ((wake_at || wake_at_timer) && (hibernate || poweroff || reboot || logout))
+	{
+		g_print ("error --suspend-until only goes with a suspend\n");
+		return self_stats_end (1);
+	}
+
+	if (wake_at_timer)
+	{
+		suspend = TRUE;
+		if (!next_timer (&err))
+		{
+			g_print ("error %s\n", err->message);
+			g_error_free (err);
+			return self_stats_end (1);
+		}
+	}
+
+	if (hibernate)
+		action = "hibernate";
+	else if (poweroff)
+		action = "poweroff";
+	else if (suspend)
+		action = "suspend";
+	else if (reboot)
+		action = "reboot";
+	else if (logout)
+		action = "logout";
+
+	/* Another process is on it: wait for its result, no discovery. A
+	 * suspend with a wake time joins from system_suspend(), under its
+	 * own name. */
+	if (action && !capabilities && !daemon && !wake_at && session_action_join (action, &err))
+	{
+		if (err)
+		{
+			g_print ("error %s\n", err->message);
+			g_error_free (err);
+			return self_stats_end (1);
+		}
+		return self_stats_end (0);
+	}
+
+	initialize_context (&handler_context);
+	self_stats_phase ("context");
+
+	handler_context.ignore_inhibitors = ignore_inhibitors;
+	if (inhibit_wait >= 0)
+		handler_context.inhibit_wait = inhibit_wait;
+	handler_context.inhibit_progress = inhibit_progress;
+
+	if (suspend_mode)
+	{
+		g_free (handler_context.suspend_mode);
+		handler_context.suspend_mode = suspend_mode;
+	}
+	handler_context.wake_at = wake_at;
+
 	if (capabilities)
 	{
 		get_capabilities (&handler_context);
+		self_stats_phase ("capabilities");
+	}
+	else if (daemon)
+	{
+		int status = run_daemon (&handler_context);
+		free_context (&handler_context);
+		return status;
 	}
 	else if (hibernate)
 	{
-		system_hibernate (&handler_context, err);
+		system_hibernate (&handler_context, &err);
 		if (err)
 			goto _error;
+		sleep_wait_resume (&handler_context);
 	}
 	else 	if (poweroff)
 	{
-		system_poweroff (&handler_context, err);
+		system_poweroff (&handler_context, &err);
 		if (err)
 			goto _error;
 	}
 	else if (suspend)
 	{
-		system_suspend (&handler_context, err);
+		system_suspend (&handler_context, &err);
 		if (err)
 			goto _error;
+		sleep_wait_resume (&handler_context);
 	}
 	else if (reboot)
 	{
-		system_reboot (&handler_context, err);
+		system_reboot (&handler_context, &err);
+		if (err)
+			goto _error;
+	}
+	else if (logout)
+	{
+		system_logout (&handler_context, &err);
 		if (err)
 			goto _error;
 	}
 
 	/* We have done with it */
+	if (action)
+		session_action_done (action, NULL);
 	free_context (&handler_context);
-	return 0;
+	return self_stats_end (0);
 
 _error:
 	g_print ("error %s\n", err->message);
+	if (action)
+		session_action_done (action, err);
 	g_error_free (err);
 	free_context (&handler_context);
-	return 1;
+	return self_stats_end (1);
 }
@@ -0,0 +1,342 @@
+/**
+ * Copyright (c) 2011-2013 Fabrice THIROUX <fabrice.thiroux@free.fr> (GPL-3+).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or any
+ * later version. See http://www.gnu.org/copyleft/gpl.html the full text
+ * of the license.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Small privileged helper run through pkexec. It only knows a few fixed
+ * commands and checks every value before writing it to the kernel, so it
+ * doesn't link against anything but the libc.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+static const char *root = "";
+
+/* Same as sysfs_path() but without glib. The fake root is only honoured
+ * when we don't run with borrowed privileges (see main()).
+ */
+static void build_path (char *buffer, size_t size, const char *path)
+{
+	snprintf (buffer, size, "%s%s", root, path);
+}
+
+static int read_file (const char *path, char *buffer, size_t size)
+{
+	char pathname[PATH_MAX];
+	ssize_t length;
+	int fd;
+
+	build_path (pathname, sizeof(pathname), path);
+	fd = open (pathname, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0)
+		return -1;
+
+	length = read (fd, buffer, size - 1);
+	close (fd);
+	if (length < 0)
+		return -1;
+
+	buffer[length] = '\0';
+	return 0;
+}
+
+static int write_file (const char *path, const char *value)
+{
+	char pathname[PATH_MAX];
+	size_t length = strlen (value);
+	int fd;
+
+	build_path (pathname, sizeof(pathname), path);
+	fd = open (pathname, O_WRONLY | O_TRUNC | O_NOFOLLOW);
+	if (fd < 0)
+	{
+		perror (pathname);
+		return -1;
+	}
+
+	if (write (fd, value, length) != (ssize_t) length)
+	{
+		perror (pathname);
+		close (fd);
+		return -1;
+	}
+
+	return close (fd);
+}
+
+/* Is word one of the (space separated, maybe bracketed) words of list? */
+static int list_contains (const char *list, const char *word)
+{
+	size_t length = strlen (word);
+	const char *p = list;
+
+	while ((p = strstr (p, word)) != NULL)
+	{
+		char before = (p == list) ? ' ' : p[-1];
+		char after = p[length];
+
+		if ((before == ' ' || before == '[') &&
+		    (after == ' ' || after == ']' || after == '\n' || after == '\0'))
+			return 1;
+		p += length;
+	}
+	return 0;
+}
+
+static int valid_word (const char *word)
+{
+	if (*word == '\0')
+		return 0;
+
+	for (; *word; word++)
+	{
+		if (!((*word >= 'a' && *word <= 'z') || (*word >= '0' && *word <= '9') || *word == '-'))
+			return 0;
+	}
+	return 1;
+}
+
+static int all_digits (const char *value)
+{
+	if (*value == '\0')
+		return 0;
+
+	for (; *value; value++)
+	{
+		if (*value < '0' || *value > '9')
+			return 0;
+	}
+	return 1;
+}
+
+/* mem-sleep MODE: select the suspend variant (s2idle, shallow, deep). */
+static int cmd_mem_sleep (char **argv)
+{
+	char modes[256];
+
+	if (!valid_word (argv[0]))
+		return 2;
+
+	if (read_file ("/sys/power/mem_sleep", modes, sizeof(modes)) < 0 ||
+	    !list_contains (modes, argv[0]))
+	{
+		fprintf (stderr, "Suspend mode '%s' is not supported\n", argv[0]);
+		return 1;
+	}
+
+	return write_file ("/sys/power/mem_sleep", argv[0]) < 0 ? 1 : 0;
+}
+
+/* drop-caches: drop clean page cache, nothing that needs writing. */
+static int cmd_drop_caches (char **argv)
+{
+	sync ();
+	return write_file ("/proc/sys/vm/drop_caches", "1") < 0 ? 1 : 0;
+}
+
+/* image-size BYTES: size the kernel tries to shrink the hibernation image to. */
+static int cmd_image_size (char **argv)
+{
+	if (!all_digits (argv[0]))
+		return 2;
+
+	return write_file ("/sys/power/image_size", argv[0]) < 0 ? 1 : 0;
+}
+
+/* Write MODE to a kernel choice file, if it is one of its choices. */
+static int write_choice (const char *path, const char *mode)
+{
+	char modes[256];
+
+	if (!valid_word (mode))
+		return 2;
+
+	if (read_file (path, modes, sizeof(modes)) < 0 || !list_contains (modes, mode))
+	{
+		fprintf (stderr, "'%s' is not supported by %s\n", mode, path);
+		return 1;
+	}
+
+	return write_file (path, mode) < 0 ? 1 : 0;
+}
+
+/* state STATE: go to sleep (mem, freeze or disk), returns once resumed. */
+static int cmd_state (char **argv)
+{
+	if (strcmp (argv[0], "mem") != 0 && strcmp (argv[0], "freeze") != 0 && strcmp (argv[0], "disk") != 0)
+		return 2;
+
+	sync ();
+	return write_choice ("/sys/power/state", argv[0]);
+}
+
+/* disk MODE: what to do once the hibernation image is written. */
+static int cmd_disk (char **argv)
+{
+	return write_choice ("/sys/power/disk", argv[0]);
+}
+
+/* reboot, poweroff: ask init, which stops the services first. systemd
+ * takes a signal, other inits go through their own commands, or the
+ * signals of busybox and sysvinit (inittab ctrlaltdel) as a last resort.
+ * Under a fake root the request is written to its "reboot" file instead. */
+static int power_off (const char *name, int systemd_signal, int init_signal)
+{
+	struct stat info;
+	char command[32];
+
+	sync ();
+
+	if (*root)
+		return write_file ("/reboot", name) < 0 ? 1 : 0;
+
+	if (lstat ("/run/systemd/system", &info) == 0 && S_ISDIR (info.st_mode))
+	{
+		if (kill (1, systemd_signal) == 0)
+			return 0;
+	}
+	else
+	{
+		snprintf (command, sizeof(command), "/sbin/%s", name);
+		execl (command, name, (char *) NULL);
+
+		if (kill (1, init_signal) == 0)
+			return 0;
+	}
+
+	perror (name);
+	return 1;
+}
+
+static int cmd_reboot (char **argv)
+{
+	return power_off ("reboot", SIGRTMIN + 5, SIGINT);
+}
+
+static int cmd_poweroff (char **argv)
+{
+	return power_off ("poweroff", SIGRTMIN + 4, SIGUSR2);
+}
+
+/* hot-trip ZONE MILLIDEGREES: move the "hot" trip point of a thermal zone
+ * (thermal_zoneN), which only notifies, below its critical one. */
+static int cmd_hot_trip (char **argv)
+{
+	char path[PATH_MAX], value[64];
+	long critical = 0;
+	int i, hot = -1;
+
+	if (strncmp (argv[0], "thermal_zone", 12) != 0 || !all_digits (argv[0] + 12) || !all_digits (argv[1]))
+		return 2;
+
+	for (i = 0; i < 32; i++)
+	{
+		snprintf (path, sizeof(path), "/sys/class/thermal/%s/trip_point_%d_type", argv[0], i);
+		if (read_file (path, value, sizeof(value)) < 0)
+			break;
+
+		if (strncmp (value, "hot", 3) == 0)
+			hot = i;
+		else if (strncmp (value, "critical", 8) == 0)
+		{
+			snprintf (path, sizeof(path), "/sys/class/thermal/%s/trip_point_%d_temp", argv[0], i);
+			if (read_file (path, value, sizeof(value)) == 0)
+				critical = atol (value);
+		}
+	}
+
+	if (hot < 0)
+	{
+		fprintf (stderr, "%s has no hot trip point\n", argv[0]);
+		return 1;
+	}
+	if (critical > 0 && atol (argv[1]) >= critical)
+	{
+		fprintf (stderr, "%s is above the critical trip point\n", argv[1]);
+		return 1;
+	}
+
+	snprintf (path, sizeof(path), "/sys/class/thermal/%s/trip_point_%d_temp", argv[0], hot);
+	return write_file (path, argv[1]) < 0 ? 1 : 0;
+}
+
+/* wakealarm SECONDS: wake the computer up at this time (since the epoch).
+ * An alarm already set must be cleared first. */
+static int cmd_wakealarm (char **argv)
+{
+	if (!all_digits (argv[0]) || atol (argv[0]) <= (long) time (NULL))
+		return 2;
+
+	if (write_file ("/sys/class/rtc/rtc0/wakealarm", "0") < 0)
+		return 1;
+	return write_file ("/sys/class/rtc/rtc0/wakealarm", argv[0]) < 0 ? 1 : 0;
+}
+
+static const struct {
+	const char *name;
+	int argc;
+	int (*run) (char **);
+} commands[] = {
+	{ "mem-sleep", 1, cmd_mem_sleep },
+	{ "drop-caches", 0, cmd_drop_caches },
+	{ "image-size", 1, cmd_image_size },
+	{ "state", 1, cmd_state },
+	{ "disk", 1, cmd_disk },
+	{ "reboot", 0, cmd_reboot },
+	{ "poweroff", 0, cmd_poweroff },
+	{ "hot-trip", 2, cmd_hot_trip },
+	{ "wakealarm", 1, cmd_wakealarm },
+	{ NULL }
+};
+
+int main (int argc, char *argv[])
+{
+	int i;
+
+	/* pkexec and sudo make us root for real: the environment is the
+	 * caller's, never trust it then. */
+	if (getuid () != 0 && getuid () == geteuid () && getgid () == getegid () &&
+	    !getenv ("PKEXEC_UID") && !getenv ("SUDO_UID") && getenv ("OBSESSION_SYSFS_ROOT"))
+		root = getenv ("OBSESSION_SYSFS_ROOT");
+
+	if (argc >= 2)
+	{
+		for (i = 0; commands[i].name; i++)
+		{
+			if (strcmp (argv[1], commands[i].name) == 0 && argc - 2 == commands[i].argc)
+				return commands[i].run (argv + 2);
+		}
+	}
+
+	fprintf (stderr, "Usage: obsession-helper mem-sleep MODE\n"
+	                 "       obsession-helper drop-caches\n"
+	                 "       obsession-helper image-size BYTES\n"
+	                 "       obsession-helper state mem|freeze|disk\n"
+	                 "       obsession-helper disk MODE\n"
+	                 "       obsession-helper reboot|poweroff\n"
+	                 "       obsession-helper hot-trip ZONE MILLIDEGREES\n"
+	                 "       obsession-helper wakealarm SECONDS\n");
+	return 2;
+}
@@ -22,13 +22,18 @@
 
 #include <locale.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <gtk/gtk.h>
 #include <glib.h>
+#include <glib-unix.h>
 #include <glib/gi18n.h>
 #include <gdk/gdkkeysyms.h>
+#include <gdk/gdkx.h>
 
 #include "config.h"
 #include "dbus-interface.h"
+#include "sysfs-interface.h"
+#include "x-session.h"
 #include "obsession.h"
 
 /* Command parameters. */
@@ -36,11 +41,14 @@ static char * prompt = NULL;
 static char * banner_side = NULL;
 static char * banner_path = NULL;
 
+static gboolean self_stats = FALSE;
+
 static GOptionEntry opt_entries[] =
 {
 	{ "prompt", 'p', 0, G_OPTION_ARG_STRING, &prompt, N_("Custom message to show on the dialog"), N_("message") },
 	{ "banner", 'b', 0, G_OPTION_ARG_STRING, &banner_path, N_("Banner to show on the dialog"), N_("image file") },
 	{ "side", 's', 0, G_OPTION_ARG_STRING, &banner_side, N_("Position of the banner"), "top|left|right|bottom" },
+	{ "self-stats", 0, 0, G_OPTION_ARG_NONE, &self_stats, N_("Print what each phase costs, check the budget of obsession.conf"), NULL },
 	{ NULL }
 };
 
@@ -51,83 +59,242 @@ static void reboot_clicked(GtkButton * button, HandlerContext * handler_context)
 static void suspend_clicked(GtkButton * button, HandlerContext * handler_context);
 static void hibernate_clicked(GtkButton * button, HandlerContext * handler_context);
 static void switch_user_clicked(GtkButton * button, HandlerContext * handler_context);
-static void cancel_clicked(GtkButton * button, gpointer user_data);
+static void cancel_clicked(GtkButton * button, HandlerContext * handler_context);
 static GtkPositionType get_banner_position(void);
 gboolean expose_event(GtkWidget * widget, GdkEventExpose * event, GdkPixbuf * pixbuf);
 
 
-/* Handler for "clicked" signal on Logout button. */
-static void logout_clicked(GtkButton * button, HandlerContext * handler_context)
+/* The label shows an error or a countdown: the inhibitors don't replace it. */
+static gboolean message_shown = FALSE;
+
+/* The action the user may force past its blockers, with a second click. */
+static void (*blocked_action)(HandlerContext *, GError **) = NULL;
+
+/* The override only holds for the next click on the blocked action. */
+static void forget_blocked(HandlerContext * handler_context)
 {
-	/* kill(handler_context->lxsession_pid, SIGTERM); */
-	g_spawn_command_line_async(handler_context->logout_cmd, NULL);
-	gtk_main_quit();
+	handler_context->ignore_inhibitors = FALSE;
+	blocked_action = NULL;
 }
 
-/* Handler for "clicked" signal on Shutdown button. */
-static void shutdown_clicked(GtkButton * button, HandlerContext * handler_context)
+/* Show why action failed. When applications block it, a second click on
+ * it goes on anyway. */
+static void action_failed(HandlerContext * handler_context, void (*action)(HandlerContext *, GError **), GError * err)
 {
-	GError *err = NULL;
-	gtk_label_set_text(GTK_LABEL(handler_context->error_label), NULL);
+	message_shown = TRUE;
+	if (g_error_matches(err, OBSESSION_ERROR, INHIBITED_ERROR))
+	{
+		gchar * message = g_strdup_printf(_("%s\nClick again to proceed anyway."), err->message);
+		gtk_label_set_text(GTK_LABEL(handler_context->error_label), message);
+		handler_context->ignore_inhibitors = TRUE;
+		blocked_action = action;
+		g_free(message);
+	}
+	else
+		gtk_label_set_text(GTK_LABEL(handler_context->error_label), err->message);
 
-	system_poweroff (handler_context, err);
+	g_error_free(err);
+}
 
-	if (err)
+/* Countdown while the blockers of an action are waited for. */
+static void inhibit_progress(HandlerContext * handler_context, const gchar * blockers, gint remaining)
+{
+	gchar * message = g_strdup_printf(_("Waiting %d s for:\n%s"), remaining, blockers);
+	message_shown = TRUE;
+	gtk_label_set_text(GTK_LABEL(handler_context->error_label), message);
+	g_free(message);
+}
+
+/* Power buttons, in the order of the ACTION_* flags. */
+static GtkWidget * action_buttons[4];
+
+/* Show the buttons of the given actions (ACTION_* flags) according to the
+ * context: hidden if nobody can do it, with a tooltip if it needs
+ * authentication or the hibernation image may not fit. */
+static void update_buttons(HandlerContext * handler_context, guint actions)
+{
+	gint providers[] = { handler_context->poweroff, handler_context->reboot,
+	                     handler_context->suspend, handler_context->hibernate };
+	gint i;
+
+	for (i = 0; i < G_N_ELEMENTS(providers); i++)
 	{
-		gtk_label_set_text(GTK_LABEL(handler_context->error_label), err->message);
-		g_error_free (err);
+		GtkWidget * button = action_buttons[i];
+		GString * tooltip;
+		gboolean sensitive = TRUE;
+
+		if (!(actions & (1 << i)))
+			continue;
+
+		if (providers[i] == NONE)
+		{
+			gtk_widget_hide(button);
+			continue;
+		}
+
+		tooltip = g_string_new(NULL);
+		if (handler_context->challenge & (1 << i))
+			g_string_append(tooltip, _("Requires authentication"));
+
+		/* Tell beforehand if the image is not likely to fit in swap. */
+		if ((1 << i) == ACTION_HIBERNATE && handler_context->hibernate_preflight != PREFLIGHT_OFF)
+		{
+			HibernateCheck check;
+			sysfs_hibernate_check (&check);
+			g_string_append_printf(tooltip, "%s%s", tooltip->len ? "\n" : "", check.message);
+			if (check.result == HIBERNATE_CHECK_FAIL && handler_context->hibernate_preflight == PREFLIGHT_REFUSE)
+				sensitive = FALSE;
+			g_free (check.message);
+		}
+
+		gtk_widget_set_tooltip_text(button, tooltip->len ? tooltip->str : NULL);
+		gtk_widget_set_sensitive(button, sensitive);
+		gtk_widget_show(button);
+		g_string_free(tooltip, TRUE);
 	}
-	else gtk_main_quit();
 }
 
-/* Handler for "clicked" signal on Reboot button. */
-static void reboot_clicked(GtkButton * button, HandlerContext * handler_context)
+/* Tell beforehand which applications block shutdown or sleep. */
+static void show_inhibitors(HandlerContext * handler_context)
 {
-	GError *err = NULL;
-	gtk_label_set_text(GTK_LABEL(handler_context->error_label), NULL);
+	const gchar * whats[] = { "shutdown", "sleep" };
+	const gchar * titles[] = { N_("Shutdown blocked by:"), N_("Sleep blocked by:") };
+	GString * text;
+	gint i;
 
-	system_reboot (handler_context, err);
+	if (message_shown)
+		return;
 
-	if (err)
+	text = g_string_new(NULL);
+	for (i = 0; i < 2; i++)
 	{
-		gtk_label_set_text(GTK_LABEL(handler_context->error_label), err->message);
-		g_error_free (err);
+		gboolean blocked;
+		gchar * list = system_inhibitors(whats[i], &blocked);
+
+		if (blocked)
+			g_string_append_printf(text, "%s%s\n%s", text->len ? "\n" : "", _(titles[i]), list);
+		g_free(list);
 	}
-	else gtk_main_quit();
+
+	gtk_label_set_text(GTK_LABEL(handler_context->error_label), text->str);
+	g_string_free(text, TRUE);
 }
 
-/* Handler for "clicked" signal on Suspend button. */
-static void suspend_clicked(GtkButton * button, HandlerContext * handler_context)
+/* Called while the dialog is open, when some actions were probed again. */
+static void context_changed(HandlerContext * handler_context, guint actions)
 {
+	update_buttons(handler_context, actions);
+	show_inhibitors(handler_context);
+}
+
+/* The applications were asked to close: log out, unless some are still
+ * there. A second click logs out anyway. */
+static gboolean logout_forced = FALSE;
+
+static void clients_closed(gchar ** stragglers, gpointer data)
+{
+	HandlerContext * handler_context = data;
+	GtkWidget * window = gtk_widget_get_toplevel(handler_context->error_label);
 	GError *err = NULL;
-	gtk_label_set_text(GTK_LABEL(handler_context->error_label), NULL);
 
-	system_suspend (handler_context, err);
+	if (stragglers)
+	{
+		gchar * names = g_strjoinv(", ", stragglers);
+		gchar * message = g_strdup_printf(_("Still running: %s.\nLogout again to quit anyway."), names);
+
+		gtk_label_set_text(GTK_LABEL(handler_context->error_label), message);
+		message_shown = TRUE;
+		gtk_widget_show(window);
+		logout_forced = TRUE;
+
+		g_free(message);
+		g_free(names);
+		g_strfreev(stragglers);
+		return;
+	}
+
+	/* kill(handler_context->lxsession_pid, SIGTERM); */
+	system_logout(handler_context, &err);
+	forget_blocked(handler_context);
 
 	if (err)
 	{
-		gtk_label_set_text(GTK_LABEL(handler_context->error_label), err->message);
-		g_error_free (err);
+		gtk_widget_show(window);
+		action_failed(handler_context, system_logout, err);
 	}
 	else gtk_main_quit();
 }
 
-/* Handler for "clicked" signal on Hibernate button. */
-static void hibernate_clicked(GtkButton * button, HandlerContext * handler_context)
+/* Handler for "clicked" signal on Logout button. */
+static void logout_clicked(GtkButton * button, HandlerContext * handler_context)
+{
+	if (blocked_action != system_logout)
+		forget_blocked(handler_context);
+
+	/* Let the applications close (and save) first, the main loop runs
+	 * meanwhile. */
+	if (handler_context->close_timeout > 0 && !logout_forced)
+	{
+		gtk_widget_hide(gtk_widget_get_toplevel(GTK_WIDGET(button)));
+		gdk_flush();
+
+		/* While the windows are still there */
+		session_save(handler_context);
+		x_close_clients(handler_context->close_timeout * 1000, clients_closed, handler_context);
+	}
+	else
+		clients_closed(NULL, handler_context);
+}
+
+/* Box of the action buttons, insensitive while an action runs. */
+static GtkWidget * action_box;
+
+/* Run a power action. It may wait for blockers to go, with the dialog
+ * still alive: its buttons can't start another one meanwhile, only
+ * Cancel, which gives the action up. */
+static void run_action(HandlerContext * handler_context, void (*action)(HandlerContext *, GError **))
 {
 	GError *err = NULL;
 	gtk_label_set_text(GTK_LABEL(handler_context->error_label), NULL);
+	message_shown = FALSE;
+
+	if (action != blocked_action)
+		forget_blocked(handler_context);
 
-	system_hibernate (handler_context, err);
+	gtk_widget_set_sensitive(action_box, FALSE);
+	action(handler_context, &err);
+	gtk_widget_set_sensitive(action_box, TRUE);
+	forget_blocked(handler_context);
 
 	if (err)
-	{
-		gtk_label_set_text(GTK_LABEL(handler_context->error_label), err->message);
-		g_error_free (err);
-	}
+		action_failed(handler_context, action, err);
 	else gtk_main_quit();
 }
 
+/* Handler for "clicked" signal on Shutdown button. */
+static void shutdown_clicked(GtkButton * button, HandlerContext * handler_context)
+{
+	run_action(handler_context, system_poweroff);
+}
+
+/* Handler for "clicked" signal on Reboot button. */
+static void reboot_clicked(GtkButton * button, HandlerContext * handler_context)
+{
+	run_action(handler_context, system_reboot);
+}
+
+/* Handler for "clicked" signal on Suspend button. */
+static void suspend_clicked(GtkButton * button, HandlerContext * handler_context)
+{
+	run_action(handler_context, system_suspend);
+}
+
+/* Handler for "clicked" signal on Hibernate button. */
+static void hibernate_clicked(GtkButton * button, HandlerContext * handler_context)
+{
+	run_action(handler_context, system_hibernate);
+}
+
 /* Handler for "clicked" signal on Switch User button. */
 static void switch_user_clicked(GtkButton * button, HandlerContext * handler_context)
 {
@@ -136,17 +303,22 @@ static void switch_user_clicked(GtkButton * button, HandlerContext * handler_con
 	gtk_main_quit();
 }
 
-/* Handler for "clicked" signal on Cancel button. */
-static void cancel_clicked(GtkButton * button, gpointer user_data)
+/* Handler for "clicked" signal on Cancel button. An action waiting
+ * gives up too. */
+static void cancel_clicked(GtkButton * button, HandlerContext * handler_context)
 {
+	forget_blocked(handler_context);
+	g_cancellable_cancel(handler_context->cancellable);
 	gtk_main_quit();
 }
 
 /* Handler for "Escape" key pressed.
  * https://stackoverflow.com/questions/17740771/how-to-program-window-to-close-with-escape-key */
-static gboolean check_escape(GtkWidget *widget, GdkEventKey *event, gpointer data)
+static gboolean check_escape(GtkWidget *widget, GdkEventKey *event, HandlerContext * handler_context)
 {
   if (event->keyval == GDK_KEY_Escape) {
+    forget_blocked(handler_context);
+    g_cancellable_cancel(handler_context->cancellable);
     gtk_main_quit();
     return TRUE;
   }
@@ -194,6 +366,19 @@ gboolean expose_event(GtkWidget * widget, GdkEventExpose * event, GdkPixbuf * pi
 	return FALSE;
 }
 
+/* Another obsession-logout was started: show this one instead. */
+static gboolean raise_dialog(gint listen_fd, GIOCondition condition, gpointer window)
+{
+	gint fd = session_socket_accept(listen_fd);
+
+	if (fd >= 0)
+		close(fd);
+
+	gtk_window_present_with_time(GTK_WINDOW(window),
+	                             gdk_x11_get_server_time(gtk_widget_get_window(GTK_WIDGET(window))));
+	return TRUE;
+}
+
 /* Main program. */
 int main(int argc, char * argv[])
 {
@@ -217,9 +402,30 @@ int main(int argc, char * argv[])
 	}
 	g_option_context_free(context);
 
+	if (self_stats)
+	{
+		self_stats_enable();
+		self_stats_phase("gtk");
+	}
+
+	/* One dialog per session: raise the one already open. */
+	gint dialog_fd = session_socket_listen("dialog");
+	if (dialog_fd < 0)
+	{
+		gint fd = session_socket_connect("dialog");
+		if (fd >= 0)
+		{
+			gboolean sent = write(fd, "raise\n", 6) == 6;
+			close(fd);
+			if (sent)
+				return self_stats_end(0);
+		}
+	}
+
 	HandlerContext handler_context;
 	initialize_context (&handler_context);
-
+	handler_context.display = GDK_DISPLAY_XDISPLAY(gdk_display_get_default());
+	self_stats_phase("context");
 
 
 	/* Make the button images accessible. */
@@ -299,48 +505,33 @@ int main(int argc, char * argv[])
 	gtk_label_set_markup(GTK_LABEL(label), prompt);
 	gtk_box_pack_start(GTK_BOX(controls), label, FALSE, FALSE, 4);
 
-	/* Create the Shutdown button. */
-	if (handler_context.poweroff)
-	{
-		GtkWidget * shutdown_button = gtk_button_new_with_mnemonic(_("Sh_utdown"));
-		GtkWidget * image = gtk_image_new_from_icon_name("system-shutdown", GTK_ICON_SIZE_BUTTON);
-		gtk_button_set_image(GTK_BUTTON(shutdown_button), image);
-		gtk_button_set_alignment(GTK_BUTTON(shutdown_button), 0.0, 0.5);
-		g_signal_connect(G_OBJECT(shutdown_button), "clicked", G_CALLBACK(shutdown_clicked), &handler_context);
-		gtk_box_pack_start(GTK_BOX(controls), shutdown_button, FALSE, FALSE, 4);
-	}
-
-	/* Create the Reboot button. */
-	if (handler_context.reboot)
-	{
-		GtkWidget * reboot_button = gtk_button_new_with_mnemonic(_("_Reboot"));
-		GtkWidget * image = gtk_image_new_from_icon_name("system-restart", GTK_ICON_SIZE_BUTTON);
-		gtk_button_set_image(GTK_BUTTON(reboot_button), image);
-		gtk_button_set_alignment(GTK_BUTTON(reboot_button), 0.0, 0.5);
-		g_signal_connect(G_OBJECT(reboot_button), "clicked", G_CALLBACK(reboot_clicked), &handler_context);
-		gtk_box_pack_start(GTK_BOX(controls), reboot_button, FALSE, FALSE, 4);
-	}
-
-	/* Create the Suspend button. */
-	if (handler_context.suspend)
+	/* Every button but Cancel */
+	action_box = gtk_vbox_new(FALSE, 6);
+	gtk_box_pack_start(GTK_BOX(controls), action_box, FALSE, FALSE, 0);
+
+	/* Create the power buttons. They are all there, hidden while their
+	 * action is not available: see update_buttons(). */
+	const struct {
+		const gchar * label;
+		const gchar * icon;
+		GCallback clicked;
+	} actions[] = {
+		{ N_("Sh_utdown"), "system-shutdown", G_CALLBACK(shutdown_clicked) },
+		{ N_("_Reboot"), "system-restart", G_CALLBACK(reboot_clicked) },
+		{ N_("_Suspend"), "system-suspend", G_CALLBACK(suspend_clicked) },
+		{ N_("_Hibernate"), "system-hibernate", G_CALLBACK(hibernate_clicked) },
+	};
+	gint i;
+	for (i = 0; i < G_N_ELEMENTS(actions); i++)
 	{
-		GtkWidget * suspend_button = gtk_button_new_with_mnemonic(_("_Suspend"));
-		GtkWidget * image = gtk_image_new_from_icon_name("system-suspend", GTK_ICON_SIZE_BUTTON);
-		gtk_button_set_image(GTK_BUTTON(suspend_button), image);
-		gtk_button_set_alignment(GTK_BUTTON(suspend_button), 0.0, 0.5);
-		g_signal_connect(G_OBJECT(suspend_button), "clicked", G_CALLBACK(suspend_clicked), &handler_context);
-		gtk_box_pack_start(GTK_BOX(controls), suspend_button, FALSE, FALSE, 4);
-	}
-
-	/* Create the Hibernate button. */
-	if (handler_context.hibernate)
-	{
-		GtkWidget * hibernate_button = gtk_button_new_with_mnemonic(_("_Hibernate"));
-		GtkWidget * image = gtk_image_new_from_icon_name("system-hibernate", GTK_ICON_SIZE_BUTTON);
-		gtk_button_set_image(GTK_BUTTON(hibernate_button), image);
-		gtk_button_set_alignment(GTK_BUTTON(hibernate_button), 0.0, 0.5);
-		g_signal_connect(G_OBJECT(hibernate_button), "clicked", G_CALLBACK(hibernate_clicked), &handler_context);
-		gtk_box_pack_start(GTK_BOX(controls), hibernate_button, FALSE, FALSE, 4);
+		GtkWidget * button = gtk_button_new_with_mnemonic(_(actions[i].label));
+		GtkWidget * image = gtk_image_new_from_icon_name(actions[i].icon, GTK_ICON_SIZE_BUTTON);
+		gtk_button_set_image(GTK_BUTTON(button), image);
+		gtk_button_set_alignment(GTK_BUTTON(button), 0.0, 0.5);
+		g_signal_connect(G_OBJECT(button), "clicked", actions[i].clicked, &handler_context);
+		gtk_widget_set_no_show_all(button, TRUE);
+		gtk_box_pack_start(GTK_BOX(action_box), button, FALSE, FALSE, 4);
+		action_buttons[i] = button;
 	}
 
 	/* Create the Switch User button. */
@@ -351,7 +542,7 @@ int main(int argc, char * argv[])
 		gtk_button_set_image(GTK_BUTTON(switch_user_button), image);
 		gtk_button_set_alignment(GTK_BUTTON(switch_user_button), 0.0, 0.5);
 		g_signal_connect(G_OBJECT(switch_user_button), "clicked", G_CALLBACK(switch_user_clicked), &handler_context);
-		gtk_box_pack_start(GTK_BOX(controls), switch_user_button, FALSE, FALSE, 4);
+		gtk_box_pack_start(GTK_BOX(action_box), switch_user_button, FALSE, FALSE, 4);
 	}
 
 	/* Create the Logout button. */
@@ -360,27 +551,39 @@ int main(int argc, char * argv[])
 	gtk_button_set_image(GTK_BUTTON(logout_button), image);
 	gtk_button_set_alignment(GTK_BUTTON(logout_button), 0.0, 0.5);
 	g_signal_connect(G_OBJECT(logout_button), "clicked", G_CALLBACK(logout_clicked), &handler_context);
-	gtk_box_pack_start(GTK_BOX(controls), logout_button, FALSE, FALSE, 4);
+	gtk_box_pack_start(GTK_BOX(action_box), logout_button, FALSE, FALSE, 4);
 
 	/* Create the Cancel button. */
 	GtkWidget * cancel_button = gtk_button_new_from_stock(GTK_STOCK_CANCEL);
 	gtk_button_set_alignment(GTK_BUTTON(cancel_button), 0.0, 0.5);
-	g_signal_connect(G_OBJECT(cancel_button), "clicked", G_CALLBACK(cancel_clicked), NULL);
+	g_signal_connect(G_OBJECT(cancel_button), "clicked", G_CALLBACK(cancel_clicked), &handler_context);
 	gtk_box_pack_start(GTK_BOX(controls), cancel_button, FALSE, FALSE, 4);
 
 	/* Create the error text. */
 	handler_context.error_label = gtk_label_new("");
 	gtk_label_set_justify(GTK_LABEL(handler_context.error_label), GTK_JUSTIFY_CENTER);
 	gtk_box_pack_start(GTK_BOX(controls), handler_context.error_label, FALSE, FALSE, 4);
+	handler_context.inhibit_progress = inhibit_progress;
+	show_inhibitors(&handler_context);
+	update_buttons(&handler_context, ACTION_ALL);
+	context_watch(&handler_context, context_changed);
 
-	g_signal_connect(window, "key_press_event", G_CALLBACK(check_escape), NULL);
+	g_signal_connect(window, "key_press_event", G_CALLBACK(check_escape), &handler_context);
 
 	/* Show everything. */
 	gtk_widget_show_all(window);
+	self_stats_phase("dialog");
+
+	if (dialog_fd >= 0)
+		g_unix_fd_add(dialog_fd, G_IO_IN, raise_dialog, window);
 
 	/* Run the main event loop. */
 	gtk_main();
 
+	/* If we went to sleep, record how long it took to wake up. */
+	gtk_widget_destroy(window);
+	sleep_wait_resume (&handler_context);
+
 	/* Return. */
-	return 0;
+	return self_stats_end(0);
 }
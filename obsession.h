@@ -29,40 +29,154 @@ enum {
 	GDM,
 	KDM,
 	LIGHTDM,
-	LXDM
+	LXDM,
+	KERNEL			/* /sys/power and reboot(2) through the helper */
 };
 
+/* Who may handle the power actions */
+enum {
+	BACKEND_AUTO = 0,	/* D-Bus services if there is a system bus, or else the kernel */
+	BACKEND_DBUS,
+	BACKEND_KERNEL
+};
+
+/* What to do when hibernation is not likely to succeed */
+enum {
+	PREFLIGHT_REFUSE = 0,
+	PREFLIGHT_WARN,
+	PREFLIGHT_OFF
+};
+
+/* Power actions, as flags */
+enum {
+	ACTION_POWEROFF = 1 << 0,
+	ACTION_REBOOT = 1 << 1,
+	ACTION_SUSPEND = 1 << 2,
+	ACTION_HIBERNATE = 1 << 3,
+	ACTION_ALL = 0xf
+};
+
+#define OBSESSION_ERROR g_quark_from_static_string ("__obsession_error__")
+
 enum {
 	POWEROFF_ERROR,
 	REBOOT_ERROR,
 	HIBERNATE_ERROR,
 	SUSPEND_ERROR,
-	SWITCH_USER_ERROR
+	SWITCH_USER_ERROR,
+	LOGOUT_ERROR,
+	INHIBITED_ERROR,
+	BUSY_ERROR
 };
 
 
-typedef struct {
+typedef struct _HandlerContext HandlerContext;
+typedef struct _WorkingSet WorkingSet;
+
+struct _HandlerContext {
 	GtkWidget *error_label;		/* Text of an error, if we get one */
+	struct _XDisplay *display;	/* X connection to reuse, NULL to open one */
 	int poweroff;
 	int reboot;
 	int hibernate;
 	int suspend;
 	int switch_user;
+	guint challenge;		/* Actions needing authentication (ACTION_*) */
+	int backend;			/* BACKEND_* */
 	char *logout_cmd;
 	char *lock_cmd;
-} HandlerContext;
+	int lock_timeout;		/* How long we wait for the locker, in ms */
+	gboolean lock_supervisor;	/* Keep the locker ready in obsession-exit --daemon */
+	char *locker_daemon;		/* Resident locker, armed by locker_arm */
+	char *locker_arm;		/* Signal name (USR1...) or "stdin" */
+	int close_timeout;		/* Time given to applications to close on logout, in s */
+	gboolean save_session;		/* Snapshot of the applications when the session ends */
+	gboolean session_saved;
+	char *helper_cmd;		/* Privileged helper, run for kernel settings */
+	char *suspend_mode;		/* s2idle, shallow, deep or NULL for kernel default */
+	int hibernate_preflight;
+	gboolean reclaim;		/* Free memory before hibernating */
+	int reclaim_budget;		/* in ms */
+	char *image_size;		/* Written to /sys/power/image_size */
+	char *hibernate_mode;		/* Written to /sys/power/disk, kernel backend only */
+	gboolean prefetch;		/* Read the working set back after hibernating */
+	char **prefetch_processes;	/* Their names, NULL for the windows' processes */
+	int prefetch_budget;		/* in ms */
+	int prefetch_max;		/* in MiB */
+	WorkingSet *working_set;	/* Recorded before hibernating */
+	const char *sleep_action;	/* Pending sleep, to be recorded on resume */
+	char *sleep_mode;
+	guint64 sleep_reclaimed;
+	gint64 sleep_started;
+	gint64 sleep_resumed;		/* Kernel backend: we saw the resume ourselves */
+	gint64 wake_at;			/* RTC wake alarm for the suspend, in s since the epoch, 0 for none */
+	gboolean ignore_inhibitors;	/* Act even if an application blocks it */
+	int inhibit_wait;		/* How long we wait for blockers to go, in s */
+	GCancellable *cancellable;	/* Gives up the waits of an action (dialog closed) */
+	int auth_timeout;		/* Time given to authenticate, in s */
+	void (*inhibit_progress) (HandlerContext *, const gchar *, gint);	/* Blockers, seconds left */
+	int idle_lock;			/* Idle time before locking, in s, 0 to disable */
+	int idle_suspend;
+	int idle_hibernate;
+	int battery_percentage;		/* Act below this charge, 0 to disable */
+	int battery_time;		/* or below this time left, in s */
+	char *battery_action;		/* "hibernate" or "poweroff" */
+	int battery_warning;		/* Time to cancel the action, in s */
+	int thermal_hibernate;		/* Hibernate above this temperature, in °C, 0 to disable */
+	int thermal_poweroff;		/* Power off above this one */
+	int thermal_hysteresis;		/* Degrees to cool down before acting again */
+	char **thermal_zones;		/* Zones watched (name or type), NULL for all */
+	gboolean thermal_arm;		/* Set the hot trip points to our threshold */
+	char *key_lock;			/* Key bindings of obsession-exit --daemon, */
+	char *key_suspend;		/* openbox style: "W-l", "XF86Sleep" */
+	char *key_hibernate;
+	char *key_reboot;
+	char *key_poweroff;
+	char *key_logout;
+	GPtrArray *hooks;		/* [Hook name] groups */
+	int hooks_deadline;		/* Time given to the hooks of an action, in s */
+};
 
 void initialize_context (HandlerContext *);
+void context_probe (HandlerContext *, guint);
+void context_watch (HandlerContext *, void (*) (HandlerContext *, guint));
 void free_context (HandlerContext *);
 void load_config (HandlerContext *);
 gboolean lock_screen(gchar *);
+gboolean lock_screen_wait(const gchar *, gint);
+gboolean lock_supervisor_start(HandlerContext *);
+gint lock_supervisor_request(gint);
+gboolean idle_policy_start(HandlerContext *);
+gboolean battery_policy_start(HandlerContext *);
+gboolean hotkey_policy_start(HandlerContext *);
+gboolean thermal_policy_start(HandlerContext *);
+gint session_socket_listen(const gchar *);
+gint session_socket_accept(gint);
+gint session_socket_connect(const gchar *);
+gboolean session_action_join(const gchar *, GError **);
+void session_action_done(const gchar *, const GError *);
 gboolean verify_running(const char *, const char *);
 
-void system_suspend (HandlerContext *, GError *);
-void system_hibernate (HandlerContext *, GError *);
-void system_reboot (HandlerContext *, GError *);
-void system_poweroff (HandlerContext *, GError *);
+void system_suspend (HandlerContext *, GError **);
+void system_hibernate (HandlerContext *, GError **);
+void system_reboot (HandlerContext *, GError **);
+void system_poweroff (HandlerContext *, GError **);
 void system_user_switch (HandlerContext *);
+void system_logout (HandlerContext *, GError **);
+void session_save (HandlerContext *);
+void sleep_wait_resume (HandlerContext *);
+void hooks_load (HandlerContext *, GKeyFile *);
+void hooks_free (HandlerContext *);
+void hooks_run (HandlerContext *, const gchar *, gboolean);
+gchar *system_inhibitors (const gchar *, gboolean *);
+WorkingSet *working_set_record (gchar **, guint64, gint);
+gint64 working_set_prefetch (WorkingSet *, gint);
+void working_set_free (WorkingSet *);
+void self_stats_enable (void);
+void self_stats_phase (const gchar *);
+void self_stats_spawned (void);
+void self_stats_load (GKeyFile *);
+int self_stats_end (int);
 
 const gchar *session_get_name();
 
@@ -0,0 +1,580 @@
+/**
+ * Copyright (c) 2011-2013 Fabrice THIROUX <fabrice.thiroux@free.fr> (GPL-3+).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or any
+ * later version. See http://www.gnu.org/copyleft/gpl.html the full text
+ * of the license.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <glib-unix.h>
+#include <X11/Xlib.h>
+
+#include "obsession.h"
+
+/* Windows may vanish before we look at them. */
+static int ignore_errors (Display *display, XErrorEvent *event)
+{
+	return 0;
+}
+
+/* Is this newly mapped window a locker covering the whole screen? */
+static gboolean window_covers_screen (Display *display, Window window)
+{
+	XWindowAttributes attributes;
+	XErrorHandler old_handler;
+	int screen = DefaultScreen (display);
+	Status status;
+
+	old_handler = XSetErrorHandler (ignore_errors);
+	status = XGetWindowAttributes (display, window, &attributes);
+	XSetErrorHandler (old_handler);
+	if (!status)
+		return FALSE;
+
+	return attributes.override_redirect
+	    && attributes.x <= 0 && attributes.y <= 0
+	    && attributes.width >= DisplayWidth (display, screen)
+	    && attributes.height >= DisplayHeight (display, screen);
+}
+
+/* Did the locker die, or exit with an error? A locker going to the
+ * background exits successfully. *status is -1 until it is reaped.
+ */
+static gboolean locker_failed (GPid pid, gint *status)
+{
+	gint wait_status;
+
+	if (*status == -1 && waitpid (pid, &wait_status, WNOHANG) == pid)
+		*status = wait_status;
+
+	return *status != -1 && (!WIFEXITED (*status) || WEXITSTATUS (*status) != 0);
+}
+
+static void locker_reap (GPid pid, gint status, gpointer data)
+{
+	g_spawn_close_pid (pid);
+}
+
+/* Wait until the locker writes to the ready pipe or maps a full screen
+ * window, at most timeout ms. Both are events, nothing is polled. The end
+ * of the pipe alone proves nothing, the locker may have crashed: then we
+ * only wait for its window.
+ */
+static gboolean wait_screen_covered (Display *display, int ready_fd, GPid locker, gint timeout)
+{
+	gint64 deadline = g_get_monotonic_time () + timeout * G_TIME_SPAN_MILLISECOND;
+	struct pollfd fds[2];
+	nfds_t nfds = 1;
+	gint status = -1;
+	gboolean covered = FALSE;
+
+	fds[0].fd = ready_fd;
+	fds[0].events = POLLIN;
+	if (display)
+	{
+		fds[1].fd = ConnectionNumber (display);
+		fds[1].events = POLLIN;
+		nfds = 2;
+	}
+
+	for (;;)
+	{
+		gint64 now = g_get_monotonic_time ();
+		char buffer[16];
+		gssize length;
+
+		while (display && XPending (display))
+		{
+			XEvent event;
+
+			XNextEvent (display, &event);
+			if (event.type == MapNotify && window_covers_screen (display, event.xmap.window))
+				covered = TRUE;
+		}
+
+		if (covered || now >= deadline || locker_failed (locker, &status))
+			break;
+
+		if (poll (fds, nfds, (deadline - now) / G_TIME_SPAN_MILLISECOND + 1) < 0)
+			break;
+
+		if (fds[0].revents)
+		{
+			length = read (ready_fd, buffer, sizeof(buffer));
+			if (length > 0)
+				covered = TRUE;
+			else
+				fds[0].fd = -1;		/* Closed: poll() skips it */
+		}
+	}
+
+	/* Written, then died: not locked. */
+	covered = covered && !locker_failed (locker, &status);
+
+	if (status == -1)
+		g_child_watch_add (locker, locker_reap, NULL);
+	else
+		g_spawn_close_pid (locker);
+	return covered;
+}
+
+/* Run the lock command and wait, at most timeout ms, for the screen to be
+ * actually covered. The locker may report it is ready by writing to the
+ * file descriptor given in $XSS_SLEEP_LOCK_FD; otherwise we watch for its
+ * full screen window to be mapped. Return TRUE if the screen was seen
+ * locked, by a locker still there.
+ */
+gboolean lock_screen_wait (const gchar *cmd, gint timeout)
+{
+	gchar **argv = NULL;
+	gchar **envp;
+	gchar *fd_name;
+	gint ready[2];
+	gboolean spawned, locked = FALSE;
+	Display *display;
+	GPid locker;
+
+	g_return_val_if_fail (cmd != NULL, FALSE);
+
+	switch (lock_supervisor_request (timeout))
+	{
+		case 1:
+			return TRUE;
+		case 0:
+			return FALSE;
+		default:
+			break;
+	}
+
+	if (!g_shell_parse_argv (cmd, NULL, &argv, NULL))
+		return FALSE;
+
+	if (!g_unix_open_pipe (ready, FD_CLOEXEC, NULL))
+	{
+		g_strfreev (argv);
+		return FALSE;
+	}
+
+	/* Only the write end goes to the locker. */
+	fcntl (ready[1], F_SETFD, 0);
+
+	/* Listen to new windows before the locker can map its own. */
+	display = XOpenDisplay (NULL);
+	if (display)
+	{
+		XSelectInput (display, DefaultRootWindow (display), SubstructureNotifyMask);
+		XSync (display, False);
+	}
+
+	fd_name = g_strdup_printf ("%d", ready[1]);
+	envp = g_environ_setenv (g_get_environ (), "XSS_SLEEP_LOCK_FD", fd_name, TRUE);
+	self_stats_spawned ();
+	spawned = g_spawn_async (NULL, argv, envp,
+	                         G_SPAWN_SEARCH_PATH | G_SPAWN_LEAVE_DESCRIPTORS_OPEN | G_SPAWN_DO_NOT_REAP_CHILD,
+	                         NULL, NULL, &locker, NULL);
+	close (ready[1]);
+
+	if (spawned)
+		locked = wait_screen_covered (display, ready[0], locker, timeout);
+
+	if (display)
+		XCloseDisplay (display);
+	close (ready[0]);
+	g_free (fd_name);
+	g_strfreev (envp);
+	g_strfreev (argv);
+	return locked;
+}
+
+
+/*** Lock supervisor ***/
+
+/* obsession-exit --daemon keeps everything needed to lock the screen ready:
+ * the lock command is parsed once and spawned with posix_spawn (vfork-like
+ * in the libc), or a resident locker is only armed with a signal or a line
+ * on its standard input. Clients ask for a lock on the "lock" session
+ * socket and get "locked" or "timeout" back once the screen is covered.
+ */
+
+/* The spawned locker gets the write end of the ready pipe there. */
+#define LOCK_READY_FD 3
+
+/* A resident locker dying sooner than that is not restarted. */
+#define LOCKER_MIN_LIFETIME (5 * G_TIME_SPAN_SECOND)
+
+extern char **environ;
+
+typedef struct {
+	gchar **argv;		/* Lock command, parsed once */
+	gchar **envp;		/* Environment with XSS_SLEEP_LOCK_FD set */
+	gint timeout;
+	Display *display;
+	GPid locker;		/* Spawned locker, while the screen is locked */
+	gchar **daemon_argv;	/* Resident locker */
+	GPid daemon;
+	gint64 daemon_started;
+	gint arm_signal;	/* 0 to arm through stdin */
+	gint arm_fd;
+	gint64 requested;	/* Time of the pending request, or 0 */
+	gboolean covered;	/* Result of the last request */
+	GSList *clients;	/* Waiting for the screen to be covered */
+	gint ready_fd;
+	guint ready_source;
+	guint timeout_source;
+} LockSupervisor;
+
+static LockSupervisor supervisor;
+
+static const struct {
+	const gchar *name;
+	gint signal;
+} arm_signals[] = {
+	{ "HUP", SIGHUP },
+	{ "USR1", SIGUSR1 },
+	{ "USR2", SIGUSR2 },
+	{ "ALRM", SIGALRM },
+	{ NULL, 0 }
+};
+
+/* Tell every client how it went, and log the lock latency. */
+static void supervisor_reply (gboolean covered)
+{
+	gint64 elapsed = (g_get_monotonic_time () - supervisor.requested) / G_TIME_SPAN_MILLISECOND;
+	const gchar *answer = covered ? "locked\n" : "timeout\n";
+	GSList *l;
+
+	if (covered)
+		g_message ("Screen covered %" G_GINT64_FORMAT " ms after the lock request", elapsed);
+	else
+		g_warning ("Screen not covered %" G_GINT64_FORMAT " ms after the lock request", elapsed);
+
+	for (l = supervisor.clients; l; l = l->next)
+	{
+		gint fd = GPOINTER_TO_INT (l->data);
+		send (fd, answer, strlen (answer), MSG_NOSIGNAL);
+		close (fd);
+	}
+	g_slist_free (supervisor.clients);
+	supervisor.clients = NULL;
+
+	if (supervisor.ready_source)
+		g_source_remove (supervisor.ready_source);
+	if (supervisor.timeout_source)
+		g_source_remove (supervisor.timeout_source);
+	if (supervisor.ready_fd >= 0)
+		close (supervisor.ready_fd);
+
+	supervisor.ready_source = 0;
+	supervisor.timeout_source = 0;
+	supervisor.ready_fd = -1;
+	supervisor.requested = 0;
+	supervisor.covered = covered;
+}
+
+/* Only a byte on the ready pipe, from a locker still running, means
+ * locked. The end of the pipe alone may be a crash: then its exit or its
+ * window will tell.
+ */
+static gboolean supervisor_ready (gint fd, GIOCondition condition, gpointer data)
+{
+	gchar buffer[16];
+
+	supervisor.ready_source = 0;
+	if ((condition & G_IO_IN) && read (fd, buffer, sizeof(buffer)) > 0 && supervisor.locker)
+		supervisor_reply (TRUE);
+	return FALSE;
+}
+
+static gboolean supervisor_timeout (gpointer data)
+{
+	supervisor.timeout_source = 0;
+	supervisor_reply (FALSE);
+	return FALSE;
+}
+
+static gboolean supervisor_x_event (gint fd, GIOCondition condition, gpointer data)
+{
+	while (XPending (supervisor.display))
+	{
+		XEvent event;
+
+		XNextEvent (supervisor.display, &event);
+		if (supervisor.requested && event.type == MapNotify &&
+		    window_covers_screen (supervisor.display, event.xmap.window))
+			supervisor_reply (TRUE);
+	}
+	return TRUE;
+}
+
+static void supervisor_locker_exited (GPid pid, gint status, gpointer data)
+{
+	g_spawn_close_pid (pid);
+	supervisor.locker = 0;
+
+	/* Died before covering the screen. */
+	if (supervisor.requested && !supervisor.daemon_argv)
+		supervisor_reply (FALSE);
+}
+
+static void supervisor_spawn_daemon (void);
+
+static void supervisor_daemon_exited (GPid pid, gint status, gpointer data)
+{
+	g_spawn_close_pid (pid);
+	supervisor.daemon = 0;
+	if (supervisor.arm_fd >= 0)
+		close (supervisor.arm_fd);
+	supervisor.arm_fd = -1;
+
+	if (g_get_monotonic_time () - supervisor.daemon_started < LOCKER_MIN_LIFETIME)
+		g_warning ("The resident locker exited right away, it won't be restarted");
+	else
+		supervisor_spawn_daemon ();
+}
+
+/* Start the resident locker, keeping its standard input to arm it. */
+static void supervisor_spawn_daemon (void)
+{
+	GError *error = NULL;
+
+	self_stats_spawned ();
+	if (!g_spawn_async_with_pipes (NULL, supervisor.daemon_argv, NULL,
+	                               G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD,
+	                               NULL, NULL, &supervisor.daemon,
+	                               supervisor.arm_signal ? NULL : &supervisor.arm_fd,
+	                               NULL, NULL, &error))
+	{
+		g_warning ("Can't start the resident locker: %s", error->message);
+		g_error_free (error);
+		return;
+	}
+
+	supervisor.daemon_started = g_get_monotonic_time ();
+	g_child_watch_add (supervisor.daemon, supervisor_daemon_exited, NULL);
+}
+
+/* Spawn the parsed lock command, with the ready pipe on LOCK_READY_FD. */
+static gboolean supervisor_spawn_locker (void)
+{
+	posix_spawn_file_actions_t actions;
+	gint ready[2];
+	pid_t pid;
+	gint result;
+
+	if (!g_unix_open_pipe (ready, FD_CLOEXEC, NULL))
+		return FALSE;
+
+	/* dup2() onto itself would keep FD_CLOEXEC. */
+	if (ready[1] == LOCK_READY_FD)
+	{
+		gint fd = fcntl (ready[1], F_DUPFD_CLOEXEC, LOCK_READY_FD + 1);
+		close (ready[1]);
+		ready[1] = fd;
+	}
+
+	posix_spawn_file_actions_init (&actions);
+	posix_spawn_file_actions_adddup2 (&actions, ready[1], LOCK_READY_FD);
+	self_stats_spawned ();
+	result = posix_spawnp (&pid, supervisor.argv[0], &actions, NULL, supervisor.argv, supervisor.envp);
+	posix_spawn_file_actions_destroy (&actions);
+	close (ready[1]);
+
+	if (result != 0)
+	{
+		g_warning ("Can't run the lock command: %s", g_strerror (result));
+		close (ready[0]);
+		return FALSE;
+	}
+
+	supervisor.locker = pid;
+	g_child_watch_add (pid, supervisor_locker_exited, NULL);
+
+	supervisor.ready_fd = ready[0];
+	supervisor.ready_source = g_unix_fd_add (ready[0], G_IO_IN | G_IO_HUP | G_IO_ERR, supervisor_ready, NULL);
+	return TRUE;
+}
+
+/* Lock now, or join the lock in progress. */
+static void supervisor_lock (void)
+{
+	gboolean started;
+
+	if (supervisor.requested)
+		return;
+
+	supervisor.requested = g_get_monotonic_time ();
+
+	if (supervisor.daemon_argv)
+	{
+		if (supervisor.daemon == 0)
+			started = FALSE;
+		else if (supervisor.arm_signal)
+			started = kill (supervisor.daemon, supervisor.arm_signal) == 0;
+		else
+			started = write (supervisor.arm_fd, "lock\n", 5) == 5;
+	}
+	else if (supervisor.locker)
+	{
+		/* Already locked, don't stack another locker. */
+		supervisor_reply (TRUE);
+		return;
+	}
+	else
+		started = supervisor_spawn_locker ();
+
+	if (!started)
+	{
+		supervisor_reply (FALSE);
+		return;
+	}
+
+	supervisor.timeout_source = g_timeout_add (supervisor.timeout, supervisor_timeout, NULL);
+}
+
+/* The request of a client, once it came. */
+static gboolean supervisor_request (gint fd, GIOCondition condition, gpointer data)
+{
+	gchar request[16];
+	gssize length;
+
+	length = read (fd, request, sizeof(request) - 1);
+	if (length < 0 && errno == EAGAIN)
+		return TRUE;
+
+	if (length > 0 && strncmp (request, "lock", 4) == 0)
+	{
+		supervisor.clients = g_slist_prepend (supervisor.clients, GINT_TO_POINTER (fd));
+		supervisor_lock ();
+	}
+	else
+		close (fd);
+
+	return FALSE;
+}
+
+/* Never wait on a client in the daemon: its request is read when it comes. */
+static gboolean supervisor_accept (gint listen_fd, GIOCondition condition, gpointer data)
+{
+	gint fd = session_socket_accept (listen_fd);
+
+	if (fd < 0)
+		return TRUE;
+
+	g_unix_set_fd_nonblocking (fd, TRUE, NULL);
+	g_unix_fd_add (fd, G_IO_IN | G_IO_HUP | G_IO_ERR, supervisor_request, NULL);
+	return TRUE;
+}
+
+/* Start supervising the screen locker for obsession-exit --daemon. */
+gboolean lock_supervisor_start (HandlerContext *handler_context)
+{
+	gint listen_fd, i;
+
+	listen_fd = session_socket_listen ("lock");
+	if (listen_fd < 0)
+	{
+		g_warning ("A lock supervisor is already running");
+		return FALSE;
+	}
+
+	if (!g_shell_parse_argv (handler_context->lock_cmd, NULL, &supervisor.argv, NULL))
+	{
+		g_warning ("Can't parse the lock command '%s'", handler_context->lock_cmd);
+		close (listen_fd);
+		return FALSE;
+	}
+
+	supervisor.envp = g_environ_setenv (g_strdupv (environ), "XSS_SLEEP_LOCK_FD", G_STRINGIFY (LOCK_READY_FD), TRUE);
+	supervisor.timeout = handler_context->lock_timeout;
+	supervisor.ready_fd = -1;
+	supervisor.arm_fd = -1;
+
+	if (handler_context->locker_daemon &&
+	    g_shell_parse_argv (handler_context->locker_daemon, NULL, &supervisor.daemon_argv, NULL))
+	{
+		for (i = 0; arm_signals[i].name; i++)
+		{
+			if (g_strcmp0 (handler_context->locker_arm, arm_signals[i].name) == 0)
+				supervisor.arm_signal = arm_signals[i].signal;
+		}
+		supervisor_spawn_daemon ();
+	}
+
+	/* Covered screens are seen on the root window. */
+	supervisor.display = XOpenDisplay (NULL);
+	if (supervisor.display)
+	{
+		XSelectInput (supervisor.display, DefaultRootWindow (supervisor.display), SubstructureNotifyMask);
+		XFlush (supervisor.display);
+		g_unix_fd_add (ConnectionNumber (supervisor.display), G_IO_IN, supervisor_x_event, NULL);
+	}
+
+	g_unix_fd_add (listen_fd, G_IO_IN, supervisor_accept, NULL);
+	return TRUE;
+}
+
+/* Ask the lock supervisor to lock the screen and wait for it, at most
+ * timeout ms (0: don't wait). Return 1 if the screen is locked, 0 if not
+ * and -1 if there is no supervisor.
+ */
+gint lock_supervisor_request (gint timeout)
+{
+	struct pollfd pfd;
+	gchar answer[16];
+	gssize length = 0;
+	gint fd;
+
+	/* We are the supervisor. */
+	if (supervisor.argv)
+	{
+		supervisor_lock ();
+		if (timeout == 0)
+			return 1;
+		while (supervisor.requested)
+			g_main_context_iteration (NULL, TRUE);
+		return supervisor.covered ? 1 : 0;
+	}
+
+	fd = session_socket_connect ("lock");
+	if (fd < 0)
+		return -1;
+
+	if (write (fd, "lock\n", 5) != 5)
+	{
+		close (fd);
+		return -1;
+	}
+
+	if (timeout > 0)
+	{
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll (&pfd, 1, timeout + 500) > 0)
+			length = read (fd, answer, sizeof(answer) - 1);
+	}
+	close (fd);
+
+	if (timeout == 0)
+		return 1;
+
+	return length > 0 && strncmp (answer, "locked", 6) == 0 ? 1 : 0;
+}
@@ -0,0 +1,177 @@
+/**
+ * Copyright (c) 2011-2013 Fabrice THIROUX <fabrice.thiroux@free.fr> (GPL-3+).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or any
+ * later version. See http://www.gnu.org/copyleft/gpl.html the full text
+ * of the license.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* --self-stats of obsession-exit and obsession-logout: what a run costs,
+ * sampled at the phase boundaries of main(). Memory and page faults come
+ * from /proc/self/statm and getrusage(), processes started and D-Bus
+ * messages sent are counted here. A [Budget program] group of
+ * obsession.conf sets limits to the last sample:
+ *
+ *   [Budget obsession-exit]
+ *   rss=16384
+ *   faults=4000
+ *   spawns=0
+ *   messages=30
+ *
+ * (KiB of maximum resident memory, minor and major faults, processes,
+ * messages). Going over one of them makes the program exit with 2.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "obsession.h"
+
+typedef struct {
+	gboolean enabled;
+	gint64 start;
+	volatile gint spawns;
+	volatile gint messages;
+	glong rss;			/* Last sample, in KiB */
+	glong max_rss;
+	glong faults;
+	gint budget_rss;		/* 0 for no limit, budget_spawns < 0 too */
+	gint budget_faults;
+	gint budget_spawns;
+	gint budget_messages;
+} SelfStats;
+
+static SelfStats stats = { .budget_spawns = -1, .budget_messages = -1 };
+
+/* Runs in the GDBus worker thread. */
+static GDBusMessage *count_message (GDBusConnection *connection, GDBusMessage *message, gboolean incoming, gpointer data)
+{
+	if (!incoming)
+		g_atomic_int_inc (&stats.messages);
+	return message;
+}
+
+static glong statm_rss (void)
+{
+	gchar *content = NULL;
+	glong rss = 0;
+
+	/* size resident shared... in pages */
+	if (g_file_get_contents ("/proc/self/statm", &content, NULL, NULL))
+	{
+		gchar **fields = g_strsplit (content, " ", 3);
+
+		if (fields[0] && fields[1])
+			rss = g_ascii_strtoll (fields[1], NULL, 10) * (sysconf (_SC_PAGESIZE) / 1024);
+		g_strfreev (fields);
+	}
+	g_free (content);
+	return rss;
+}
+
+/* Start counting. The buses are connected now, so that the messages of
+ * the whole run go through our filter. Their Hello calls are sent by
+ * g_bus_get_sync(), before the filter: counted by hand. */
+void self_stats_enable (void)
+{
+	GBusType buses[] = { G_BUS_TYPE_SYSTEM, G_BUS_TYPE_SESSION };
+	gint i;
+
+	stats.enabled = TRUE;
+	stats.start = g_get_monotonic_time ();
+
+	for (i = 0; i < G_N_ELEMENTS (buses); i++)
+	{
+		GDBusConnection *bus = g_bus_get_sync (buses[i], NULL, NULL);
+
+		/* The connection is shared, the others get this one. */
+		if (bus)
+		{
+			g_atomic_int_inc (&stats.messages);
+			g_dbus_connection_add_filter (bus, count_message, NULL, NULL);
+		}
+	}
+
+	fprintf (stderr, "%-14s %8s %8s %8s %8s %8s %8s\n",
+	         "phase", "ms", "rss", "max rss", "faults", "spawns", "messages");
+}
+
+void self_stats_phase (const gchar *phase)
+{
+	struct rusage usage;
+
+	if (!stats.enabled)
+		return;
+
+	getrusage (RUSAGE_SELF, &usage);
+	stats.rss = statm_rss ();
+	stats.max_rss = usage.ru_maxrss;
+	stats.faults = usage.ru_minflt + usage.ru_majflt;
+
+	fprintf (stderr, "%-14s %8.1f %8ld %8ld %8ld %8d %8d\n", phase,
+	         (g_get_monotonic_time () - stats.start) / 1000.0, stats.rss, stats.max_rss,
+	         stats.faults, g_atomic_int_get (&stats.spawns), g_atomic_int_get (&stats.messages));
+}
+
+void self_stats_spawned (void)
+{
+	g_atomic_int_inc (&stats.spawns);
+}
+
+/* Read the [Budget program] group. */
+void self_stats_load (GKeyFile *kf)
+{
+	gchar *group = g_strdup_printf ("Budget %s", g_get_prgname ());
+
+	stats.budget_rss = g_key_file_get_integer (kf, group, "rss", NULL);
+	stats.budget_faults = g_key_file_get_integer (kf, group, "faults", NULL);
+	if (g_key_file_has_key (kf, group, "spawns", NULL))
+		stats.budget_spawns = g_key_file_get_integer (kf, group, "spawns", NULL);
+	if (g_key_file_has_key (kf, group, "messages", NULL))
+		stats.budget_messages = g_key_file_get_integer (kf, group, "messages", NULL);
+	g_free (group);
+}
+
+static gboolean over_budget (const gchar *name, glong value, glong budget)
+{
+	if (value <= budget)
+		return FALSE;
+
+	fprintf (stderr, "Over budget: %s %ld > %ld\n", name, value, budget);
+	return TRUE;
+}
+
+/* Last sample, status becomes 2 when over the budget. */
+int self_stats_end (int status)
+{
+	gboolean over = FALSE;
+
+	if (!stats.enabled)
+		return status;
+
+	self_stats_phase ("exit");
+
+	if (stats.budget_rss > 0)
+		over |= over_budget ("rss", stats.max_rss, stats.budget_rss);
+	if (stats.budget_faults > 0)
+		over |= over_budget ("faults", stats.faults, stats.budget_faults);
+	if (stats.budget_spawns >= 0)
+		over |= over_budget ("spawns", g_atomic_int_get (&stats.spawns), stats.budget_spawns);
+	if (stats.budget_messages >= 0)
+		over |= over_budget ("messages", g_atomic_int_get (&stats.messages), stats.budget_messages);
+
+	return over ? 2 : status;
+}
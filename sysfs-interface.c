@@ -0,0 +1,380 @@
+/**
+ * Copyright (c) 2011-2013 Fabrice THIROUX <fabrice.thiroux@free.fr> (GPL-3+).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or any
+ * later version. See http://www.gnu.org/copyleft/gpl.html the full text
+ * of the license.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "obsession.h"
+#include "sysfs-interface.h"
+
+/* Build the real path of a kernel file. OBSESSION_SYSFS_ROOT lets us run
+ * against a fake tree (e.g. OBSESSION_SYSFS_ROOT=/tmp/fake reads
+ * /tmp/fake/sys/power/mem_sleep).
+ */
+gchar *sysfs_path (const gchar *path)
+{
+	const gchar *root = g_getenv ("OBSESSION_SYSFS_ROOT");
+
+	if (root == NULL || *root == '\0')
+		return g_strdup (path);
+
+	return g_build_filename (root, path, NULL);
+}
+
+/* Read a kernel file, without its trailing new line. Return NULL if the
+ * file can't be read.
+ */
+gchar *sysfs_read (const gchar *path)
+{
+	gchar *pathname = sysfs_path (path);
+	gchar *content = NULL;
+
+	if (g_file_get_contents (pathname, &content, NULL, NULL))
+		g_strchomp (content);
+
+	g_free (pathname);
+	return content;
+}
+
+/* Return the values listed in a kernel choice file such as
+ * /sys/power/mem_sleep ("s2idle [deep]"). The one between brackets is
+ * the current one, it is stored in current if not NULL.
+ */
+gchar **sysfs_choices (const gchar *path, gchar **current)
+{
+	gchar *content = sysfs_read (path);
+	gchar **modes;
+	gint i;
+
+	if (current)
+		*current = NULL;
+
+	if (content == NULL)
+		return NULL;
+
+	modes = g_strsplit (content, " ", -1);
+	g_free (content);
+
+	for (i = 0; modes[i]; i++)
+	{
+		gchar *mode = modes[i];
+		gsize len = strlen (mode);
+
+		if (len > 2 && mode[0] == '[' && mode[len - 1] == ']')
+		{
+			memmove (mode, mode + 1, len - 2);
+			mode[len - 2] = '\0';
+			if (current)
+				*current = g_strdup (mode);
+		}
+	}
+
+	return modes;
+}
+
+/* Is value one of the choices of a kernel choice file? */
+gboolean sysfs_choice_supported (const gchar *path, const gchar *value)
+{
+	gchar **modes = sysfs_choices (path, NULL);
+	gboolean found = FALSE;
+	gint i;
+
+	for (i = 0; modes && modes[i]; i++)
+	{
+		if (g_strcmp0 (modes[i], value) == 0)
+		{
+			found = TRUE;
+			break;
+		}
+	}
+
+	g_strfreev (modes);
+	return found;
+}
+
+/* Can the RTC wake the computer up? */
+gboolean sysfs_wakealarm_supported (void)
+{
+	gchar *pathname = sysfs_path (SYSFS_WAKEALARM);
+	gboolean supported = g_file_test (pathname, G_FILE_TEST_EXISTS);
+
+	g_free (pathname);
+	return supported;
+}
+
+/* Read a "Key:   value kB" line of /proc/meminfo, in bytes. */
+static guint64 meminfo_get (const gchar *meminfo, const gchar *key)
+{
+	gsize len = strlen (key);
+	const gchar *p = meminfo;
+
+	while (p && *p)
+	{
+		if (strncmp (p, key, len) == 0 && p[len] == ':')
+			return g_ascii_strtoull (p + len + 1, NULL, 10) * 1024;
+
+		p = strchr (p, '\n');
+		if (p)
+			p++;
+	}
+	return 0;
+}
+
+/* Return the largest free space of the swap areas in /proc/swaps, in bytes.
+ * The image is written to a single area (the resume device) so their free
+ * space doesn't add up.
+ */
+static guint64 swaps_largest_free (void)
+{
+	gchar *content = sysfs_read ("/proc/swaps");
+	gchar **lines;
+	guint64 largest = 0;
+	gint i;
+
+	if (content == NULL)
+		return 0;
+
+	lines = g_strsplit (content, "\n", -1);
+	/* First line is the header: Filename Type Size Used Priority */
+	for (i = 1; lines[i]; i++)
+	{
+		guint64 size, used;
+
+		if (sscanf (lines[i], "%*s %*s %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT, &size, &used) == 2 && size > used)
+			largest = MAX (largest, (size - used) * 1024);
+	}
+
+	g_strfreev (lines);
+	g_free (content);
+	return largest;
+}
+
+/* Estimate if a hibernation image can be written, from /proc/meminfo,
+ * /proc/swaps, /sys/power/resume and /sys/power/image_size. Only small
+ * files are read so it takes a few milliseconds. The result is returned
+ * and stored with a human readable message in check.
+ */
+gint sysfs_hibernate_check (HibernateCheck *check)
+{
+	gchar *meminfo, *state, *resume, *image_size;
+	guint64 used, pinned, target;
+	gchar *image, *swap;
+
+	memset (check, 0, sizeof(HibernateCheck));
+
+	state = sysfs_read ("/sys/power/state");
+	if (state == NULL || strstr (state, "disk") == NULL)
+	{
+		g_free (state);
+		check->result = HIBERNATE_CHECK_FAIL;
+		check->message = g_strdup ("Hibernation is not supported by the kernel");
+		return check->result;
+	}
+	g_free (state);
+
+	meminfo = sysfs_read ("/proc/meminfo");
+	if (meminfo == NULL)
+	{
+		check->result = HIBERNATE_CHECK_WARN;
+		check->message = g_strdup ("Can't read memory usage");
+		return check->result;
+	}
+
+	/* Page cache and reclaimable slabs are dropped by the kernel before
+	 * writing the image, what remains (anonymous memory, shmem, kernel) has
+	 * to be saved. */
+	used = meminfo_get (meminfo, "MemTotal") - meminfo_get (meminfo, "MemFree");
+	pinned = used
+	       - MIN (used, meminfo_get (meminfo, "Buffers")
+	                  + meminfo_get (meminfo, "Cached")
+	                  + meminfo_get (meminfo, "SReclaimable"))
+	       + meminfo_get (meminfo, "Shmem");
+	g_free (meminfo);
+
+	/* The kernel tries to shrink the image down to image_size. */
+	image_size = sysfs_read ("/sys/power/image_size");
+	target = image_size ? g_ascii_strtoull (image_size, NULL, 10) : used;
+	g_free (image_size);
+
+	check->image = MIN (used, MAX (pinned, target));
+	check->swap_free = swaps_largest_free ();
+
+	image = g_format_size (check->image);
+	swap = g_format_size (check->swap_free);
+
+	resume = sysfs_read ("/sys/power/resume");
+
+	/* The image is compressed, usually by half. Not fitting even then is a
+	 * sure failure, not fitting uncompressed only a risk. */
+	if (check->swap_free == 0)
+	{
+		check->result = HIBERNATE_CHECK_FAIL;
+		check->message = g_strdup ("No swap space to write the hibernation image");
+	}
+	else if (check->swap_free < check->image / 2)
+	{
+		check->result = HIBERNATE_CHECK_FAIL;
+		check->message = g_strdup_printf ("Not enough swap space: image of about %s, %s free", image, swap);
+	}
+	else if (check->swap_free < check->image)
+	{
+		check->result = HIBERNATE_CHECK_WARN;
+		check->message = g_strdup_printf ("Swap space may be too small: image of about %s, %s free", image, swap);
+	}
+	else if (g_strcmp0 (resume, "0:0") == 0)
+	{
+		/* systemd may still set it just before hibernating. */
+		check->result = HIBERNATE_CHECK_WARN;
+		check->message = g_strdup_printf ("No resume device configured: image of about %s, %s free", image, swap);
+	}
+	else
+	{
+		check->result = HIBERNATE_CHECK_OK;
+		check->message = g_strdup_printf ("Image of about %s, %s of swap free", image, swap);
+	}
+
+	g_free (resume);
+	g_free (swap);
+	g_free (image);
+	return check->result;
+}
+
+/* Return MemFree from /proc/meminfo, in bytes. */
+guint64 sysfs_mem_free (void)
+{
+	gchar *meminfo = sysfs_read ("/proc/meminfo");
+	guint64 free = meminfo ? meminfo_get (meminfo, "MemFree") : 0;
+
+	g_free (meminfo);
+	return free;
+}
+
+/* Return the cgroup (as a /sys/fs/cgroup/... path) where we may ask the
+ * kernel to reclaim memory: the user manager's one which is delegated to
+ * the user, or ours. NULL if there is no cgroup v2 memory controller.
+ */
+gchar *sysfs_user_cgroup (void)
+{
+	gchar *content = sysfs_read ("/proc/self/cgroup");
+	gchar *candidates[2] = { NULL, NULL };
+	gchar *result = NULL;
+	gchar *slice;
+	gint i;
+
+	/* cgroup v2 line: "0::/user.slice/user-1000.slice/session-2.scope" */
+	if (content == NULL || !g_str_has_prefix (content, "0::/"))
+	{
+		g_free (content);
+		return NULL;
+	}
+
+	slice = g_strdup_printf ("/user-%d.slice/", getuid ());
+	gchar *found = strstr (content, slice);
+	if (found)
+	{
+		gchar *parent = g_strndup (content + 3, found + strlen (slice) - (content + 3));
+		candidates[0] = g_strdup_printf ("/sys/fs/cgroup%suser@%d.service", parent, getuid ());
+		g_free (parent);
+	}
+	candidates[1] = g_strconcat ("/sys/fs/cgroup", content + 3, NULL);
+
+	for (i = 0; i < 2 && result == NULL; i++)
+	{
+		gchar *reclaim, *pathname;
+
+		if (candidates[i] == NULL)
+			continue;
+
+		reclaim = g_build_filename (candidates[i], "memory.reclaim", NULL);
+		pathname = sysfs_path (reclaim);
+		if (access (pathname, W_OK) == 0)
+			result = g_strdup (candidates[i]);
+		g_free (pathname);
+		g_free (reclaim);
+	}
+
+	g_free (candidates[0]);
+	g_free (candidates[1]);
+	g_free (slice);
+	g_free (content);
+	return result;
+}
+
+/* Ask the kernel to reclaim bytes of memory from cgroup. Return FALSE if it
+ * could not reclaim that much.
+ */
+gboolean sysfs_cgroup_reclaim (const gchar *cgroup, guint64 bytes)
+{
+	gchar *reclaim = g_build_filename (cgroup, "memory.reclaim", NULL);
+	gchar *pathname = sysfs_path (reclaim);
+	gchar *value = g_strdup_printf ("%" G_GUINT64_FORMAT, bytes);
+	gboolean result = FALSE;
+	int fd;
+
+	fd = open (pathname, O_WRONLY);
+	if (fd >= 0)
+	{
+		/* Fails with EAGAIN when less than asked was reclaimed. */
+		result = write (fd, value, strlen (value)) > 0;
+		close (fd);
+	}
+
+	g_free (value);
+	g_free (pathname);
+	g_free (reclaim);
+	return result;
+}
+
+/* Run the privileged helper (command line from the "helper" key) with
+ * the given arguments and wait for it. Return TRUE on success.
+ */
+gboolean sysfs_helper_run (const gchar *helper_cmd, const gchar * const *args, GError **error)
+{
+	gchar **helper_argv = NULL;
+	GPtrArray *argv;
+	gint status = 0;
+	gboolean result = FALSE;
+	gint i;
+
+	if (!g_shell_parse_argv (helper_cmd, NULL, &helper_argv, error))
+		return FALSE;
+
+	argv = g_ptr_array_new ();
+	for (i = 0; helper_argv[i]; i++)
+		g_ptr_array_add (argv, helper_argv[i]);
+	for (i = 0; args[i]; i++)
+		g_ptr_array_add (argv, (gpointer) args[i]);
+	g_ptr_array_add (argv, NULL);
+
+	self_stats_spawned ();
+	if (g_spawn_sync (NULL, (gchar **) argv->pdata, NULL, G_SPAWN_SEARCH_PATH,
+	                  NULL, NULL, NULL, NULL, &status, error))
+	{
+#if GLIB_CHECK_VERSION(2,70,0)
+		result = g_spawn_check_wait_status (status, error);
+#else
+		result = g_spawn_check_exit_status (status, error);
+#endif
+	}
+
+	g_ptr_array_free (argv, TRUE);
+	g_strfreev (helper_argv);
+	return result;
+}
@@ -0,0 +1,61 @@
+/**
+ * Copyright (c) 2011-2013 Fabrice THIROUX <fabrice.thiroux@free.fr> (GPL-3+).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or any
+ * later version. See http://www.gnu.org/copyleft/gpl.html the full text
+ * of the license.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _SYSFS_INTERFACE_H
+#define _SYSFS_INTERFACE_H
+
+#include <glib.h>
+
+/* Files are looked up under $OBSESSION_SYSFS_ROOT when it is set. */
+extern gchar *sysfs_path (const gchar *);
+extern gchar *sysfs_read (const gchar *);
+
+/* Choice files, e.g. /sys/power/mem_sleep or /sys/power/disk */
+extern gchar **sysfs_choices (const gchar *, gchar **);
+extern gboolean sysfs_choice_supported (const gchar *, const gchar *);
+
+/* RTC wake alarm, in seconds since the epoch */
+#define SYSFS_WAKEALARM "/sys/class/rtc/rtc0/wakealarm"
+extern gboolean sysfs_wakealarm_supported (void);
+
+/* Hibernation pre-flight */
+enum {
+	HIBERNATE_CHECK_OK,
+	HIBERNATE_CHECK_WARN,
+	HIBERNATE_CHECK_FAIL
+};
+
+typedef struct {
+	gint result;
+	guint64 image;		/* Estimated image size, in bytes */
+	guint64 swap_free;	/* Largest free swap area, in bytes */
+	gchar *message;
+} HibernateCheck;
+
+extern gint sysfs_hibernate_check (HibernateCheck *);
+
+/* Memory reclaim */
+extern guint64 sysfs_mem_free (void);
+extern gchar *sysfs_user_cgroup (void);
+extern gboolean sysfs_cgroup_reclaim (const gchar *, guint64);
+
+/* Privileged helper */
+extern gboolean sysfs_helper_run (const gchar *, const gchar * const *, GError **);
+
+#endif
@@ -0,0 +1,510 @@
+/**
+ * Copyright (c) 2011-2013 Fabrice THIROUX <fabrice.thiroux@free.fr> (GPL-3+).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or any
+ * later version. See http://www.gnu.org/copyleft/gpl.html the full text
+ * of the license.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Thermal policy of obsession-exit --daemon: hibernate or power off
+ * before the critical trip point of a thermal zone makes the kernel cut
+ * the power. The zones are read once at start and after a resume, never
+ * polled: in between the kernel tells us when a trip point is crossed.
+ *
+ * The trip crossings come from the "event" group of the thermal generic
+ * netlink family (Linux 5.10 or later), whatever the governor of the
+ * zone. Older kernels only send a zone uevent, and only with the
+ * user_space policy. With arm=true, the "hot" trip point of each zone is
+ * set to our lowest threshold by obsession-helper, so that the crossing
+ * we care about is one of them.
+ *
+ * For tests, OBSESSION_UEVENT_FIFO names a fifo read instead of the
+ * sockets, one uevent per line:
+ *
+ *   change@/devices/virtual/thermal/thermal_zone0 SUBSYSTEM=thermal TEMP=95000
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include <linux/thermal.h>
+#include <glib-unix.h>
+
+#include "obsession.h"
+#include "sysfs-interface.h"
+
+#define THERMAL_CLASS "/sys/class/thermal"
+#define DEFAULT_THERMAL_HYSTERESIS 5
+
+enum {
+	THERMAL_NORMAL,
+	THERMAL_HIBERNATE,
+	THERMAL_POWEROFF
+};
+
+typedef struct {
+	HandlerContext *handler_context;
+	GHashTable *temperatures;	/* Zone (thermal_zoneN) to its last temperature, in m°C */
+	gint acted;			/* Last action, until the zones cool down */
+	guint16 family;			/* Of the thermal generic netlink */
+} ThermalPolicy;
+
+static ThermalPolicy thermal;
+
+/* Is the zone (thermal_zoneN) one of the zones key, by name or type? */
+static gboolean thermal_zone_wanted (const gchar *zone)
+{
+	gchar **zones = thermal.handler_context->thermal_zones;
+	gchar *path, *type;
+	gboolean wanted;
+
+	if (zones == NULL)
+		return TRUE;
+
+	path = g_strdup_printf (THERMAL_CLASS "/%s/type", zone);
+	type = sysfs_read (path);
+	wanted = g_strv_contains ((const gchar * const *) zones, zone) ||
+	         (type && g_strv_contains ((const gchar * const *) zones, type));
+	g_free (type);
+	g_free (path);
+	return wanted;
+}
+
+static gint thermal_zone_read (const gchar *zone)
+{
+	gchar *path = g_strdup_printf (THERMAL_CLASS "/%s/temp", zone);
+	gchar *temp = sysfs_read (path);
+	gint value = temp ? atoi (temp) : 0;
+
+	g_free (temp);
+	g_free (path);
+	return value;
+}
+
+static void thermal_act (gint level, gint temperature)
+{
+	HandlerContext *handler_context = thermal.handler_context;
+	GError *err = NULL;
+
+	thermal.acted = level;
+	g_message ("Temperature %d.%d °C, %s", temperature / 1000, ABS (temperature % 1000) / 100,
+	           level == THERMAL_POWEROFF ? "poweroff" : "hibernate");
+
+	if (level == THERMAL_POWEROFF)
+		system_poweroff (handler_context, &err);
+	else
+	{
+		system_hibernate (handler_context, &err);
+		if (!err)
+			sleep_wait_resume (handler_context);
+	}
+
+	if (err)
+	{
+		g_warning ("Can't %s: %s", level == THERMAL_POWEROFF ? "poweroff" : "hibernate", err->message);
+		g_error_free (err);
+	}
+}
+
+static void thermal_read_all (void);
+
+/* Compare the hottest zone to the thresholds. Once we acted, nothing more
+ * happens until it is hysteresis degrees below the threshold. */
+static void thermal_check (void)
+{
+	HandlerContext *handler_context = thermal.handler_context;
+	gint hysteresis = handler_context->thermal_hysteresis * 1000;
+	gint hibernate = handler_context->thermal_hibernate * 1000;
+	gint poweroff = handler_context->thermal_poweroff * 1000;
+	GHashTableIter iter;
+	gpointer value;
+	gint hottest = G_MININT;
+
+	g_hash_table_iter_init (&iter, thermal.temperatures);
+	while (g_hash_table_iter_next (&iter, NULL, &value))
+		hottest = MAX (hottest, GPOINTER_TO_INT (value));
+
+	if (hottest == G_MININT)
+		return;
+
+	if (thermal.acted == THERMAL_POWEROFF && hottest < poweroff - hysteresis)
+		thermal.acted = hibernate > 0 ? THERMAL_HIBERNATE : THERMAL_NORMAL;
+	if (thermal.acted == THERMAL_HIBERNATE && (hibernate <= 0 || hottest < hibernate - hysteresis))
+	{
+		g_message ("Temperature back to normal");
+		thermal.acted = THERMAL_NORMAL;
+	}
+
+	if (poweroff > 0 && hottest >= poweroff && thermal.acted < THERMAL_POWEROFF)
+		thermal_act (THERMAL_POWEROFF, hottest);
+	else if (hibernate > 0 && hottest >= hibernate && thermal.acted < THERMAL_HIBERNATE)
+	{
+		thermal_act (THERMAL_HIBERNATE, hottest);
+		/* Nothing was said while we slept. */
+		thermal_read_all ();
+		thermal_check ();
+	}
+}
+
+static void thermal_read_all (void)
+{
+	gchar *path = sysfs_path (THERMAL_CLASS);
+	GDir *dir = g_dir_open (path, 0, NULL);
+	const gchar *zone;
+
+	g_hash_table_remove_all (thermal.temperatures);
+	while (dir && (zone = g_dir_read_name (dir)))
+	{
+		if (g_str_has_prefix (zone, "thermal_zone") && thermal_zone_wanted (zone))
+			g_hash_table_insert (thermal.temperatures, g_strdup (zone), GINT_TO_POINTER (thermal_zone_read (zone)));
+	}
+
+	if (dir)
+		g_dir_close (dir);
+	g_free (path);
+}
+
+/* A uevent: "action@devpath" followed by KEY=VALUE fields. */
+static void thermal_uevent (gchar **fields)
+{
+	const gchar *devpath, *zone, *temp = NULL;
+	gboolean thermal_subsystem = FALSE;
+	gint i;
+
+	if (fields[0] == NULL || (devpath = strchr (fields[0], '@')) == NULL)
+		return;
+
+	for (i = 1; fields[i]; i++)
+	{
+		if (g_strcmp0 (fields[i], "SUBSYSTEM=thermal") == 0)
+			thermal_subsystem = TRUE;
+		else if (g_str_has_prefix (fields[i], "TEMP="))
+			temp = fields[i] + strlen ("TEMP=");
+	}
+
+	zone = strrchr (devpath, '/');
+	if (!thermal_subsystem || zone == NULL || !g_str_has_prefix (++zone, "thermal_zone") || !thermal_zone_wanted (zone))
+		return;
+
+	g_hash_table_insert (thermal.temperatures, g_strdup (zone),
+	                     GINT_TO_POINTER (temp ? atoi (temp) : thermal_zone_read (zone)));
+	thermal_check ();
+}
+
+static gboolean thermal_netlink (gint fd, GIOCondition condition, gpointer data)
+{
+	struct sockaddr_nl sender;
+	socklen_t length = sizeof(sender);
+	gchar buffer[4096];
+	gchar **fields;
+	GPtrArray *list;
+	gssize size;
+	gssize i;
+
+	size = recvfrom (fd, buffer, sizeof(buffer) - 1, MSG_DONTWAIT, (struct sockaddr *) &sender, &length);
+	/* Only the kernel speaks on this group. */
+	if (size <= 0 || sender.nl_pid != 0)
+		return TRUE;
+	buffer[size] = '\0';
+
+	/* The fields are separated by NULs. */
+	list = g_ptr_array_new ();
+	for (i = 0; i < size; i += strlen (buffer + i) + 1)
+		g_ptr_array_add (list, buffer + i);
+	g_ptr_array_add (list, NULL);
+	fields = (gchar **) g_ptr_array_free (list, FALSE);
+
+	thermal_uevent (fields);
+	g_free (fields);
+	return TRUE;
+}
+
+static gboolean thermal_fifo (GIOChannel *channel, GIOCondition condition, gpointer data)
+{
+	gchar *line = NULL;
+
+	while (g_io_channel_read_line (channel, &line, NULL, NULL, NULL) == G_IO_STATUS_NORMAL)
+	{
+		gchar **fields = g_strsplit (g_strstrip (line), " ", -1);
+
+		thermal_uevent (fields);
+		g_strfreev (fields);
+		g_free (line);
+	}
+	return TRUE;
+}
+
+#ifdef THERMAL_GENL_EVENT_GROUP_NAME
+
+static gboolean nla_ok (const struct nlattr *attribute, gint length)
+{
+	return length >= NLA_HDRLEN && attribute->nla_len >= NLA_HDRLEN && attribute->nla_len <= length;
+}
+
+static const struct nlattr *nla_next (const struct nlattr *attribute, gint *length)
+{
+	*length -= NLA_ALIGN (attribute->nla_len);
+	return (const struct nlattr *) ((const gchar *) attribute + NLA_ALIGN (attribute->nla_len));
+}
+
+static const gchar *nla_data (const struct nlattr *attribute)
+{
+	return (const gchar *) attribute + NLA_HDRLEN;
+}
+
+/* A trip point of a zone was crossed, one way or the other. */
+static gboolean thermal_genl (gint fd, GIOCondition condition, gpointer data)
+{
+	struct sockaddr_nl sender;
+	socklen_t length = sizeof(sender);
+	guint32 buffer[2048];
+	const struct nlmsghdr *message;
+	gssize size;
+
+	size = recvfrom (fd, buffer, sizeof(buffer), MSG_DONTWAIT, (struct sockaddr *) &sender, &length);
+	/* Only the kernel speaks on this group. */
+	if (size <= 0 || sender.nl_pid != 0)
+		return TRUE;
+
+	for (message = (struct nlmsghdr *) buffer; NLMSG_OK (message, size); message = NLMSG_NEXT (message, size))
+	{
+		const struct genlmsghdr *header = NLMSG_DATA (message);
+		const struct nlattr *attribute = (const struct nlattr *) ((const gchar *) header + GENL_HDRLEN);
+		gint left = message->nlmsg_len - NLMSG_LENGTH (GENL_HDRLEN);
+		gint64 id = -1, temp = G_MININT;
+		gchar *zone;
+
+		if (message->nlmsg_type != thermal.family ||
+		    (header->cmd != THERMAL_GENL_EVENT_TZ_TRIP_UP && header->cmd != THERMAL_GENL_EVENT_TZ_TRIP_DOWN))
+			continue;
+
+		for (; nla_ok (attribute, left); attribute = nla_next (attribute, &left))
+		{
+			if ((attribute->nla_type & NLA_TYPE_MASK) == THERMAL_GENL_ATTR_TZ_ID)
+				id = *(const guint32 *) nla_data (attribute);
+			else if ((attribute->nla_type & NLA_TYPE_MASK) == THERMAL_GENL_ATTR_TZ_TEMP)
+				temp = *(const gint32 *) nla_data (attribute);
+		}
+		if (id < 0)
+			continue;
+
+		zone = g_strdup_printf ("thermal_zone%" G_GINT64_FORMAT, id);
+		if (thermal_zone_wanted (zone))
+		{
+			/* Not every kernel gives the temperature. */
+			g_hash_table_insert (thermal.temperatures, g_strdup (zone),
+			                     GINT_TO_POINTER (temp != G_MININT ? (gint) temp : thermal_zone_read (zone)));
+			thermal_check ();
+		}
+		g_free (zone);
+	}
+	return TRUE;
+}
+
+/* Ask the kernel for the id of the thermal family and of its event
+ * group. Return FALSE if there is none. */
+static gboolean thermal_genl_resolve (gint fd, guint32 *group)
+{
+	struct {
+		struct nlmsghdr message;
+		struct genlmsghdr header;
+		guint32 attributes[16];
+	} request;
+	struct nlattr *name = (struct nlattr *) request.attributes;
+	guint32 reply[2048];
+	const struct nlmsghdr *message = (struct nlmsghdr *) reply;
+	const struct nlattr *attribute;
+	gssize size;
+	gint left;
+
+	memset (&request, 0, sizeof(request));
+	name->nla_type = CTRL_ATTR_FAMILY_NAME;
+	name->nla_len = NLA_HDRLEN + sizeof(THERMAL_GENL_FAMILY_NAME);
+	memcpy ((gchar *) name + NLA_HDRLEN, THERMAL_GENL_FAMILY_NAME, sizeof(THERMAL_GENL_FAMILY_NAME));
+	request.message.nlmsg_len = NLMSG_LENGTH (GENL_HDRLEN) + NLA_ALIGN (name->nla_len);
+	request.message.nlmsg_type = GENL_ID_CTRL;
+	request.message.nlmsg_flags = NLM_F_REQUEST;
+	request.header.cmd = CTRL_CMD_GETFAMILY;
+	request.header.version = 1;
+
+	/* An unknown family is answered with NLMSG_ERROR. */
+	if (send (fd, &request, request.message.nlmsg_len, 0) < 0 ||
+	    (size = recv (fd, reply, sizeof(reply), 0)) <= 0 ||
+	    !NLMSG_OK (message, size) || message->nlmsg_type != GENL_ID_CTRL)
+		return FALSE;
+
+	thermal.family = 0;
+	*group = 0;
+	attribute = (const struct nlattr *) ((const gchar *) NLMSG_DATA (message) + GENL_HDRLEN);
+	left = message->nlmsg_len - NLMSG_LENGTH (GENL_HDRLEN);
+	for (; nla_ok (attribute, left); attribute = nla_next (attribute, &left))
+	{
+		const struct nlattr *entry = (const struct nlattr *) nla_data (attribute);
+		gint entries = attribute->nla_len - NLA_HDRLEN;
+
+		if ((attribute->nla_type & NLA_TYPE_MASK) == CTRL_ATTR_FAMILY_ID)
+			thermal.family = *(const guint16 *) nla_data (attribute);
+		if ((attribute->nla_type & NLA_TYPE_MASK) != CTRL_ATTR_MCAST_GROUPS)
+			continue;
+
+		/* Nested, each group a name and an id. */
+		for (; *group == 0 && nla_ok (entry, entries); entry = nla_next (entry, &entries))
+		{
+			const struct nlattr *field = (const struct nlattr *) nla_data (entry);
+			gint fields = entry->nla_len - NLA_HDRLEN;
+			const gchar *group_name = NULL;
+			guint32 group_id = 0;
+
+			for (; nla_ok (field, fields); field = nla_next (field, &fields))
+			{
+				if ((field->nla_type & NLA_TYPE_MASK) == CTRL_ATTR_MCAST_GRP_NAME)
+					group_name = nla_data (field);
+				else if ((field->nla_type & NLA_TYPE_MASK) == CTRL_ATTR_MCAST_GRP_ID)
+					group_id = *(const guint32 *) nla_data (field);
+			}
+			if (g_strcmp0 (group_name, THERMAL_GENL_EVENT_GROUP_NAME) == 0)
+				*group = group_id;
+		}
+	}
+	return thermal.family != 0 && *group != 0;
+}
+
+/* Join the event group of the thermal generic netlink family. */
+static gboolean thermal_genl_listen (void)
+{
+	gint fd = socket (AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+	guint32 group;
+
+	if (fd < 0)
+		return FALSE;
+
+	if (!thermal_genl_resolve (fd, &group) ||
+	    setsockopt (fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group, sizeof(group)) < 0)
+	{
+		close (fd);
+		return FALSE;
+	}
+
+	g_unix_fd_add (fd, G_IO_IN, thermal_genl, NULL);
+	return TRUE;
+}
+
+#else
+
+static gboolean thermal_genl_listen (void)
+{
+	return FALSE;
+}
+
+#endif
+
+static gboolean thermal_listen (void)
+{
+	const gchar *fifo = g_getenv ("OBSESSION_UEVENT_FIFO");
+	struct sockaddr_nl address;
+	gint fd;
+
+	if (fifo && *fifo)
+	{
+		GIOChannel *channel;
+
+		/* Read and write, or we would see the end of file whenever the
+		 * writer goes. */
+		if ((fd = open (fifo, O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0)
+			return FALSE;
+		channel = g_io_channel_unix_new (fd);
+		g_io_channel_set_encoding (channel, NULL, NULL);
+		g_io_add_watch (channel, G_IO_IN, thermal_fifo, NULL);
+		return TRUE;
+	}
+
+	if (thermal_genl_listen ())
+		return TRUE;
+	g_warning ("No thermal netlink events, only the zones with the user_space policy are heard");
+
+	fd = socket (AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
+		return FALSE;
+
+	memset (&address, 0, sizeof(address));
+	address.nl_family = AF_NETLINK;
+	address.nl_groups = 1;	/* Kernel events, not udev's */
+	if (bind (fd, (struct sockaddr *) &address, sizeof(address)) < 0)
+	{
+		close (fd);
+		return FALSE;
+	}
+
+	g_unix_fd_add (fd, G_IO_IN, thermal_netlink, NULL);
+	return TRUE;
+}
+
+/* Move the "hot" trip point of each zone to our lowest threshold. */
+static void thermal_arm (void)
+{
+	HandlerContext *handler_context = thermal.handler_context;
+	gint threshold = handler_context->thermal_hibernate > 0 ? handler_context->thermal_hibernate : handler_context->thermal_poweroff;
+	gchar *millidegrees = g_strdup_printf ("%d", threshold * 1000);
+	GHashTableIter iter;
+	gpointer zone;
+
+	g_hash_table_iter_init (&iter, thermal.temperatures);
+	while (g_hash_table_iter_next (&iter, &zone, NULL))
+	{
+		const gchar *args[] = { "hot-trip", zone, millidegrees, NULL };
+		GError *err = NULL;
+
+		if (!sysfs_helper_run (handler_context->helper_cmd, args, &err))
+		{
+			g_message ("Can't arm %s: %s", (gchar *) zone, err ? err->message : "no hot trip point");
+			g_clear_error (&err);
+		}
+	}
+	g_free (millidegrees);
+}
+
+/* Start the thermal policy for obsession-exit --daemon. */
+gboolean thermal_policy_start (HandlerContext *handler_context)
+{
+	thermal.handler_context = handler_context;
+	if (handler_context->thermal_hysteresis <= 0)
+		handler_context->thermal_hysteresis = DEFAULT_THERMAL_HYSTERESIS;
+
+	thermal.temperatures = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	thermal_read_all ();
+	if (g_hash_table_size (thermal.temperatures) == 0)
+	{
+		g_warning ("No thermal zone, no thermal policy");
+		g_hash_table_destroy (thermal.temperatures);
+		return FALSE;
+	}
+
+	if (!thermal_listen ())
+	{
+		g_warning ("Can't listen to the thermal events, no thermal policy");
+		g_hash_table_destroy (thermal.temperatures);
+		return FALSE;
+	}
+
+	if (handler_context->thermal_arm)
+		thermal_arm ();
+
+	/* Already too hot? */
+	thermal_check ();
+	return TRUE;
+}
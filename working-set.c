@@ -0,0 +1,453 @@
+/**
+ * Copyright (c) 2011-2013 Fabrice THIROUX <fabrice.thiroux@free.fr> (GPL-3+).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or any
+ * later version. See http://www.gnu.org/copyleft/gpl.html the full text
+ * of the license.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Working set of the session, recorded before hibernating and read back
+ * from swap right after the resume, so that the desktop doesn't fault it
+ * in page by page. The resident pages of each process are found in
+ * /proc/PID/pagemap and merged in large ranges; after the resume, they are
+ * given to process_madvise(MADV_WILLNEED) by batches, in address order,
+ * until a time or size budget is spent. process_madvise() wants
+ * CAP_SYS_NICE: without it, only the files mapped in the ranges are read
+ * ahead (posix_fadvise(POSIX_FADV_WILLNEED)), anonymous memory is left
+ * to the faults and the time to get the working set back isn't measured.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "obsession.h"
+#include "x-session.h"
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_process_madvise
+#define SYS_process_madvise 440
+#endif
+
+#define PAGEMAP_PRESENT (G_GUINT64_CONSTANT (1) << 63)
+
+/* Holes up to this many pages are read too: fewer, longer reads. */
+#define RANGE_GAP 16
+/* iovecs per process_madvise() call (UIO_MAXIOV) */
+#define ADVICE_BATCH 1024
+/* The working set is back when this much of it is resident, in %. */
+#define RESIDENT_TARGET 90
+
+typedef struct {
+	pid_t pid;
+	guint64 start_time;		/* Field 22 of /proc/PID/stat, against pid reuse */
+	GArray *ranges;			/* struct iovec, by address */
+	guint64 bytes;
+} WorkingSetProcess;
+
+struct _WorkingSet {
+	GPtrArray *processes;
+	guint64 bytes;			/* Resident when recorded, holes excluded */
+};
+
+static guint64 process_start_time (pid_t pid)
+{
+	gchar *path = g_strdup_printf ("/proc/%d/stat", pid);
+	gchar *content = NULL, *p;
+	guint64 start_time = 0;
+	gint field;
+
+	/* The name, field 2, may hold spaces: count from its closing ')'. */
+	if (g_file_get_contents (path, &content, NULL, NULL) && (p = strrchr (content, ')')))
+	{
+		for (field = 2; p && field < 22; field++)
+			p = strchr (p + 1, ' ');
+		if (p)
+			start_time = g_ascii_strtoull (p + 1, NULL, 10);
+	}
+
+	g_free (content);
+	g_free (path);
+	return start_time;
+}
+
+static void process_free (gpointer data)
+{
+	WorkingSetProcess *process = data;
+
+	g_array_free (process->ranges, TRUE);
+	g_free (process);
+}
+
+static void range_add (GArray *ranges, guint64 start, guint64 end)
+{
+	struct iovec *last = ranges->len ? &g_array_index (ranges, struct iovec, ranges->len - 1) : NULL;
+	struct iovec range;
+
+	if (last && start - ((guint64) (gsize) last->iov_base + last->iov_len) <= RANGE_GAP * (guint64) sysconf (_SC_PAGESIZE))
+	{
+		last->iov_len = end - (guint64) (gsize) last->iov_base;
+		return;
+	}
+
+	range.iov_base = (void *) (gsize) start;
+	range.iov_len = end - start;
+	g_array_append_val (ranges, range);
+}
+
+/* Count the pages of [start, end) whose pagemap entry has one of bits,
+ * adding the runs of such pages to ranges if not NULL. */
+static guint64 pagemap_scan (gint fd, guint64 start, guint64 end, guint64 bits, GArray *ranges)
+{
+	guint64 page_size = sysconf (_SC_PAGESIZE);
+	guint64 entries[512];
+	guint64 address = start, run = 0, found = 0;
+
+	while (address < end)
+	{
+		gsize count = MIN (G_N_ELEMENTS (entries), (end - address) / page_size);
+		gssize size = pread (fd, entries, count * sizeof(guint64), address / page_size * sizeof(guint64));
+		gsize i;
+
+		if (size <= 0)
+			break;
+
+		for (i = 0; i < size / sizeof(guint64); i++, address += page_size)
+		{
+			if (entries[i] & bits)
+			{
+				if (!run)
+					run = address;
+				found++;
+			}
+			else if (run)
+			{
+				if (ranges)
+					range_add (ranges, run, address);
+				run = 0;
+			}
+		}
+	}
+
+	if (run && ranges)
+		range_add (ranges, run, address);
+	return found * page_size;
+}
+
+/* Resident ranges of a process, at most max bytes. */
+static WorkingSetProcess *process_record (pid_t pid, guint64 max, gint64 deadline)
+{
+	gchar *path = g_strdup_printf ("/proc/%d/maps", pid);
+	gchar *maps = NULL;
+	gchar **lines;
+	WorkingSetProcess *process;
+	gint fd, i;
+
+	g_file_get_contents (path, &maps, NULL, NULL);
+	g_free (path);
+	path = g_strdup_printf ("/proc/%d/pagemap", pid);
+	fd = open (path, O_RDONLY | O_CLOEXEC);
+	g_free (path);
+
+	if (maps == NULL || fd < 0)
+	{
+		if (fd >= 0)
+			close (fd);
+		g_free (maps);
+		return NULL;
+	}
+
+	process = g_new0 (WorkingSetProcess, 1);
+	process->pid = pid;
+	process->start_time = process_start_time (pid);
+	process->ranges = g_array_new (FALSE, FALSE, sizeof(struct iovec));
+
+	lines = g_strsplit (maps, "\n", -1);
+	for (i = 0; lines[i] && process->bytes < max && g_get_monotonic_time () < deadline; i++)
+	{
+		guint64 start, end;
+		gchar perms[5];
+
+		/* "start-end perms offset dev inode path", only what can be read */
+		if (sscanf (lines[i], "%" G_GINT64_MODIFIER "x-%" G_GINT64_MODIFIER "x %4s", &start, &end, perms) != 3 ||
+		    perms[0] != 'r' || strstr (lines[i], "[vsyscall]"))
+			continue;
+
+		process->bytes += pagemap_scan (fd, start, MIN (end, start + (max - process->bytes)), PAGEMAP_PRESENT, process->ranges);
+	}
+
+	g_strfreev (lines);
+	g_free (maps);
+	close (fd);
+
+	if (process->ranges->len == 0)
+	{
+		process_free (process);
+		return NULL;
+	}
+	return process;
+}
+
+/* Processes of the configured names, or those owning a window. */
+static GArray *working_set_pids (gchar **names)
+{
+	GArray *pids = g_array_new (FALSE, FALSE, sizeof(pid_t));
+	pid_t self = getpid ();
+
+	if (names)
+	{
+		GDir *dir = g_dir_open ("/proc", 0, NULL);
+		const gchar *entry;
+
+		while (dir && (entry = g_dir_read_name (dir)))
+		{
+			gchar *path, *comm = NULL;
+			pid_t pid = atoi (entry);
+
+			if (pid <= 0 || pid == self)
+				continue;
+
+			path = g_strdup_printf ("/proc/%d/comm", pid);
+			if (g_file_get_contents (path, &comm, NULL, NULL) &&
+			    g_strv_contains ((const gchar * const *) names, g_strchomp (comm)))
+				g_array_append_val (pids, pid);
+			g_free (comm);
+			g_free (path);
+		}
+		if (dir)
+			g_dir_close (dir);
+	}
+	else
+	{
+		Display *display = XOpenDisplay (NULL);
+		Window *clients;
+		gulong count, i, j;
+
+		if (display == NULL)
+			return pids;
+
+		/* The last mapped first. */
+		clients = x_get_clients (display, &count);
+		for (i = count; clients && i > 0; i--)
+		{
+			pid_t pid = x_get_pid (display, clients[i - 1]);
+
+			for (j = 0; j < pids->len && g_array_index (pids, pid_t, j) != pid; j++);
+			if (pid > 0 && pid != self && j == pids->len)
+				g_array_append_val (pids, pid);
+		}
+		g_free (clients);
+		XCloseDisplay (display);
+	}
+	return pids;
+}
+
+/* Record the working set of the processes of names (or of the windows),
+ * max bytes at most, within budget ms. */
+WorkingSet *working_set_record (gchar **names, guint64 max, gint budget)
+{
+	gint64 deadline = g_get_monotonic_time () + budget * G_TIME_SPAN_MILLISECOND;
+	WorkingSet *working_set = g_new0 (WorkingSet, 1);
+	GArray *pids = working_set_pids (names);
+	guint i;
+
+	working_set->processes = g_ptr_array_new_with_free_func (process_free);
+	for (i = 0; i < pids->len && working_set->bytes < max && g_get_monotonic_time () < deadline; i++)
+	{
+		WorkingSetProcess *process = process_record (g_array_index (pids, pid_t, i), max - working_set->bytes, deadline);
+
+		if (process == NULL)
+			continue;
+
+		working_set->bytes += process->bytes;
+		g_ptr_array_add (working_set->processes, process);
+	}
+	g_message ("Working set of %u processes: %" G_GUINT64_FORMAT " bytes", working_set->processes->len, working_set->bytes);
+
+	g_array_free (pids, TRUE);
+	return working_set;
+}
+
+void working_set_free (WorkingSet *working_set)
+{
+	if (working_set == NULL)
+		return;
+
+	g_ptr_array_free (working_set->processes, TRUE);
+	g_free (working_set);
+}
+
+/* Bytes of the working set in memory. */
+static guint64 working_set_resident (WorkingSet *working_set)
+{
+	guint64 resident = 0;
+	guint i, j;
+
+	for (i = 0; i < working_set->processes->len; i++)
+	{
+		WorkingSetProcess *process = g_ptr_array_index (working_set->processes, i);
+		gchar *path = g_strdup_printf ("/proc/%d/pagemap", process->pid);
+		gint fd = open (path, O_RDONLY | O_CLOEXEC);
+
+		g_free (path);
+		if (fd < 0)
+			continue;
+
+		for (j = 0; j < process->ranges->len; j++)
+		{
+			struct iovec *range = &g_array_index (process->ranges, struct iovec, j);
+			guint64 start = (guint64) (gsize) range->iov_base;
+
+			resident += pagemap_scan (fd, start, start + range->iov_len, PAGEMAP_PRESENT, NULL);
+		}
+		close (fd);
+	}
+	return resident;
+}
+
+/* Read ahead the files mapped in the ranges of process. Return the bytes
+ * advised. */
+static guint64 process_readahead (WorkingSetProcess *process)
+{
+	gchar *path = g_strdup_printf ("/proc/%d/maps", process->pid);
+	gchar *maps = NULL;
+	gchar **lines;
+	guint64 advised = 0;
+	gint i;
+	guint j;
+
+	g_file_get_contents (path, &maps, NULL, NULL);
+	g_free (path);
+	if (maps == NULL)
+		return 0;
+
+	lines = g_strsplit (maps, "\n", -1);
+	for (i = 0; lines[i]; i++)
+	{
+		guint64 start, end, offset, inode;
+		gchar perms[5];
+		gint name = 0, fd = -1;
+
+		/* "start-end perms offset dev inode path", files only */
+		if (sscanf (lines[i], "%" G_GINT64_MODIFIER "x-%" G_GINT64_MODIFIER "x %4s %" G_GINT64_MODIFIER "x %*s %" G_GINT64_MODIFIER "u %n",
+		            &start, &end, perms, &offset, &inode, &name) != 5 || inode == 0 || name == 0 ||
+		    lines[i][name] != '/' || g_str_has_suffix (lines[i], " (deleted)"))
+			continue;
+
+		for (j = 0; j < process->ranges->len; j++)
+		{
+			struct iovec *range = &g_array_index (process->ranges, struct iovec, j);
+			guint64 low = MAX (start, (guint64) (gsize) range->iov_base);
+			guint64 high = MIN (end, (guint64) (gsize) range->iov_base + range->iov_len);
+
+			if (low >= high)
+				continue;
+			if (fd < 0 && (fd = open (lines[i] + name, O_RDONLY | O_CLOEXEC)) < 0)
+				break;
+			if (posix_fadvise (fd, offset + (low - start), high - low, POSIX_FADV_WILLNEED) == 0)
+				advised += high - low;
+		}
+		if (fd >= 0)
+			close (fd);
+	}
+
+	g_strfreev (lines);
+	g_free (maps);
+	return advised;
+}
+
+/* Ask the kernel to read the working set back, until budget ms are spent.
+ * Return the time it took to be RESIDENT_TARGET % resident, in ms, or -1
+ * if it wasn't within the budget. */
+gint64 working_set_prefetch (WorkingSet *working_set, gint budget)
+{
+	gint64 start = g_get_monotonic_time ();
+	gint64 deadline = start + budget * G_TIME_SPAN_MILLISECOND;
+	static gboolean denied = FALSE;
+	guint64 advised = 0;
+	guint i, j;
+
+	for (i = 0; i < working_set->processes->len && g_get_monotonic_time () < deadline; i++)
+	{
+		WorkingSetProcess *process = g_ptr_array_index (working_set->processes, i);
+		gint pidfd;
+
+		if (process_start_time (process->pid) != process->start_time)
+			continue;
+
+		if (denied)
+		{
+			advised += process_readahead (process);
+			continue;
+		}
+
+		if ((pidfd = syscall (SYS_pidfd_open, process->pid, 0)) < 0)
+			continue;
+
+		for (j = 0; j < process->ranges->len && g_get_monotonic_time () < deadline; j += ADVICE_BATCH)
+		{
+			struct iovec *ranges = &g_array_index (process->ranges, struct iovec, j);
+			gsize count = MIN (ADVICE_BATCH, process->ranges->len - j);
+			gssize size = syscall (SYS_process_madvise, pidfd, ranges, count, MADV_WILLNEED, 0);
+
+			if (size < 0 && errno == EPERM)
+			{
+				g_message ("Can't prefetch the memory of other processes without CAP_SYS_NICE, only their files");
+				denied = TRUE;
+				advised += process_readahead (process);
+				break;
+			}
+			if (size < 0)
+			{
+				g_message ("Can't prefetch the memory of %d: %s", process->pid, g_strerror (errno));
+				break;
+			}
+			advised += size;
+		}
+		close (pidfd);
+	}
+
+	/* The anonymous memory only comes back on faults: the working set
+	 * won't be resident, don't wait for it. */
+	if (denied)
+	{
+		g_message ("Read ahead %" G_GUINT64_FORMAT " bytes of mapped files, working set not measured", advised);
+		return -1;
+	}
+
+	/* The reads are asynchronous: wait for them, within the budget. */
+	while (working_set->bytes && g_get_monotonic_time () < deadline)
+	{
+		if (working_set_resident (working_set) * 100 >= working_set->bytes * RESIDENT_TARGET)
+		{
+			gint64 elapsed = (g_get_monotonic_time () - start) / 1000;
+
+			g_message ("Prefetched %" G_GUINT64_FORMAT " bytes, working set back in %" G_GINT64_FORMAT " ms",
+			           advised, elapsed);
+			return elapsed;
+		}
+		g_usleep (20 * 1000);
+	}
+
+	g_message ("Prefetched %" G_GUINT64_FORMAT " bytes, working set not back within %d ms", advised, budget);
+	return -1;
+}
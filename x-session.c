@@ -0,0 +1,576 @@
+/**
+ * Copyright (c) 2011-2013 Fabrice THIROUX <fabrice.thiroux@free.fr> (GPL-3+).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or any
+ * later version. See http://www.gnu.org/copyleft/gpl.html the full text
+ * of the license.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <glib-unix.h>
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/Xutil.h>
+
+#include "obsession.h"
+#include "x-session.h"
+
+/* Windows may vanish at any time while we look at them. */
+static int ignore_errors (Display *display, XErrorEvent *event)
+{
+	return 0;
+}
+
+/* Read a list of 32 bits values from a window property. */
+static gulong *get_cardinals (Display *display, Window window, Atom property, Atom type, gulong *count)
+{
+	Atom actual_type;
+	int actual_format;
+	gulong after;
+	guchar *data = NULL;
+	gulong *result = NULL;
+
+	*count = 0;
+	if (XGetWindowProperty (display, window, property, 0, G_MAXINT / 4, False, type,
+	                        &actual_type, &actual_format, count, &after, &data) == Success
+	    && actual_format == 32 && *count > 0)
+	{
+		/* Xlib returns format 32 data as longs. */
+#if GLIB_CHECK_VERSION(2,68,0)
+		result = g_memdup2 (data, *count * sizeof(gulong));
+#else
+		result = g_memdup (data, *count * sizeof(gulong));
+#endif
+	}
+	else
+		*count = 0;
+
+	if (data)
+		XFree (data);
+	return result;
+}
+
+/* Return the windows managed by the window manager. */
+Window *x_get_clients (Display *display, gulong *count)
+{
+	return (Window *) get_cardinals (display, DefaultRootWindow (display),
+	                                 XInternAtom (display, "_NET_CLIENT_LIST", False),
+	                                 XA_WINDOW, count);
+}
+
+/* Return the pid of the owner of window, or 0. */
+pid_t x_get_pid (Display *display, Window window)
+{
+	gulong count;
+	gulong *pid = get_cardinals (display, window, XInternAtom (display, "_NET_WM_PID", False), XA_CARDINAL, &count);
+	pid_t result = pid ? (pid_t) pid[0] : 0;
+
+	g_free (pid);
+	return result;
+}
+
+/* Return the title of window, for humans. */
+gchar *x_get_name (Display *display, Window window)
+{
+	Atom actual_type;
+	int actual_format;
+	gulong count, after;
+	guchar *data = NULL;
+	gchar *name = NULL;
+
+	if (XGetWindowProperty (display, window, XInternAtom (display, "_NET_WM_NAME", False), 0, 1024, False,
+	                        XInternAtom (display, "UTF8_STRING", False),
+	                        &actual_type, &actual_format, &count, &after, &data) == Success && data)
+	{
+		name = g_strndup ((gchar *) data, count);
+		XFree (data);
+	}
+	else
+	{
+		char *wm_name = NULL;
+		if (XFetchName (display, window, &wm_name) && wm_name)
+		{
+			name = g_strdup (wm_name);
+			XFree (wm_name);
+		}
+	}
+
+	return name ? name : g_strdup_printf ("0x%lx", window);
+}
+
+/* Does window accept WM_DELETE_WINDOW? */
+static gboolean supports_delete (Display *display, Window window, Atom wm_delete_window)
+{
+	Atom *protocols = NULL;
+	int i, count = 0;
+	gboolean result = FALSE;
+
+	if (XGetWMProtocols (display, window, &protocols, &count))
+	{
+		for (i = 0; i < count; i++)
+		{
+			if (protocols[i] == wm_delete_window)
+				result = TRUE;
+		}
+		XFree (protocols);
+	}
+	return result;
+}
+
+/* Forget the windows that left the client list. */
+static void prune_pending (Display *display, GArray *pending)
+{
+	gulong count, i;
+	Window *clients = x_get_clients (display, &count);
+	guint j = 0;
+
+	while (j < pending->len)
+	{
+		Window window = g_array_index (pending, Window, j);
+		gboolean found = FALSE;
+
+		for (i = 0; i < count && !found; i++)
+			found = clients[i] == window;
+
+		if (found)
+			j++;
+		else
+			g_array_remove_index_fast (pending, j);
+	}
+
+	g_free (clients);
+}
+
+/* Closing of the clients, see x_close_clients(). */
+typedef struct {
+	Display *display;
+	Atom client_list;
+	GArray *pending;
+	guint watch;
+	guint timeout_source;
+	XClientsClosed done;
+	gpointer data;
+} CloseClients;
+
+/* Tell who is still there, and forget everything. */
+static void close_clients_finish (CloseClients *closing)
+{
+	XErrorHandler old_handler = XSetErrorHandler (ignore_errors);
+	gchar **stragglers = NULL;
+	guint i;
+
+	if (closing->watch)
+		g_source_remove (closing->watch);
+	if (closing->timeout_source)
+		g_source_remove (closing->timeout_source);
+
+	if (closing->pending->len > 0)
+	{
+		stragglers = g_new0 (gchar *, closing->pending->len + 1);
+		for (i = 0; i < closing->pending->len; i++)
+		{
+			Window window = g_array_index (closing->pending, Window, i);
+			stragglers[i] = x_get_name (closing->display, window);
+			g_message ("'%s' (pid %d) did not close in time", stragglers[i], x_get_pid (closing->display, window));
+		}
+	}
+
+	g_array_free (closing->pending, TRUE);
+	XSetErrorHandler (old_handler);
+	XCloseDisplay (closing->display);
+
+	closing->done (stragglers, closing->data);
+	g_free (closing);
+}
+
+static gboolean close_clients_x_event (gint fd, GIOCondition condition, gpointer data)
+{
+	CloseClients *closing = data;
+	XErrorHandler old_handler = XSetErrorHandler (ignore_errors);
+
+	while (XPending (closing->display) && closing->pending->len > 0)
+	{
+		XEvent event;
+
+		XNextEvent (closing->display, &event);
+		if ((event.type == PropertyNotify && event.xproperty.atom == closing->client_list) ||
+		    event.type == DestroyNotify)
+			prune_pending (closing->display, closing->pending);
+	}
+	XSetErrorHandler (old_handler);
+
+	if (closing->pending->len > 0)
+		return TRUE;
+
+	closing->watch = 0;
+	close_clients_finish (closing);
+	return FALSE;
+}
+
+static gboolean close_clients_timeout (gpointer data)
+{
+	CloseClients *closing = data;
+
+	closing->timeout_source = 0;
+	close_clients_finish (closing);
+	return FALSE;
+}
+
+/* Ask every client window to close (WM_DELETE_WINDOW), all at once, and
+ * wait for them to go, at most timeout ms, from the main loop. The wait is
+ * driven by X events so it lasts as long as the slowest application. Then
+ * done gets the names of the windows still there, NULL if none, to free.
+ */
+void x_close_clients (gint timeout, XClientsClosed done, gpointer data)
+{
+	CloseClients *closing;
+	XErrorHandler old_handler;
+	Display *display = XOpenDisplay (NULL);
+	Window root, *clients;
+	Atom wm_protocols, wm_delete_window;
+	gulong count, i;
+
+	if (display == NULL)
+	{
+		done (NULL, data);
+		return;
+	}
+
+	closing = g_new0 (CloseClients, 1);
+	closing->display = display;
+	closing->done = done;
+	closing->data = data;
+
+	old_handler = XSetErrorHandler (ignore_errors);
+	root = DefaultRootWindow (display);
+	wm_protocols = XInternAtom (display, "WM_PROTOCOLS", False);
+	wm_delete_window = XInternAtom (display, "WM_DELETE_WINDOW", False);
+	closing->client_list = XInternAtom (display, "_NET_CLIENT_LIST", False);
+
+	/* Clients leave the list when they are gone. */
+	XSelectInput (display, root, PropertyChangeMask);
+
+	closing->pending = g_array_new (FALSE, FALSE, sizeof(Window));
+	clients = x_get_clients (display, &count);
+	for (i = 0; i < count; i++)
+	{
+		XEvent event;
+
+		/* Not ours, and only those which can be asked. */
+		if (x_get_pid (display, clients[i]) == getpid () ||
+		    !supports_delete (display, clients[i], wm_delete_window))
+			continue;
+
+		memset (&event, 0, sizeof(event));
+		event.xclient.type = ClientMessage;
+		event.xclient.window = clients[i];
+		event.xclient.message_type = wm_protocols;
+		event.xclient.format = 32;
+		event.xclient.data.l[0] = wm_delete_window;
+		event.xclient.data.l[1] = CurrentTime;
+		XSendEvent (display, clients[i], False, NoEventMask, &event);
+
+		XSelectInput (display, clients[i], StructureNotifyMask);
+		g_array_append_val (closing->pending, clients[i]);
+	}
+	g_free (clients);
+	XFlush (display);
+	XSetErrorHandler (old_handler);
+
+	if (closing->pending->len == 0)
+	{
+		close_clients_finish (closing);
+		return;
+	}
+
+	closing->watch = g_unix_fd_add (ConnectionNumber (display), G_IO_IN, close_clients_x_event, closing);
+	closing->timeout_source = g_timeout_add (timeout, close_clients_timeout, closing);
+}
+
+/* Return the name of the running EWMH window manager, or NULL. */
+gchar *x_get_wm_name (Display *display)
+{
+	gulong count;
+	Window *check = (Window *) get_cardinals (display, DefaultRootWindow (display),
+	                                          XInternAtom (display, "_NET_SUPPORTING_WM_CHECK", False),
+	                                          XA_WINDOW, &count);
+	gchar *name = NULL;
+
+	if (check)
+	{
+		name = x_get_name (display, check[0]);
+		g_free (check);
+	}
+	return name;
+}
+
+/* Ask the window manager to exit with a client message on the root
+ * window, like "openbox --exit" does, but without starting a process.
+ * Only Openbox (_OB_CONTROL) is known. The connection of the caller is
+ * used when it has one. Return TRUE if the message was sent.
+ */
+gboolean x_wm_exit (Display *connection)
+{
+	Display *display = connection ? connection : XOpenDisplay (NULL);
+	XErrorHandler old_handler;
+	gboolean result = FALSE;
+	gchar *wm_name;
+
+	if (display == NULL)
+		return FALSE;
+
+	old_handler = XSetErrorHandler (ignore_errors);
+	wm_name = x_get_wm_name (display);
+	if (g_strcmp0 (wm_name, "Openbox") == 0)
+	{
+		XEvent event;
+
+		memset (&event, 0, sizeof(event));
+		event.xclient.type = ClientMessage;
+		event.xclient.window = DefaultRootWindow (display);
+		event.xclient.message_type = XInternAtom (display, "_OB_CONTROL", False);
+		event.xclient.format = 32;
+		event.xclient.data.l[0] = 3;	/* 1: reconfigure, 2: restart, 3: exit */
+		result = XSendEvent (display, DefaultRootWindow (display), False,
+		                     SubstructureNotifyMask | SubstructureRedirectMask, &event) != 0;
+		XSync (display, False);
+	}
+
+	g_free (wm_name);
+	XSetErrorHandler (old_handler);
+	if (connection == NULL)
+		XCloseDisplay (display);
+	return result;
+}
+
+/* Return the class part of WM_CLASS, or "". */
+gchar *x_get_class (Display *display, Window window)
+{
+	XClassHint hint = { NULL, NULL };
+	gchar *class;
+
+	if (!XGetClassHint (display, window, &hint))
+		return g_strdup ("");
+
+	class = g_strdup (hint.res_class ? hint.res_class : "");
+	if (hint.res_name)
+		XFree (hint.res_name);
+	if (hint.res_class)
+		XFree (hint.res_class);
+	return class;
+}
+
+/* Panels and desktops are started by autostart, not part of the session. */
+static gboolean is_session_window (Display *display, Window window)
+{
+	gulong count, i;
+	gulong *types = get_cardinals (display, window, XInternAtom (display, "_NET_WM_WINDOW_TYPE", False), XA_ATOM, &count);
+	Atom dock = XInternAtom (display, "_NET_WM_WINDOW_TYPE_DOCK", False);
+	Atom desktop = XInternAtom (display, "_NET_WM_WINDOW_TYPE_DESKTOP", False);
+	gboolean result = TRUE;
+
+	for (i = 0; i < count; i++)
+	{
+		if (types[i] == dock || types[i] == desktop)
+			result = FALSE;
+	}
+	g_free (types);
+	return result;
+}
+
+/* Command line of a local process of ours, NULL if it's not one. */
+static gchar **process_argv (pid_t pid)
+{
+	gchar *pathname = g_strdup_printf ("/proc/%d", pid);
+	gchar *cmdline = NULL;
+	gchar **argv = NULL;
+	GPtrArray *args;
+	gsize length, i;
+	struct stat st;
+
+	/* A remote client gives a pid of its host. */
+	if (stat (pathname, &st) < 0 || st.st_uid != getuid ())
+		goto out;
+
+	g_free (pathname);
+	pathname = g_strdup_printf ("/proc/%d/cmdline", pid);
+	if (!g_file_get_contents (pathname, &cmdline, &length, NULL) || length == 0)
+		goto out;
+
+	args = g_ptr_array_new ();
+	for (i = 0; i < length; i += strlen (cmdline + i) + 1)
+		g_ptr_array_add (args, g_strdup (cmdline + i));
+	g_ptr_array_add (args, NULL);
+	argv = (gchar **) g_ptr_array_free (args, FALSE);
+
+out:
+	g_free (cmdline);
+	g_free (pathname);
+	return argv;
+}
+
+/* Where the window manager shows window: top left of its frame. */
+static void window_geometry (Display *display, Window window, gint *x, gint *y, gint *width, gint *height)
+{
+	Window root, child;
+	int wx, wy;
+	unsigned int w, h, border, depth;
+	gulong count;
+	gulong *extents;
+
+	*x = *y = *width = *height = 0;
+	if (!XGetGeometry (display, window, &root, &wx, &wy, &w, &h, &border, &depth) ||
+	    !XTranslateCoordinates (display, window, root, 0, 0, &wx, &wy, &child))
+		return;
+
+	extents = get_cardinals (display, window, XInternAtom (display, "_NET_FRAME_EXTENTS", False), XA_CARDINAL, &count);
+	if (count == 4)
+	{
+		wx -= extents[0];
+		wy -= extents[2];
+	}
+	g_free (extents);
+
+	*x = wx;
+	*y = wy;
+	*width = w;
+	*height = h;
+}
+
+typedef struct {
+	pid_t pid;
+	gchar **argv;
+	gchar *directory;
+	GVariantBuilder *windows;
+} Process;
+
+/* Describe the applications of the session, for SESSION_SNAPSHOT. The
+ * connection of the caller is used when it has one. Return NULL without a
+ * display. */
+GVariant *x_session_snapshot (Display *connection)
+{
+	Display *display = connection ? connection : XOpenDisplay (NULL);
+	XErrorHandler old_handler;
+	GArray *processes;
+	GVariantBuilder builder;
+	Window *clients;
+	gulong count, i;
+	guint j;
+
+	if (display == NULL)
+		return NULL;
+
+	old_handler = XSetErrorHandler (ignore_errors);
+	processes = g_array_new (FALSE, TRUE, sizeof(Process));
+
+	clients = x_get_clients (display, &count);
+	for (i = 0; i < count; i++)
+	{
+		pid_t pid = x_get_pid (display, clients[i]);
+		Process *process = NULL;
+		gulong desktop_count;
+		gulong *desktop;
+		gint x, y, width, height;
+		gchar *class;
+
+		if (pid == 0 || pid == getpid () || !is_session_window (display, clients[i]))
+			continue;
+
+		for (j = 0; j < processes->len && !process; j++)
+		{
+			if (g_array_index (processes, Process, j).pid == pid)
+				process = &g_array_index (processes, Process, j);
+		}
+
+		if (process == NULL)
+		{
+			Process new_process = { pid, process_argv (pid), NULL, NULL };
+			gchar *cwd = g_strdup_printf ("/proc/%d/cwd", pid);
+
+			if (new_process.argv == NULL)
+			{
+				g_free (cwd);
+				continue;
+			}
+			new_process.directory = g_file_read_link (cwd, NULL);
+			new_process.windows = g_variant_builder_new (G_VARIANT_TYPE ("a(siiiii)"));
+			g_free (cwd);
+
+			g_array_append_val (processes, new_process);
+			process = &g_array_index (processes, Process, processes->len - 1);
+		}
+
+		desktop = get_cardinals (display, clients[i], XInternAtom (display, "_NET_WM_DESKTOP", False), XA_CARDINAL, &desktop_count);
+		window_geometry (display, clients[i], &x, &y, &width, &height);
+		class = x_get_class (display, clients[i]);
+
+		/* 0xFFFFFFFF, on all desktops, becomes -1 too. */
+		g_variant_builder_add (process->windows, "(siiiii)", class,
+		                       desktop ? (gint32) desktop[0] : -1, x, y, width, height);
+		g_free (class);
+		g_free (desktop);
+	}
+	g_free (clients);
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE (SESSION_SNAPSHOT_TYPE));
+	for (j = 0; j < processes->len; j++)
+	{
+		Process *process = &g_array_index (processes, Process, j);
+
+		g_variant_builder_add (&builder, "(^asa(siiiii))", process->argv,
+		                       process->directory ? process->directory : "", process->windows);
+		g_variant_builder_unref (process->windows);
+		g_strfreev (process->argv);
+		g_free (process->directory);
+	}
+
+	g_array_free (processes, TRUE);
+	XSetErrorHandler (old_handler);
+	if (connection == NULL)
+		XCloseDisplay (display);
+	return g_variant_builder_end (&builder);
+}
+
+static void send_root_message (Display *display, Window window, const gchar *type, long l0, long l1, long l2, long l3, long l4)
+{
+	XEvent event;
+
+	memset (&event, 0, sizeof(event));
+	event.xclient.type = ClientMessage;
+	event.xclient.window = window;
+	event.xclient.message_type = XInternAtom (display, type, False);
+	event.xclient.format = 32;
+	event.xclient.data.l[0] = l0;
+	event.xclient.data.l[1] = l1;
+	event.xclient.data.l[2] = l2;
+	event.xclient.data.l[3] = l3;
+	event.xclient.data.l[4] = l4;
+	XSendEvent (display, DefaultRootWindow (display), False,
+	            SubstructureNotifyMask | SubstructureRedirectMask, &event);
+}
+
+/* Ask the window manager to put window back where it was: frame at x, y,
+ * client of width x height, on desktop (-1 to leave it). */
+void x_place_window (Display *display, Window window, gint desktop, gint x, gint y, gint width, gint height)
+{
+	/* NorthWest gravity, x y width height given, from a pager */
+	long flags = NorthWestGravity | (1 << 8) | (1 << 9) | (1 << 10) | (1 << 11) | (2 << 12);
+
+	if (desktop >= 0)
+		send_root_message (display, window, "_NET_WM_DESKTOP", desktop, 2, 0, 0, 0);
+	if (width > 0 && height > 0)
+		send_root_message (display, window, "_NET_MOVERESIZE_WINDOW", flags, x, y, width, height);
+	XFlush (display);
+}
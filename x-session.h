@@ -0,0 +1,47 @@
+/**
+ * Copyright (c) 2011-2013 Fabrice THIROUX <fabrice.thiroux@free.fr> (GPL-3+).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or any
+ * later version. See http://www.gnu.org/copyleft/gpl.html the full text
+ * of the license.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _X_SESSION_H
+#define _X_SESSION_H
+
+#include <glib.h>
+#include <X11/Xlib.h>
+
+/* EWMH helpers */
+extern Window *x_get_clients (Display *, gulong *);
+extern pid_t x_get_pid (Display *, Window);
+extern gchar *x_get_name (Display *, Window);
+extern gchar *x_get_wm_name (Display *);
+
+/* Logout: the windows still there, or NULL, to free */
+typedef void (*XClientsClosed) (gchar **, gpointer);
+
+extern void x_close_clients (gint, XClientsClosed, gpointer);
+extern gboolean x_wm_exit (Display *);
+
+/* Session snapshot: per process, its argv, working directory and windows
+ * (WM_CLASS, desktop or -1, frame position and client size). */
+#define SESSION_SNAPSHOT "session.snapshot"
+#define SESSION_SNAPSHOT_TYPE "a(assa(siiiii))"
+
+extern GVariant *x_session_snapshot (Display *);
+extern gchar *x_get_class (Display *, Window);
+extern void x_place_window (Display *, Window, gint, gint, gint, gint, gint);
+
+#endif
@@ -0,0 +1,850 @@
+/**
+ * Copyright (c) 2011-2013 Fabrice THIROUX <fabrice.thiroux@free.fr> (GPL-3+).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or any
+ * later version. See http://www.gnu.org/copyleft/gpl.html the full text
+ * of the license.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Start the programs of the autostart directories (Desktop Application
+ * Autostart Specification), several at once. At most "concurrency" of
+ * them are starting at the same time: a program holds its slot until it
+ * exits or "settle" ms passed. While starting, programs get a low I/O
+ * priority so that the first ones are not slowed down by the others.
+ *
+ * The .desktop files are only parsed when an autostart directory changed:
+ * the entries to start, already resolved, are kept in an index in
+ * $XDG_CACHE_HOME/obsession (a GVariant, read from a mapped file).
+ *
+ * Afterwards it stays a little to see the first window of each program,
+ * for the boot chart (autostart-chart.c).
+ *
+ * With --restore, the applications saved when the last session ended
+ * (session.snapshot, see x_session_snapshot) are started too, and their
+ * windows put back in place as they map.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <glib.h>
+
+#include "config.h"
+#include "autostart-chart.h"
+#include "x-session.h"
+
+#define DEFAULT_DESKTOP "Openbox"
+#define DEFAULT_SETTLE 1000
+#define DEFAULT_CHART_TIME 10
+
+/* version, desktop, (directory, mtime)s, (id, argv, working directory, TryExec)s */
+#define INDEX_VERSION 1
+#define INDEX_TYPE "(usa(sx)a(sasss))"
+
+/* linux/ioprio.h is not installed everywhere. */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_WHO_PGRP 2
+#define IOPRIO_CLASS_NONE 0
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+
+static gint concurrency = 0;
+static gint settle = DEFAULT_SETTLE;
+static gchar *ioprio = NULL;
+static gboolean dry_run = FALSE;
+static gboolean no_index = FALSE;
+static gint chart_time = DEFAULT_CHART_TIME;
+static gboolean report = FALSE;
+static gboolean restore = FALSE;
+
+static GOptionEntry opt_entries[] = {
+	{ "concurrency", 'j', 0, G_OPTION_ARG_INT, &concurrency, "Start at most N programs at once (default: number of CPUs)", "N" },
+	{ "settle", 0, 0, G_OPTION_ARG_INT, &settle, "Time a program keeps its slot, in ms", "MS" },
+	{ "ioprio", 0, 0, G_OPTION_ARG_STRING, &ioprio, "I/O priority while starting", "idle|low|normal" },
+	{ "dry-run", 'n', 0, G_OPTION_ARG_NONE, &dry_run, "Only list the programs to start", NULL },
+	{ "rebuild", 0, 0, G_OPTION_ARG_NONE, &no_index, "Read the .desktop files again, not the index", NULL },
+	{ "chart-time", 0, 0, G_OPTION_ARG_INT, &chart_time, "Wait at most S seconds for the windows, 0 for no chart", "S" },
+	{ "report", 0, 0, G_OPTION_ARG_NONE, &report, "Show the programs which slowed the last login down", NULL },
+	{ "restore", 'r', 0, G_OPTION_ARG_NONE, &restore, "Start the applications of the last session too", NULL },
+	{ NULL }
+};
+
+static GQueue waiting = G_QUEUE_INIT;
+static guint starting = 0;
+static gint start_ioprio = 0;
+static GMainLoop *loop;
+static gboolean done = FALSE;
+
+/* For the chart */
+static GPtrArray *launched;
+static Entry *freeing;
+static gint64 start_time;
+static guint chart_source = 0;
+
+static int ioprio_set (int who, int id, int value)
+{
+	return syscall (SYS_ioprio_set, who, id, value);
+}
+
+/* In the child, before exec. The program leads a process group, so that
+ * the processes and threads it starts get their priority back with it. */
+static void child_setup (gpointer data)
+{
+	if (start_ioprio)
+	{
+		setpgid (0, 0);
+		ioprio_set (IOPRIO_WHO_PROCESS, 0, start_ioprio);
+	}
+}
+
+static void entry_free (Entry *entry)
+{
+	g_free (entry->id);
+	g_strfreev (entry->argv);
+	g_free (entry->directory);
+	if (entry->windows)
+		g_variant_unref (entry->windows);
+	g_free (entry->placed);
+	if (entry->seen)
+		g_array_free (entry->seen, TRUE);
+	g_free (entry);
+}
+
+static void start_next (void);
+
+/* The program is started (or gone): give its slot to the next one and
+ * its normal I/O priority back. */
+static void entry_settled (Entry *entry)
+{
+	if (entry->settled)
+		return;
+
+	entry->settled = TRUE;
+	entry->settled_at = g_get_monotonic_time ();
+	starting--;
+
+	if (entry->settle_source)
+		g_source_remove (entry->settle_source);
+	entry->settle_source = 0;
+
+	/* Its children may outlive it. */
+	if (start_ioprio)
+		ioprio_set (IOPRIO_WHO_PGRP, entry->pid, IOPRIO_PRIO_VALUE (IOPRIO_CLASS_NONE, 0));
+
+	freeing = entry;
+	start_next ();
+	freeing = NULL;
+}
+
+static gboolean entry_settle_timeout (gpointer data)
+{
+	Entry *entry = data;
+
+	entry->settle_source = 0;
+	entry_settled (entry);
+	return FALSE;
+}
+
+static gboolean chart_timeout (gpointer data)
+{
+	chart_source = 0;
+	g_main_loop_quit (loop);
+	return FALSE;
+}
+
+/* Every saved window of the running entries is back in place. */
+static gboolean restore_complete (void)
+{
+	guint i, j;
+
+	for (i = 0; i < launched->len; i++)
+	{
+		Entry *entry = g_ptr_array_index (launched, i);
+
+		if (entry->windows == NULL || entry->exited)
+			continue;
+		for (j = 0; j < g_variant_n_children (entry->windows); j++)
+		{
+			if (!entry->placed[j])
+				return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/* Everything started: the programs go on without us, once we know enough
+ * about them for the chart and their windows are all placed. */
+static void check_done (void)
+{
+	if (done || starting > 0 || !g_queue_is_empty (&waiting))
+		return;
+
+	if ((chart_time <= 0 || chart_complete (launched)) && (!restore || restore_complete ()))
+	{
+		done = TRUE;
+		g_main_loop_quit (loop);
+	}
+	else if (chart_source == 0)
+		chart_source = g_timeout_add_seconds (chart_time > 0 ? chart_time : DEFAULT_CHART_TIME, chart_timeout, NULL);
+}
+
+/* A window of entry is mapped. If it comes from the saved session, put it
+ * back where it was: the first saved window of the same class, or else the
+ * first one left. */
+static void entry_window (Entry *entry, Display *display, Window window)
+{
+	gchar *class;
+	guint i, n, pass;
+
+	if (entry->seen == NULL)
+		entry->seen = g_array_new (FALSE, FALSE, sizeof(Window));
+	for (i = 0; i < entry->seen->len; i++)
+	{
+		if (g_array_index (entry->seen, Window, i) == window)
+			return;
+	}
+	g_array_append_val (entry->seen, window);
+
+	if (entry->windows)
+	{
+		class = x_get_class (display, window);
+		n = g_variant_n_children (entry->windows);
+
+		for (pass = 0; pass < 2; pass++)
+		{
+			for (i = 0; i < n; i++)
+			{
+				const gchar *saved_class;
+				gint desktop, x, y, width, height;
+
+				if (entry->placed[i])
+					continue;
+
+				g_variant_get_child (entry->windows, i, "(&siiiii)", &saved_class, &desktop, &x, &y, &width, &height);
+				if (pass == 0 && g_strcmp0 (class, saved_class) != 0)
+					continue;
+
+				x_place_window (display, window, desktop, x, y, width, height);
+				entry->placed[i] = TRUE;
+				pass = 2;
+				break;
+			}
+		}
+		g_free (class);
+	}
+
+	check_done ();
+}
+
+static void entry_exited (GPid pid, gint status, gpointer data)
+{
+	Entry *entry = data;
+
+	g_spawn_close_pid (pid);
+	entry->exited = g_get_monotonic_time ();
+	entry->status = WIFEXITED (status) ? WEXITSTATUS (status) : 128 + WTERMSIG (status);
+	g_debug ("%s exited after %" G_GINT64_FORMAT " ms", entry->id,
+	         (entry->exited - entry->started) / G_TIME_SPAN_MILLISECOND);
+
+	entry_settled (entry);
+	check_done ();
+}
+
+static void start_next (void)
+{
+	while (starting < (guint) concurrency && !g_queue_is_empty (&waiting))
+	{
+		Entry *entry = g_queue_pop_head (&waiting);
+		GError *error = NULL;
+
+		entry->started = g_get_monotonic_time ();
+		entry->after = freeing;
+		starting++;
+
+		if (g_spawn_async (entry->directory, entry->argv, NULL,
+		                   G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD,
+		                   child_setup, NULL, &entry->pid, &error))
+		{
+			/* Also from here, before its priority is given back. */
+			if (start_ioprio)
+				setpgid (entry->pid, entry->pid);
+			g_child_watch_add (entry->pid, entry_exited, entry);
+		}
+		else
+		{
+			g_warning ("Can't start %s: %s", entry->id, error->message);
+			g_error_free (error);
+			entry->pid = 0;
+		}
+
+		/* Nothing to wait for if it didn't start. */
+		if (entry->pid == 0)
+		{
+			entry->settled = TRUE;
+			starting--;
+			entry_free (entry);
+			continue;
+		}
+
+		entry->index = launched->len;
+		g_ptr_array_add (launched, entry);
+		entry->settle_source = g_timeout_add (settle, entry_settle_timeout, entry);
+	}
+
+	check_done ();
+}
+
+static GPtrArray *autostart_dirs (void)
+{
+	const gchar * const *system_dirs = g_get_system_config_dirs ();
+	GPtrArray *dirs = g_ptr_array_new_with_free_func (g_free);
+	guint i;
+
+	/* The user one first: it hides the files of the same name. */
+	g_ptr_array_add (dirs, g_build_filename (g_get_user_config_dir (), "autostart", NULL));
+	for (i = 0; system_dirs[i]; i++)
+		g_ptr_array_add (dirs, g_build_filename (system_dirs[i], "autostart", NULL));
+	return dirs;
+}
+
+/* Modification time of a directory in µs, -1 if it does not exist. Adding,
+ * removing or replacing (the way editors save) a file changes it. */
+static gint64 dir_stamp (const gchar *pathname)
+{
+	struct stat st;
+
+	if (stat (pathname, &st) < 0)
+		return -1;
+	return (gint64) st.st_mtim.tv_sec * G_USEC_PER_SEC + st.st_mtim.tv_nsec / 1000;
+}
+
+static gboolean in_list (GKeyFile *kf, const gchar *key, const gchar *desktop)
+{
+	gchar **list = g_key_file_get_string_list (kf, G_KEY_FILE_DESKTOP_GROUP, key, NULL, NULL);
+	gboolean found = FALSE;
+	guint i;
+
+	for (i = 0; list && list[i]; i++)
+	{
+		if (g_strcmp0 (list[i], desktop) == 0)
+			found = TRUE;
+	}
+	g_strfreev (list);
+	return found;
+}
+
+/* Exec line to argv. There is nothing to open at login, so the file and
+ * URL field codes go away. */
+static gchar **expand_exec (GKeyFile *kf, const gchar *pathname)
+{
+	gchar *exec = g_key_file_get_string (kf, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_EXEC, NULL);
+	gchar **args = NULL;
+	GPtrArray *argv;
+	guint i;
+
+	if (exec == NULL || !g_shell_parse_argv (exec, NULL, &args, NULL))
+	{
+		g_free (exec);
+		return NULL;
+	}
+	g_free (exec);
+
+	argv = g_ptr_array_new ();
+	if (g_key_file_get_boolean (kf, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_TERMINAL, NULL))
+	{
+		gchar *terminal = g_find_program_in_path ("x-terminal-emulator");
+
+		g_ptr_array_add (argv, terminal ? terminal : g_strdup ("xterm"));
+		g_ptr_array_add (argv, g_strdup ("-e"));
+	}
+
+	for (i = 0; args[i]; i++)
+	{
+		GString *arg;
+		const gchar *p;
+
+		if (g_strcmp0 (args[i], "%i") == 0)
+		{
+			gchar *icon = g_key_file_get_string (kf, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_ICON, NULL);
+
+			if (icon)
+			{
+				g_ptr_array_add (argv, g_strdup ("--icon"));
+				g_ptr_array_add (argv, icon);
+			}
+			continue;
+		}
+
+		arg = g_string_new (NULL);
+		for (p = args[i]; *p; p++)
+		{
+			if (*p != '%' || p[1] == '\0')
+			{
+				g_string_append_c (arg, *p);
+				continue;
+			}
+
+			switch (*++p)
+			{
+				case '%':
+					g_string_append_c (arg, '%');
+					break;
+				case 'c':
+				{
+					gchar *name = g_key_file_get_locale_string (kf, G_KEY_FILE_DESKTOP_GROUP,
+					                                            G_KEY_FILE_DESKTOP_KEY_NAME, NULL, NULL);
+					if (name)
+						g_string_append (arg, name);
+					g_free (name);
+					break;
+				}
+				case 'k':
+					g_string_append (arg, pathname);
+					break;
+				default:
+					/* %f %F %u %U and the deprecated ones */
+					break;
+			}
+		}
+
+		/* An argument that was only a field code */
+		if (arg->len > 0 || args[i][0] != '%')
+			g_ptr_array_add (argv, g_string_free (arg, FALSE));
+		else
+			g_string_free (arg, TRUE);
+	}
+	g_strfreev (args);
+
+	if (argv->len == 0)
+	{
+		g_ptr_array_free (argv, TRUE);
+		return NULL;
+	}
+	g_ptr_array_add (argv, NULL);
+	return (gchar **) g_ptr_array_free (argv, FALSE);
+}
+
+/* Should this .desktop file be started in desktop? Return the resolved
+ * entry, (id, argv, working directory, TryExec), or NULL. TryExec depends
+ * on what is installed, not on the file: it is checked at each start. */
+static GVariant *entry_resolve (const gchar *id, const gchar *pathname, const gchar *desktop)
+{
+	GKeyFile *kf = g_key_file_new ();
+	GVariant *entry = NULL;
+	gchar *type = NULL, *directory = NULL, *try_exec = NULL;
+	gchar **argv = NULL;
+
+	if (!g_key_file_load_from_file (kf, pathname, G_KEY_FILE_NONE, NULL))
+		goto out;
+
+	type = g_key_file_get_string (kf, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_TYPE, NULL);
+	if (g_strcmp0 (type, G_KEY_FILE_DESKTOP_TYPE_APPLICATION) != 0 ||
+	    g_key_file_get_boolean (kf, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_HIDDEN, NULL) ||
+	    (g_key_file_has_key (kf, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_ONLY_SHOW_IN, NULL) &&
+	     !in_list (kf, G_KEY_FILE_DESKTOP_KEY_ONLY_SHOW_IN, desktop)) ||
+	    in_list (kf, G_KEY_FILE_DESKTOP_KEY_NOT_SHOW_IN, desktop) ||
+	    (g_key_file_has_key (kf, G_KEY_FILE_DESKTOP_GROUP, "X-GNOME-Autostart-enabled", NULL) &&
+	     !g_key_file_get_boolean (kf, G_KEY_FILE_DESKTOP_GROUP, "X-GNOME-Autostart-enabled", NULL)))
+		goto out;
+
+	argv = expand_exec (kf, pathname);
+	if (argv == NULL)
+	{
+		g_warning ("%s: no valid Exec line", pathname);
+		goto out;
+	}
+
+	directory = g_key_file_get_string (kf, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_PATH, NULL);
+	try_exec = g_key_file_get_string (kf, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_TRY_EXEC, NULL);
+	entry = g_variant_new ("(s^ass)", id, argv, directory ? directory : "", try_exec ? try_exec : "");
+
+out:
+	g_strfreev (argv);
+	g_free (type);
+	g_free (directory);
+	g_free (try_exec);
+	g_key_file_free (kf);
+	return entry;
+}
+
+/* Read every .desktop file of dirs. */
+static GVariant *index_build (const gchar *desktop, GPtrArray *dirs)
+{
+	GHashTable *seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	GVariantBuilder stamps, entries;
+	guint i;
+
+	g_variant_builder_init (&stamps, G_VARIANT_TYPE ("a(sx)"));
+	g_variant_builder_init (&entries, G_VARIANT_TYPE ("a(sasss)"));
+
+	for (i = 0; i < dirs->len; i++)
+	{
+		const gchar *dirname = g_ptr_array_index (dirs, i);
+		GDir *dir;
+		const gchar *name;
+
+		/* Before reading it: a file added meanwhile makes the next
+		 * login rebuild the index, not miss the file. */
+		g_variant_builder_add (&stamps, "(sx)", dirname, dir_stamp (dirname));
+
+		dir = g_dir_open (dirname, 0, NULL);
+		if (dir == NULL)
+			continue;
+
+		while ((name = g_dir_read_name (dir)) != NULL)
+		{
+			gchar *pathname;
+			GVariant *entry;
+
+			if (!g_str_has_suffix (name, ".desktop") || g_hash_table_contains (seen, name))
+				continue;
+			g_hash_table_add (seen, g_strdup (name));
+
+			pathname = g_build_filename (dirname, name, NULL);
+			entry = entry_resolve (name, pathname, desktop);
+			if (entry)
+				g_variant_builder_add_value (&entries, entry);
+			g_free (pathname);
+		}
+		g_dir_close (dir);
+	}
+
+	g_hash_table_destroy (seen);
+	return g_variant_ref_sink (g_variant_new ("(usa(sx)a(sasss))", INDEX_VERSION, desktop, &stamps, &entries));
+}
+
+static gchar *index_pathname (const gchar *desktop)
+{
+	gchar *basename = g_strconcat ("autostart-", desktop, ".index", NULL);
+	gchar *pathname = g_build_filename (g_get_user_cache_dir (), "obsession", basename, NULL);
+
+	g_free (basename);
+	return pathname;
+}
+
+/* Return the index if it is still valid: same format, same desktop and
+ * none of the directories changed. */
+static GVariant *index_load (const gchar *pathname, const gchar *desktop, GPtrArray *dirs)
+{
+	GMappedFile *file = g_mapped_file_new (pathname, FALSE, NULL);
+	GBytes *bytes;
+	GVariant *index, *stamps;
+	const gchar *index_desktop;
+	guint32 version;
+	gboolean valid = TRUE;
+	guint i;
+
+	if (file == NULL)
+		return NULL;
+
+	/* Not trusted: a damaged file only gives a stale index. */
+	bytes = g_mapped_file_get_bytes (file);
+	index = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (INDEX_TYPE), bytes, FALSE));
+	g_bytes_unref (bytes);
+	g_mapped_file_unref (file);
+
+	g_variant_get (index, "(u&s@a(sx)@a(sasss))", &version, &index_desktop, &stamps, NULL);
+	if (version != INDEX_VERSION || g_strcmp0 (index_desktop, desktop) != 0 ||
+	    g_variant_n_children (stamps) != dirs->len)
+		valid = FALSE;
+
+	for (i = 0; valid && i < dirs->len; i++)
+	{
+		const gchar *dirname;
+		gint64 stamp;
+
+		g_variant_get_child (stamps, i, "(&sx)", &dirname, &stamp);
+		valid = g_strcmp0 (dirname, g_ptr_array_index (dirs, i)) == 0 &&
+		        stamp == dir_stamp (dirname);
+	}
+	g_variant_unref (stamps);
+
+	if (!valid)
+	{
+		g_variant_unref (index);
+		return NULL;
+	}
+	return index;
+}
+
+static void index_save (const gchar *pathname, GVariant *index)
+{
+	gchar *dirname = g_path_get_dirname (pathname);
+	GError *error = NULL;
+
+	g_mkdir_with_parents (dirname, 0700);
+	if (!g_file_set_contents (pathname, g_variant_get_data (index), g_variant_get_size (index), &error))
+	{
+		g_warning ("Can't save the index: %s", error->message);
+		g_error_free (error);
+	}
+	g_free (dirname);
+}
+
+/* The autostart entries, from the index or from the .desktop files. */
+static GVariant *get_index (const gchar *desktop)
+{
+	GPtrArray *dirs = autostart_dirs ();
+	gchar *pathname = index_pathname (desktop);
+	GVariant *index = no_index ? NULL : index_load (pathname, desktop, dirs);
+
+	if (index == NULL)
+	{
+		g_debug ("Rebuilding %s", pathname);
+		index = index_build (desktop, dirs);
+		if (!dry_run)
+			index_save (pathname, index);
+	}
+
+	g_free (pathname);
+	g_ptr_array_free (dirs, TRUE);
+	return index;
+}
+
+static gboolean can_exec (const gchar *try_exec)
+{
+	gchar *program;
+
+	if (*try_exec == '\0')
+		return TRUE;
+	if (g_path_is_absolute (try_exec))
+		return g_file_test (try_exec, G_FILE_TEST_IS_EXECUTABLE);
+
+	program = g_find_program_in_path (try_exec);
+	g_free (program);
+	return program != NULL;
+}
+
+static void collect_entries (const gchar *desktop)
+{
+	GVariant *index = get_index (desktop);
+	GVariantIter *iter;
+	const gchar *id, *directory, *try_exec;
+	gchar **argv;
+
+	g_variant_get (index, "(usa(sx)a(sasss))", NULL, NULL, NULL, &iter);
+	while (g_variant_iter_next (iter, "(&s^as&s&s)", &id, &argv, &directory, &try_exec))
+	{
+		Entry *entry;
+
+		if (!can_exec (try_exec))
+		{
+			g_strfreev (argv);
+			continue;
+		}
+
+		entry = g_new0 (Entry, 1);
+		entry->id = g_strdup (id);
+		entry->argv = argv;
+		entry->directory = *directory ? g_strdup (directory) : NULL;
+		g_queue_push_tail (&waiting, entry);
+	}
+
+	g_variant_iter_free (iter);
+	g_variant_unref (index);
+}
+
+/* Command lines of our processes, to not start an application twice. */
+static GHashTable *running_commands (void)
+{
+	GHashTable *commands = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	GDir *dir = g_dir_open ("/proc", 0, NULL);
+	const gchar *name;
+
+	if (dir == NULL)
+		return commands;
+
+	while ((name = g_dir_read_name (dir)) != NULL)
+	{
+		gchar *pathname, *cmdline = NULL;
+		gsize length, i;
+		struct stat st;
+
+		if (!g_ascii_isdigit (name[0]))
+			continue;
+
+		pathname = g_build_filename ("/proc", name, "cmdline", NULL);
+		if (stat (pathname, &st) == 0 && st.st_uid == getuid () &&
+		    g_file_get_contents (pathname, &cmdline, &length, NULL) && length > 1)
+		{
+			/* NUL separated arguments, as joined by g_strjoinv */
+			for (i = 0; i < length - 1; i++)
+			{
+				if (cmdline[i] == '\0')
+					cmdline[i] = ' ';
+			}
+			g_hash_table_add (commands, cmdline);
+			cmdline = NULL;
+		}
+		g_free (cmdline);
+		g_free (pathname);
+	}
+
+	g_dir_close (dir);
+	return commands;
+}
+
+/* Queue the applications of the last session after the autostart ones,
+ * unless they are already there. */
+static void collect_snapshot (void)
+{
+	gchar *pathname = g_build_filename (g_get_user_cache_dir (), "obsession", SESSION_SNAPSHOT, NULL);
+	GMappedFile *file = g_mapped_file_new (pathname, FALSE, NULL);
+	GHashTable *commands;
+	GBytes *bytes;
+	GVariant *snapshot, *windows;
+	GVariantIter iter;
+	const gchar *directory;
+	gchar **argv;
+	GList *l;
+
+	g_free (pathname);
+	if (file == NULL)
+		return;
+
+	bytes = g_mapped_file_get_bytes (file);
+	snapshot = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (SESSION_SNAPSHOT_TYPE), bytes, FALSE));
+	g_bytes_unref (bytes);
+	g_mapped_file_unref (file);
+
+	commands = running_commands ();
+	for (l = waiting.head; l; l = l->next)
+		g_hash_table_add (commands, g_strjoinv (" ", ((Entry *) l->data)->argv));
+
+	g_variant_iter_init (&iter, snapshot);
+	while (g_variant_iter_next (&iter, "(^as&s@a(siiiii))", &argv, &directory, &windows))
+	{
+		gchar *command = g_strjoinv (" ", argv);
+		Entry *entry;
+
+		if (argv[0] == NULL || g_hash_table_contains (commands, command))
+		{
+			g_free (command);
+			g_strfreev (argv);
+			g_variant_unref (windows);
+			continue;
+		}
+		g_hash_table_add (commands, command);
+
+		entry = g_new0 (Entry, 1);
+		entry->id = g_path_get_basename (argv[0]);
+		entry->argv = argv;
+		entry->directory = *directory ? g_strdup (directory) : NULL;
+		entry->windows = windows;
+		entry->placed = g_new0 (gboolean, g_variant_n_children (windows));
+		g_queue_push_tail (&waiting, entry);
+	}
+
+	g_hash_table_destroy (commands);
+	g_variant_unref (snapshot);
+}
+
+/* Defaults from the Autostart group of obsession.conf. */
+static void load_config (void)
+{
+	gchar *pathname = g_build_filename (g_get_user_config_dir (), "obsession.conf", NULL);
+	GKeyFile *kf = g_key_file_new ();
+
+	if (g_key_file_load_from_file (kf, pathname, G_KEY_FILE_NONE, NULL))
+	{
+		if (g_key_file_has_key (kf, "Autostart", "concurrency", NULL))
+			concurrency = g_key_file_get_integer (kf, "Autostart", "concurrency", NULL);
+		if (g_key_file_has_key (kf, "Autostart", "settle", NULL))
+			settle = g_key_file_get_integer (kf, "Autostart", "settle", NULL);
+		if (g_key_file_has_key (kf, "Autostart", "chart_time", NULL))
+			chart_time = g_key_file_get_integer (kf, "Autostart", "chart_time", NULL);
+		restore = g_key_file_get_boolean (kf, "Autostart", "restore", NULL);
+		ioprio = g_key_file_get_string (kf, "Autostart", "ioprio", NULL);
+	}
+
+	g_key_file_free (kf);
+	g_free (pathname);
+}
+
+int main (int argc, char *argv[])
+{
+	const gchar *desktop = DEFAULT_DESKTOP;
+	GOptionContext *context;
+	GError *error = NULL;
+	GList *l;
+
+	load_config ();
+
+	context = g_option_context_new ("[desktop-environment]");
+	g_option_context_add_main_entries (context, opt_entries, PACKAGE " " PACKAGE_VERSION);
+	if (!g_option_context_parse (context, &argc, &argv, &error))
+	{
+		g_print ("%s\n", error->message);
+		g_error_free (error);
+		return 1;
+	}
+	g_option_context_free (context);
+
+	if (report)
+		return chart_report () ? 0 : 1;
+
+	if (argc > 1)
+		desktop = argv[1];
+
+	if (concurrency <= 0)
+		concurrency = MAX (1, sysconf (_SC_NPROCESSORS_ONLN));
+
+	if (g_strcmp0 (ioprio, "idle") == 0)
+		start_ioprio = IOPRIO_PRIO_VALUE (IOPRIO_CLASS_IDLE, 0);
+	else if (g_strcmp0 (ioprio, "normal") != 0)
+		start_ioprio = IOPRIO_PRIO_VALUE (IOPRIO_CLASS_BE, 7);
+
+	collect_entries (desktop);
+	if (restore)
+		collect_snapshot ();
+
+	if (dry_run)
+	{
+		for (l = waiting.head; l; l = l->next)
+		{
+			Entry *entry = l->data;
+			gchar *command = g_strjoinv (" ", entry->argv);
+
+			g_print ("%s: %s\n", entry->id, command);
+			g_free (command);
+		}
+		return 0;
+	}
+
+	if (g_queue_is_empty (&waiting))
+		return 0;
+
+	loop = g_main_loop_new (NULL, FALSE);
+	launched = g_ptr_array_new_with_free_func ((GDestroyNotify) entry_free);
+	if (chart_time > 0 || restore)
+		chart_watch (launched, entry_window);
+
+	start_time = g_get_monotonic_time ();
+	start_next ();
+
+	/* Stay until the programs are all settled: the last ones may still
+	 * have a low I/O priority to give back. */
+	if (!done)
+		g_main_loop_run (loop);
+
+	if (chart_time > 0)
+		chart_save (desktop, start_time, launched);
+
+	g_ptr_array_free (launched, TRUE);
+	return 0;
+}